@@ -1,229 +1,550 @@
-/* 
-This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
-
-Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
-
-    This program is free software: you can redistribute it and/or modify
-    it under the terms of the GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    This program is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU General Public License for more details.
-
-    You should have received a copy of the GNU General Public License
-    along with this program.  If not, see <http://www.gnu.org/licenses/>.
- */
-
-/* This is Ecf.h, the public header file for the 2003 version of the
-   ECF library. */
-
-#ifndef _GCI_ECF
-#define _GCI_ECF
-
-/* #defines which are publically needed */
-
-typedef enum { NOISE_CONST, NOISE_GIVEN, NOISE_POISSON_DATA,
-	       NOISE_POISSON_FIT, NOISE_GAUSSIAN_FIT, NOISE_MLE } noise_type;
-
-typedef enum { FIT_GLOBAL_MULTIEXP, FIT_GLOBAL_STRETCHEDEXP } fit_type;
-
-typedef enum { ECF_RESTRAIN_DEFAULT, ECF_RESTRAIN_USER } restrain_type;
-
-/* Single transient analysis functions */
-
-// the next fn uses GCI_triple_integral_*() to fit repeatedly until chisq_target is met
-int GCI_triple_integral_fitting_engine(float xincr, float y[], int fit_start, int fit_end,
-							  float instr[], int ninstr, noise_type noise, float sig[],
-							  float *Z, float *A, float *tau, float *fitted, float *residuals,
-							  float *chisq, float chisq_target);
-// the next fn uses GCI_marquardt_instr() to fit repeatedly until chisq_target is met
-int GCI_marquardt_fitting_engine(float xincr, float *trans, int ndata, int fit_start, int fit_end, 
-						float prompt[], int nprompt,
-						noise_type noise, float sig[],
-						float param[], int paramfree[],
-					   int nparam, restrain_type restrain,
-					   void (*fitfunc)(float, float [], float *, float [], int),
-					   float *fitted, float *residuals, float *chisq,
-					   float **covar, float **alpha, float **erraxes,
-					   float chisq_target, float chisq_delta, int chisq_percent);
-
-int GCI_triple_integral(float xincr, float y[],
-						int fit_start, int fit_end,
-						noise_type noise, float sig[],
-						float *Z, float *A, float *tau,
-						float *fitted, float *residuals,
-						float *chisq, int division);
-int GCI_triple_integral_instr(float xincr, float y[],
-							  int fit_start, int fit_end,
-							  float instr[], int ninstr,
-							  noise_type noise, float sig[],
-							  float *Z, float *A, float *tau,
-							  float *fitted, float *residuals,
-							  float *chisq, int division);
-
-int GCI_marquardt(float x[], float y[], int ndata,
-				  noise_type noise, float sig[],
-				  float param[], int paramfree[], int nparam,
-				  restrain_type restrain,
-				  void (*fitfunc)(float, float [], float *, float [], int),
-				  float *fitted, float *residuals,
-				  float **covar, float **alpha, float *chisq,
-				  float chisq_delta, float chisq_percent, float **erraxes);
-int GCI_marquardt_instr(float xincr, float y[],
-					int ndata, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[],
-					float param[], int paramfree[], int nparam,
-					restrain_type restrain,
-					void (*fitfunc)(float, float [], float *, float [], int),
-					float *fitted, float *residuals,
-					float **covar, float **alpha, float *chisq,
-					float chisq_delta, float chisq_percent, float **erraxes);
-void GCI_marquardt_cleanup(void);
-
-/* Global analysis analysis functions */
-
-int GCI_marquardt_global_exps_instr(float xincr, float **trans,
-					int ndata, int ntrans, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[], int ftype,
-					float **param, int paramfree[], int nparam,
-					restrain_type restrain, float chisq_delta, 
-					float **fitted, float **residuals,
-					float chisq_trans[], float *chisq_global, int *df,
-					int drop_bad_transients);
-int GCI_marquardt_global_generic_instr(float xincr, float **trans,
-					int ndata, int ntrans, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[],
-					float **param, int paramfree[], int nparam, int gparam[],
-					restrain_type restrain, float chisq_delta, 
-					void (*fitfunc)(float, float [], float *, float [], int),
-					float **fitted, float **residuals,
-					float chisq_trans[], float *chisq_global, int *df);
-
-/* Support plane analysis functions */
-
-int GCI_SPA_1D_marquardt(
-				float x[], float y[], int ndata,
-				noise_type noise, float sig[],
-				float param[], int paramfree[], int nparam,
-				restrain_type restrain, float chisq_delta,
-				void (*fitfunc)(float, float [], float *, float [], int),
-				int spa_param, int spa_nvalues,
-				float spa_low, float spa_high,
-				float chisq[], void (*progressfunc)(float));
-int GCI_SPA_2D_marquardt(
-				float x[], float y[], int ndata,
-				noise_type noise, float sig[],
-				float param[], int paramfree[], int nparam,
-				restrain_type restrain, float chisq_delta,
-				void (*fitfunc)(float, float [], float *, float [], int),
-				int spa_param1, int spa_nvalues1,
-				float spa_low1, float spa_high1,
-				int spa_param2, int spa_nvalues2,
-				float spa_low2, float spa_high2,
-				float **chisq, void (*progressfunc)(float));
-int GCI_SPA_1D_marquardt_instr(
-				float xincr, float y[],
-				int ndata, int fit_start, int fit_end,
-				float instr[], int ninstr,
-				noise_type noise, float sig[],
-				float param[], int paramfree[], int nparam,
-				restrain_type restrain, float chisq_delta,
-				void (*fitfunc)(float, float [], float *, float [], int),
-				int spa_param, int spa_nvalues,
-				float spa_low, float spa_high,
-				float chisq[], float chisq_target, void (*progressfunc)(float));
-int GCI_SPA_2D_marquardt_instr(
-				float xincr, float y[],
-				int ndata, int fit_start, int fit_end,
-				float instr[], int ninstr,
-				noise_type noise, float sig[],
-				float param[], int paramfree[], int nparam,
-				restrain_type restrain, float chisq_delta,
-				void (*fitfunc)(float, float [], float *, float [], int),
-				int spa_param1, int spa_nvalues1,
-				float spa_low1, float spa_high1,
-				int spa_param2, int spa_nvalues2,
-				float spa_low2, float spa_high2,
-				float **chisq, float chisq_target, void (*progressfunc)(float));
-int GCI_SPA_1D_marquardt_global_exps_instr(
-					float xincr, float **trans,
-					int ndata, int ntrans, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[], int ftype,
-					float **param, int paramfree[], int nparam,
-					restrain_type restrain, float chisq_delta, int drop_bad_transients,
-					int spa_param, int spa_nvalues,
-					float spa_low, float spa_high,
-					float chisq_global[], int df[], void (*progressfunc)(float));
-int GCI_SPA_2D_marquardt_global_exps_instr(
-					float xincr, float **trans,
-					int ndata, int ntrans, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[], int ftype,
-					float **param, int paramfree[], int nparam,
-					restrain_type restrain, float chisq_delta, int drop_bad_transients,
-					int spa_param1, int spa_nvalues1,
-					float spa_low1, float spa_high1,
-					int spa_param2, int spa_nvalues2,
-					float spa_low2, float spa_high2,
-					float **chisq_global, int **df, void (*progressfunc)(float));
-int GCI_SPA_1D_marquardt_global_generic_instr(
-					float xincr, float **trans,
-					int ndata, int ntrans, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[],
-					float **param, int paramfree[], int nparam, int gparam[],
-					restrain_type restrain, float chisq_delta,
-					void (*fitfunc)(float, float [], float *, float [], int),
-					int spa_param, int spa_nvalues,
-					float spa_low, float spa_high,
-					float chisq_global[], int df[], void (*progressfunc)(float));
-int GCI_SPA_2D_marquardt_global_generic_instr(
-					float xincr, float **trans,
-					int ndata, int ntrans, int fit_start, int fit_end,
-					float instr[], int ninstr,
-					noise_type noise, float sig[],
-					float **param, int paramfree[], int nparam, int gparam[],
-					restrain_type restrain, float chisq_delta,
-					void (*fitfunc)(float, float [], float *, float [], int),
-					int spa_param1, int spa_nvalues1,
-					float spa_low1, float spa_high1,
-					int spa_param2, int spa_nvalues2,
-					float spa_low2, float spa_high2,
-					float **chisq_global, int **df, void (*progressfunc)(float));
-
-/* Setting restraints */
-
-int GCI_set_restrain_limits(int nparam, int restrain[],
-							float minval[], float maxval[]);
-
-/* Predefined fitting models */
-
-void GCI_multiexp_lambda(float x, float param[],
-			 float *y, float dy_dparam[], int nparam);
-void GCI_multiexp_tau(float x, float param[],
-		      float *y, float dy_dparam[], int nparam);
-void GCI_stretchedexp(float x, float param[],
-		      float *y, float dy_dparam[], int nparam);
-
-/* Utility functions */
-float **GCI_ecf_matrix(long nrows, long ncols);
-void GCI_ecf_free_matrix(float **m);
-
-void ECF_ExportParams_start (char path[]);
-void ECF_ExportParams_stop (void);
-
-#endif /* _GCI_ECF */
-
-// Emacs settings:
-// Local variables:
-// mode: c
-// c-basic-offset: 4
-// tab-width: 4
-// End:
+/* 
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This is Ecf.h, the public header file for the 2003 version of the
+   ECF library. */
+
+#ifndef _GCI_ECF
+#define _GCI_ECF
+
+/* #defines which are publically needed */
+
+typedef enum { NOISE_CONST, NOISE_GIVEN, NOISE_POISSON_DATA,
+	       NOISE_POISSON_FIT, NOISE_GAUSSIAN_FIT, NOISE_MLE } noise_type;
+
+typedef enum { FIT_GLOBAL_MULTIEXP, FIT_GLOBAL_STRETCHEDEXP } fit_type;
+
+typedef enum { ECF_RESTRAIN_DEFAULT, ECF_RESTRAIN_USER } restrain_type;
+
+typedef enum { ECF_ACCURACY_LIBM, ECF_ACCURACY_FAST } accuracy_type;
+
+typedef enum { ECF_METHOD_MARQUARDT, ECF_METHOD_VARPRO } method_type;
+
+typedef enum { ECF_BIN_SQUARE, ECF_BIN_CIRCLE } ecf_bin_shape;
+
+/* Working space for the fitting functions; create one per thread with
+   GCI_ecf_workspace() and pass it to the _ws variants below, so that
+   repeated fits do not allocate any memory. */
+typedef struct ecf_workspace ecf_workspace;
+
+/* User-defined limits on the fitted parameters, used by fits with
+   ECF_RESTRAIN_USER; see GCI_ecf_restraint() below. */
+typedef struct ecf_restraint ecf_restraint;
+
+/* A record of the fits in a workspace, step by step; see GCI_ecf_trace()
+   below.  Each record is one step of one fit, after the step: iteration
+   0 is the first step, which also sets the fit up (with
+   ECF_METHOD_VARPRO, the initial linear fit), and accepted says whether
+   the step reduced chi-squared (otherwise param[] is unchanged and
+   alambda has gone up).  fit counts the calls of the Marquardt
+   functions, so each refit of GCI_marquardt_fitting_engine() has its own
+   number. */
+#define ECF_TRACE_MAXPARAM 20
+
+typedef struct {
+	int fit;
+	int iteration;
+	int accepted;
+	int nparam;
+	float chisq;
+	float alambda;
+	float param[ECF_TRACE_MAXPARAM];
+} ecf_trace_record;
+
+typedef void (*ecf_trace_callback)(const ecf_trace_record *record, void *user);
+
+typedef enum { ECF_TRACE_CSV, ECF_TRACE_BINARY } ecf_trace_format;
+
+typedef struct ecf_trace ecf_trace;
+
+/* A lookup table of single exponential lifetimes for one prompt, bin
+   width and fit range; see GCI_ecf_lut() below */
+typedef struct ecf_lut ecf_lut;
+
+/* How a fit went; see GCI_ecf_set_workspace_stats() below.  The counts
+   cover all of the refits of GCI_marquardt_fitting_engine().
+   lambda_increases includes the rejected steps and, with
+   ECF_METHOD_VARPRO, the steps retried because they went out of bounds.
+   alambda is its value after the last step before the fit converged.
+   cycles is the time taken, in CPU timestamp counter cycles on x86 or in
+   clock() ticks elsewhere. */
+typedef enum { ECF_EXIT_CONVERGED,      /* and chisq_target was met */
+			   ECF_EXIT_TARGET_MISSED,  /* converged, chisq_target not met */
+			   ECF_EXIT_MAXITERS,       /* ran out of iterations */
+			   ECF_EXIT_SOLVER,         /* a step could not be solved for */
+			   ECF_EXIT_ERROR,          /* bad arguments or out of memory */
+			   ECF_EXIT_NREASONS } ecf_exit_reason;
+
+typedef struct {
+	int fn_evals;           /* evaluations of the fitting model */
+	int iterations;         /* Marquardt steps */
+	int accepted;           /* steps which reduced chi-squared */
+	int rejected;           /* steps which did not */
+	int lambda_increases;
+	int refits;             /* restarts to approach chisq_target */
+	float alambda;
+	float chisq;            /* final chi-squared */
+	int ndf;                /* degrees of freedom of the fit */
+	ecf_exit_reason exit;
+	double cycles;
+} ecf_fit_stats;
+
+/* The statistics of many fits.  The totals are sums over all the fits;
+   the histograms of fn_evals, iterations and cycles have power of two
+   bins, bin b counting the values from 2^(b-1) up to 2^b (bin 0 the
+   zeros), the refits histogram counts each number of refits, and the
+   chisq histogram has bins of reduced chi-squared 1/8 wide.  The last
+   bin of each takes everything larger. */
+#define ECF_STATS_NBINS 48
+#define ECF_STATS_CHISQ_BINS_PER_UNIT 8
+
+typedef struct {
+	int nfits;
+	int exits[ECF_EXIT_NREASONS];
+	double fn_evals, iterations, accepted, rejected, lambda_increases,
+		refits, cycles;
+	int fn_evals_hist[ECF_STATS_NBINS];
+	int iterations_hist[ECF_STATS_NBINS];
+	int refits_hist[ECF_STATS_NBINS];
+	int cycles_hist[ECF_STATS_NBINS];
+	int chisq_hist[ECF_STATS_NBINS];
+} ecf_stats_summary;
+
+/* Single transient analysis functions */
+
+// the next fn uses GCI_triple_integral_*() to fit repeatedly until chisq_target is met
+int GCI_triple_integral_fitting_engine(float xincr, float y[], int fit_start, int fit_end,
+							  float instr[], int ninstr, noise_type noise, float sig[],
+							  float *Z, float *A, float *tau, float *fitted, float *residuals,
+							  float *chisq, float chisq_target);
+int GCI_triple_integral_fitting_engine_ws(ecf_workspace *ws, float xincr, float y[],
+							  int fit_start, int fit_end,
+							  float instr[], int ninstr, noise_type noise, float sig[],
+							  float *Z, float *A, float *tau, float *fitted, float *residuals,
+							  float *chisq, float chisq_target);
+// the next fn uses GCI_marquardt_instr() to fit repeatedly until chisq_target is met
+int GCI_marquardt_fitting_engine(float xincr, float *trans, int ndata, int fit_start, int fit_end, 
+						float prompt[], int nprompt,
+						noise_type noise, float sig[],
+						float param[], int paramfree[],
+					   int nparam, restrain_type restrain,
+					   void (*fitfunc)(float, float [], float *, float [], int),
+					   float *fitted, float *residuals, float *chisq,
+					   float **covar, float **alpha, float **erraxes,
+					   float chisq_target, float chisq_delta, int chisq_percent);
+int GCI_marquardt_fitting_engine_ws(ecf_workspace *ws, float xincr, float *trans, int ndata,
+						int fit_start, int fit_end,
+						float prompt[], int nprompt,
+						noise_type noise, float sig[],
+						float param[], int paramfree[],
+					   int nparam, restrain_type restrain,
+					   void (*fitfunc)(float, float [], float *, float [], int),
+					   float *fitted, float *residuals, float *chisq,
+					   float **covar, float **alpha, float **erraxes,
+					   float chisq_target, float chisq_delta, int chisq_percent);
+// the next fn runs GCI_marquardt_fitting_engine() on ntrans transients stored
+// contiguously in trans, using up to nthreads threads (nthreads <= 0 uses the
+// default); a prompt_stride or sig_stride of 0 shares one prompt or sigma array
+int GCI_marquardt_fitting_engine_batch(float xincr, float *trans, int ndata, int ntrans,
+						int fit_start, int fit_end,
+						float prompt[], int nprompt, int prompt_stride,
+						noise_type noise, float sig[], int sig_stride,
+						float *param, int paramfree[],
+					   int nparam, restrain_type restrain, const ecf_restraint *restraint,
+					   void (*fitfunc)(float, float [], float *, float [], int),
+					   float *fitted, float *residuals, float chisq[], int iterations[],
+					   float chisq_target, float chisq_delta, int chisq_percent,
+					   ecf_fit_stats stats[], ecf_stats_summary *summary,
+					   int nthreads);
+// the next fn fits a rows x cols image of transients (pixel r + c*rows) with
+// the batch fn, first binned into nlevels levels of 2^l x 2^l pixel bins, the
+// coarsest fitted first and each finer level started from the level above
+int GCI_marquardt_fitting_engine_pyramid(float xincr, float *trans, int ndata,
+						int rows, int cols, int nlevels,
+						int fit_start, int fit_end,
+						float prompt[], int nprompt,
+						noise_type noise, float sig[],
+						float *param, int paramfree[],
+					   int nparam, restrain_type restrain, const ecf_restraint *restraint,
+					   void (*fitfunc)(float, float [], float *, float [], int),
+					   float *fitted, float *residuals, float chisq[], int iterations[],
+					   float chisq_target, float chisq_delta, int chisq_percent,
+					   ecf_fit_stats stats[], ecf_stats_summary *summary,
+					   int nthreads);
+
+// the next fn sums each pixel of a rows x cols image of transients (pixel
+// r + c*rows) with its neighbours within radius, by summed-area tables
+int GCI_ecf_bin_image(float trans[], int ndata, int rows, int cols,
+					  int radius, ecf_bin_shape shape, float binned[]);
+
+int GCI_triple_integral(float xincr, float y[],
+						int fit_start, int fit_end,
+						noise_type noise, float sig[],
+						float *Z, float *A, float *tau,
+						float *fitted, float *residuals,
+						float *chisq, int division);
+int GCI_triple_integral_instr(float xincr, float y[],
+							  int fit_start, int fit_end,
+							  float instr[], int ninstr,
+							  noise_type noise, float sig[],
+							  float *Z, float *A, float *tau,
+							  float *fitted, float *residuals,
+							  float *chisq, int division);
+int GCI_triple_integral_instr_ws(ecf_workspace *ws, float xincr, float y[],
+							  int fit_start, int fit_end,
+							  float instr[], int ninstr,
+							  noise_type noise, float sig[],
+							  float *Z, float *A, float *tau,
+							  float *fitted, float *residuals,
+							  float *chisq, int division);
+
+// the next fns work out the phasor (g, s) of a transient at a harmonic of the
+// repetition period, divided by that of the prompt, with the phase and
+// modulation lifetimes; the batch fn does ntrans transients stored
+// contiguously in trans using up to nthreads threads
+int GCI_phasor(float xincr, float y[], int fit_start, int fit_end,
+			   float prompt[], int nprompt, float Z, float period, int harmonic,
+			   float *g, float *s, float *taup, float *taum);
+int GCI_phasor_batch(float xincr, float *trans, int ndata, int ntrans,
+					 int fit_start, int fit_end, float prompt[], int nprompt,
+					 float Z, float period, int harmonic,
+					 float g[], float s[], float taup[], float taum[],
+					 float intensity[], int nthreads);
+// the next fn makes initial estimates for a GCI_multiexp_tau() fit of one,
+// two or three components from the phasors of the transient
+int GCI_phasor_estimates(float xincr, float y[], int fit_start, int fit_end,
+						 float instr[], int ninstr, float param[], int nparam);
+// the next fns build a table, for one prompt and fit range, from which
+// single exponential fits are estimated with one interpolation; the batch
+// fn can polish the estimates with Marquardt fits
+ecf_lut *GCI_ecf_lut(float xincr, int fit_start, int fit_end,
+					 float instr[], int ninstr,
+					 float tau_min, float tau_max, int nentries);
+void GCI_ecf_free_lut(ecf_lut *lut);
+int GCI_ecf_lut_estimate(const ecf_lut *lut, float y[],
+						 float *Z, float *A, float *tau);
+int GCI_ecf_lut_batch(const ecf_lut *lut, float *trans, int ndata, int ntrans,
+					  int polish, noise_type noise, float chisq_delta,
+					  float Z[], float A[], float tau[], float chisq[],
+					  int nthreads);
+
+int GCI_marquardt(float x[], float y[], int ndata,
+				  noise_type noise, float sig[],
+				  float param[], int paramfree[], int nparam,
+				  restrain_type restrain,
+				  void (*fitfunc)(float, float [], float *, float [], int),
+				  float *fitted, float *residuals,
+				  float **covar, float **alpha, float *chisq,
+				  float chisq_delta, float chisq_percent, float **erraxes);
+int GCI_marquardt_ws(ecf_workspace *ws, float x[], float y[], int ndata,
+				  noise_type noise, float sig[],
+				  float param[], int paramfree[], int nparam,
+				  restrain_type restrain,
+				  void (*fitfunc)(float, float [], float *, float [], int),
+				  float *fitted, float *residuals,
+				  float **covar, float **alpha, float *chisq,
+				  float chisq_delta, float chisq_percent, float **erraxes);
+int GCI_marquardt_instr(float xincr, float y[],
+					int ndata, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float param[], int paramfree[], int nparam,
+					restrain_type restrain,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float *fitted, float *residuals,
+					float **covar, float **alpha, float *chisq,
+					float chisq_delta, float chisq_percent, float **erraxes);
+int GCI_marquardt_instr_ws(ecf_workspace *ws, float xincr, float y[],
+					int ndata, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float param[], int paramfree[], int nparam,
+					restrain_type restrain,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float *fitted, float *residuals,
+					float **covar, float **alpha, float *chisq,
+					float chisq_delta, float chisq_percent, float **erraxes);
+// as GCI_marquardt_instr(), but multiexponential fits only iterate over the
+// lifetimes, the linear parameters being found by least squares at each step
+int GCI_marquardt_varpro_instr(float xincr, float y[],
+					int ndata, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float param[], int paramfree[], int nparam,
+					restrain_type restrain,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float *fitted, float *residuals,
+					float **covar, float **alpha, float *chisq,
+					float chisq_delta, float chisq_percent, float **erraxes);
+int GCI_marquardt_varpro_instr_ws(ecf_workspace *ws, float xincr, float y[],
+					int ndata, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float param[], int paramfree[], int nparam,
+					restrain_type restrain,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float *fitted, float *residuals,
+					float **covar, float **alpha, float *chisq,
+					float chisq_delta, float chisq_percent, float **erraxes);
+void GCI_marquardt_cleanup(void);
+
+/* Global analysis analysis functions */
+
+int GCI_marquardt_global_exps_instr(float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta, 
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df,
+					int drop_bad_transients);
+// the _ws versions take ECF_RESTRAIN_USER restraints attached to ws by
+// GCI_ecf_set_workspace_restraint() below; with ws NULL they are as above
+int GCI_marquardt_global_exps_instr_ws(ecf_workspace *ws, float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta,
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df,
+					int drop_bad_transients);
+int GCI_marquardt_global_generic_instr(float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta, 
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df);
+int GCI_marquardt_global_generic_instr_ws(ecf_workspace *ws, float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df);
+
+/* Support plane analysis functions */
+
+int GCI_SPA_1D_marquardt(
+				float x[], float y[], int ndata,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param, int spa_nvalues,
+				float spa_low, float spa_high,
+				float chisq[], void (*progressfunc)(float));
+int GCI_SPA_2D_marquardt(
+				float x[], float y[], int ndata,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param1, int spa_nvalues1,
+				float spa_low1, float spa_high1,
+				int spa_param2, int spa_nvalues2,
+				float spa_low2, float spa_high2,
+				float **chisq, void (*progressfunc)(float));
+int GCI_SPA_1D_marquardt_instr(
+				float xincr, float y[],
+				int ndata, int fit_start, int fit_end,
+				float instr[], int ninstr,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param, int spa_nvalues,
+				float spa_low, float spa_high,
+				float chisq[], float chisq_target, void (*progressfunc)(float));
+int GCI_SPA_2D_marquardt_instr(
+				float xincr, float y[],
+				int ndata, int fit_start, int fit_end,
+				float instr[], int ninstr,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param1, int spa_nvalues1,
+				float spa_low1, float spa_high1,
+				int spa_param2, int spa_nvalues2,
+				float spa_low2, float spa_high2,
+				float **chisq, float chisq_target, void (*progressfunc)(float));
+int GCI_SPA_1D_marquardt_global_exps_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta, int drop_bad_transients,
+					int spa_param, int spa_nvalues,
+					float spa_low, float spa_high,
+					float chisq_global[], int df[], void (*progressfunc)(float));
+int GCI_SPA_2D_marquardt_global_exps_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta, int drop_bad_transients,
+					int spa_param1, int spa_nvalues1,
+					float spa_low1, float spa_high1,
+					int spa_param2, int spa_nvalues2,
+					float spa_low2, float spa_high2,
+					float **chisq_global, int **df, void (*progressfunc)(float));
+int GCI_SPA_1D_marquardt_global_generic_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					int spa_param, int spa_nvalues,
+					float spa_low, float spa_high,
+					float chisq_global[], int df[], void (*progressfunc)(float));
+int GCI_SPA_2D_marquardt_global_generic_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					int spa_param1, int spa_nvalues1,
+					float spa_low1, float spa_high1,
+					int spa_param2, int spa_nvalues2,
+					float spa_low2, float spa_high2,
+					float **chisq_global, int **df, void (*progressfunc)(float));
+
+/* Setting restraints
+
+   GCI_set_restrain_limits() sets the limits used by every fit with
+   ECF_RESTRAIN_USER, so it must not be called while fits are running.
+   Fits on different threads, or different groups of pixels, can have
+   their own limits instead: make an ecf_restraint with the same
+   arguments and attach it to the workspace of the fit (or pass it to
+   GCI_marquardt_fitting_engine_batch()).  It is only read during the
+   fits, so may be shared by any number of them.  GCI_ecf_restraint()
+   returns NULL if the arguments are bad or if out of memory. */
+
+int GCI_set_restrain_limits(int nparam, int restrain[],
+							float minval[], float maxval[]);
+ecf_restraint *GCI_ecf_restraint(int nparam, int restrain[],
+								 float minval[], float maxval[]);
+void GCI_ecf_free_restraint(ecf_restraint *restraint);
+void GCI_ecf_set_workspace_restraint(ecf_workspace *ws,
+									 const ecf_restraint *restraint);
+
+/* Accuracy of the predefined fitting models: ECF_ACCURACY_LIBM (the
+   default) uses the C library log and exp, ECF_ACCURACY_FAST allows
+   vectorised polynomial approximations to them where the CPU has AVX2
+   or AVX-512; the fitted values are as accurate either way to float
+   precision, but may differ in the last bits.  Each workspace has its
+   own setting; GCI_set_accuracy() sets the one new workspaces start
+   with, including those made by the functions without a workspace
+   argument. */
+
+void GCI_set_accuracy(accuracy_type accuracy);
+accuracy_type GCI_get_accuracy(void);
+void GCI_ecf_set_workspace_accuracy(ecf_workspace *ws, accuracy_type accuracy);
+
+/* Fitting method of GCI_marquardt_fitting_engine() and the functions
+   built on it: ECF_METHOD_MARQUARDT (the default) fits all the free
+   parameters with GCI_marquardt_instr(), ECF_METHOD_VARPRO uses
+   GCI_marquardt_varpro_instr() instead, which needs fewer iterations
+   and is much less sensitive to poor starting values.  As with the
+   accuracy, GCI_set_method() sets the default for new workspaces. */
+
+void GCI_set_method(method_type method);
+method_type GCI_get_method(void);
+void GCI_ecf_set_workspace_method(ecf_workspace *ws, method_type method);
+
+/* Predefined fitting models */
+
+void GCI_multiexp_lambda(float x, float param[],
+			 float *y, float dy_dparam[], int nparam);
+void GCI_multiexp_tau(float x, float param[],
+		      float *y, float dy_dparam[], int nparam);
+void GCI_stretchedexp(float x, float param[],
+		      float *y, float dy_dparam[], int nparam);
+
+/* Utility functions */
+float **GCI_ecf_matrix(long nrows, long ncols);
+void GCI_ecf_free_matrix(float **m);
+ecf_workspace *GCI_ecf_workspace(int ndata, int nparam);
+void GCI_ecf_free_workspace(ecf_workspace *ws);
+
+/* Tracing the fits
+
+   Attach a trace to a workspace and every fit in it records its steps,
+   keeping the last capacity records in a ring buffer and passing each
+   to callback (if not NULL) as it is made.  Recording does no I/O and
+   allocates nothing, so it may be left on for large batches; use one
+   trace per workspace.  GCI_ecf_trace_read() and GCI_ecf_trace_write()
+   drain the records, oldest first, between fits; GCI_ecf_trace_write()
+   appends them to a file and returns the number written, or -1 if the
+   file cannot be written.  GCI_ecf_trace_dropped() is the number of
+   records overwritten before they were drained.
+
+   ECF_ExportParams_start() is the older interface: it has
+   GCI_marquardt_fitting_engine() append the parameters and chi-squared
+   of each step to a text file after each fit, in workspaces without a
+   trace of their own. */
+
+ecf_trace *GCI_ecf_trace(int capacity, ecf_trace_callback callback, void *user);
+void GCI_ecf_free_trace(ecf_trace *trace);
+void GCI_ecf_set_workspace_trace(ecf_workspace *ws, ecf_trace *trace);
+int GCI_ecf_trace_count(const ecf_trace *trace);
+int GCI_ecf_trace_dropped(const ecf_trace *trace);
+int GCI_ecf_trace_read(ecf_trace *trace, ecf_trace_record records[], int max);
+int GCI_ecf_trace_write(ecf_trace *trace, const char *path, ecf_trace_format format);
+
+void ECF_ExportParams_start (char path[]);
+void ECF_ExportParams_stop (void);
+
+/* Fit statistics
+
+   Attach an ecf_fit_stats to a workspace and
+   GCI_marquardt_fitting_engine() and GCI_triple_integral_fitting_engine()
+   fill it in for each transient they fit there.  The counts are kept
+   by the fits as they go, so this costs next to nothing.
+   GCI_ecf_stats_summary_add() adds the statistics of one fit to an
+   ecf_stats_summary, which should first be cleared, and
+   GCI_ecf_stats_summary_merge() adds two summaries together, such as
+   those of different threads. */
+
+void GCI_ecf_set_workspace_stats(ecf_workspace *ws, ecf_fit_stats *stats);
+void GCI_ecf_stats_summary_clear(ecf_stats_summary *summary);
+void GCI_ecf_stats_summary_add(ecf_stats_summary *summary, const ecf_fit_stats *stats);
+void GCI_ecf_stats_summary_merge(ecf_stats_summary *summary, const ecf_stats_summary *from);
+
+#endif /* _GCI_ECF */
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
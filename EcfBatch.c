@@ -0,0 +1,456 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains functions for fitting whole blocks of transients,
+   such as all the pixels of a FLIM image, with the single transient
+   routines of EcfSingle.c, either independently or coarse to fine.
+
+   The transients are independent of each other, so they are shared out
+   between threads with OpenMP when it is available (compile with
+   -fopenmp or /openmp); otherwise everything runs on the calling thread.
+   Each transient is always fitted by exactly the same sequence of
+   operations, whichever thread picks it up, so the results do not depend
+   on the number of threads used.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "EcfInternal.h"
+
+/* Work out how many threads to use; nthreads <= 0 means "as many as the
+   OpenMP runtime would like".  Always 1 without OpenMP. */
+int ecf_batch_nthreads(int nthreads)
+{
+#ifdef _OPENMP
+	if (nthreads <= 0)
+		nthreads = omp_get_max_threads();
+	return (nthreads < 1) ? 1 : nthreads;
+#else
+	return 1;
+#endif
+}
+
+/********************************************************************
+
+					   BATCH TRANSIENT FITTING
+
+					  LEVENBERG-MARQUARDT METHOD
+
+ ********************************************************************/
+
+/* Fit ntrans transients, each of length ndata, stored one after the other
+   in trans[0..ntrans*ndata-1] (this is the column order of a MATLAB
+   array).  The parameters are handled in the same way:
+   param[t*nparam..t*nparam+nparam-1] holds the initial estimates for
+   transient t on entry and the fitted values on return.
+
+   If prompt_stride is 0, every transient uses the same prompt
+   prompt[0..nprompt-1]; otherwise transient t uses the prompt starting at
+   prompt[t*prompt_stride].  sig[] and sig_stride work in the same way.
+
+   fitted and residuals may be NULL; otherwise they are ntrans*ndata long
+   and laid out like trans.  chisq[] and iterations[] may also be NULL;
+   otherwise they receive the final chi-squared value and the return value
+   of GCI_marquardt_fitting_engine() for each transient.  stats[] and
+   summary may be NULL too; otherwise stats[] receives the statistics of
+   each fit (see GCI_ecf_set_workspace_stats()), and summary, which is
+   cleared first, those of the whole batch.
+
+   Returns the number of transients which could not be fitted, or a
+   negative value if the arguments are bad.
+
+   With restrain == ECF_RESTRAIN_USER, every transient is fitted with the
+   limits in restraint, or with those set by GCI_set_restrain_limits() if
+   restraint is NULL; either way they are only read during the fits, so
+   they are fine shared between the threads.  Exporting the
+   parameters at each iteration writes to a single file, though, so the
+   fits are run on one thread if ECF_ExportParams_start() is in force. */
+
+int GCI_marquardt_fitting_engine_batch(float xincr, float *trans, int ndata, int ntrans,
+						int fit_start, int fit_end,
+						float prompt[], int nprompt, int prompt_stride,
+						noise_type noise, float sig[], int sig_stride,
+						float *param, int paramfree[],
+					   int nparam, restrain_type restrain, const ecf_restraint *restraint,
+					   void (*fitfunc)(float, float [], float *, float [], int),
+					   float *fitted, float *residuals, float chisq[], int iterations[],
+					   float chisq_target, float chisq_delta, int chisq_percent,
+					   ecf_fit_stats stats[], ecf_stats_summary *summary,
+					   int nthreads)
+{
+	int nfailed = 0;
+	int want_stats = (stats != NULL || summary != NULL);
+
+	if (trans == NULL || param == NULL || paramfree == NULL || fitfunc == NULL)
+		return -1;
+	if (ndata < 1 || ntrans < 0 || nparam < 1 || nparam > MAXFIT)
+		return -2;
+	if (fit_start < 0 || fit_start > fit_end || fit_end > ndata)
+		return -3;
+	if (prompt_stride < 0 || sig_stride < 0)
+		return -4;
+
+	if (summary != NULL)
+		GCI_ecf_stats_summary_clear(summary);
+
+	nthreads = ecf_batch_nthreads(nthreads);
+	if (ecf_export_params_active())
+		nthreads = 1;  /* the export file is shared by all fits */
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) reduction(+:nfailed)
+#endif
+	{
+		/* Per-thread working space, so the fits themselves never allocate */
+		ecf_workspace *ws = GCI_ecf_workspace(ndata, nparam);
+		float **covar = GCI_ecf_matrix(nparam, nparam);
+		float **alpha = GCI_ecf_matrix(nparam, nparam);
+		float *fitted_local = NULL, *residuals_local = NULL;
+		ecf_fit_stats stats_local;
+		ecf_stats_summary summary_local;
+		int ok = (ws != NULL && covar != NULL && alpha != NULL);
+		int t;
+
+		if (ok)
+			GCI_ecf_set_workspace_restraint(ws, restraint);
+		if (ok && want_stats)
+			GCI_ecf_set_workspace_stats(ws, &stats_local);
+		GCI_ecf_stats_summary_clear(&summary_local);
+		if (ok && fitted == NULL)
+			ok = ((fitted_local = (float *) malloc((size_t) ndata * sizeof(float))) != NULL);
+		if (ok && residuals == NULL)
+			ok = ((residuals_local = (float *) malloc((size_t) ndata * sizeof(float))) != NULL);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (t = 0; t < ntrans; t++) {
+			float local_chisq = 0.0f;
+			int ret = -1;
+
+			if (want_stats) {
+				/* in case the fit cannot be started */
+				memset(&stats_local, 0, sizeof(ecf_fit_stats));
+				stats_local.exit = ECF_EXIT_ERROR;
+			}
+
+			if (ok) {
+				ret = GCI_marquardt_fitting_engine_ws(ws, xincr,
+							trans + (size_t) t * ndata, ndata, fit_start, fit_end,
+							(prompt == NULL) ? NULL : prompt + (size_t) t * prompt_stride,
+							nprompt, noise,
+							(sig == NULL) ? NULL : sig + (size_t) t * sig_stride,
+							param + (size_t) t * nparam, paramfree, nparam,
+							restrain, fitfunc,
+							(fitted == NULL) ? fitted_local : fitted + (size_t) t * ndata,
+							(residuals == NULL) ? residuals_local : residuals + (size_t) t * ndata,
+							&local_chisq, covar, alpha, NULL,
+							chisq_target, chisq_delta, chisq_percent);
+			}
+
+			if (ret < 0)
+				nfailed++;
+			if (chisq != NULL)
+				chisq[t] = local_chisq;
+			if (iterations != NULL)
+				iterations[t] = ret;
+			if (stats != NULL)
+				stats[t] = stats_local;
+			if (summary != NULL)
+				GCI_ecf_stats_summary_add(&summary_local, &stats_local);
+		}
+
+		if (summary != NULL) {
+#ifdef _OPENMP
+#pragma omp critical(ecf_batch_summary)
+#endif
+			GCI_ecf_stats_summary_merge(summary, &summary_local);
+		}
+
+		GCI_ecf_free_workspace(ws);
+		GCI_ecf_free_matrix(covar);
+		GCI_ecf_free_matrix(alpha);
+		free(fitted_local);
+		free(residuals_local);
+	}
+
+	return nfailed;
+}
+
+
+/********************************************************************
+
+					 COARSE TO FINE IMAGE FITTING
+
+ ********************************************************************/
+
+/* One level of the pyramid of GCI_marquardt_fitting_engine_pyramid():
+   the image binned into blocks of size x size pixels */
+typedef struct {
+	int size;           /* pixels along each side of a bin */
+	int rows, cols;     /* bins down and across the image */
+	int nbins;
+	float *trans;       /* the binned transients, nbins*ndata */
+	float *param;       /* the initial estimates, then the fitted values */
+	float *sig;         /* the standard deviations of the binned data */
+	int sig_stride;
+	int *npix;          /* pixels in each bin; fewer at the edges */
+	float *counts;      /* total of each transient over the fit range */
+	int *iterations;    /* return values of the fits */
+} ecf_pyramid_level;
+
+/* Whether parameter i is proportional to the intensity, and so adds up
+   when pixels are binned, rather than being a shape parameter like a
+   lifetime which does not.  Nothing is known about user models. */
+static int ecf_pyramid_is_linear(ecf_model model, int i)
+{
+	switch (model) {
+	case ECF_MODEL_MULTIEXP_LAMBDA:
+	case ECF_MODEL_MULTIEXP_TAU:
+		return (i == 0 || i % 2 == 1);
+	case ECF_MODEL_STRETCHEDEXP:
+		return (i == 0 || i == 1);
+	default:
+		return 0;
+	}
+}
+
+static void ecf_pyramid_free(ecf_pyramid_level *levels, int nlevels)
+{
+	int l;
+
+	for (l=0; l<nlevels; l++) {
+		if (l > 0) {  /* level 0 is the caller's image */
+			free(levels[l].trans);
+			free(levels[l].param);
+		}
+		free(levels[l].sig);
+		free(levels[l].npix);
+		free(levels[l].counts);
+		free(levels[l].iterations);
+	}
+	free(levels);
+}
+
+/* Fit an image by GCI_marquardt_fitting_engine_batch(), coarse to fine.
+   The image is rows x cols pixels, and transient t = r + c*rows, the
+   pixel in row r and column c, is trans[t*ndata..t*ndata+ndata-1] as in
+   a MATLAB array; param, fitted, residuals, chisq[], iterations[] and
+   stats[] are laid out by pixel in the same way and mean the same as
+   for the batch function, and so does the return value.
+
+   The image is first binned into a pyramid of nlevels levels, level l
+   having bins of 2^l x 2^l pixels, so nlevels = 4 bins 8 x 8, 4 x 4 and
+   2 x 2 before fitting the pixels themselves.  The coarsest level is
+   fitted from the initial estimates in param, totalled over its bins
+   for Z and the amplitudes and averaged for the other parameters (user
+   fitting functions have all their parameters averaged).  Each finer
+   bin then starts from the fit of the bin containing it, with Z and the
+   amplitudes scaled by the ratio of their counts; if that fit failed it
+   starts from the initial estimates instead.  The binned transients
+   have many more counts than the pixels, so fit easily, and the pixels
+   start close to their minimum.  Fixed parameters are never taken from
+   the fit of the bin above, so each pixel is fitted with its own values
+   of them; the bins have their totals or averages as above.
+
+   Every transient uses the same prompt, and sig[] is one array for all
+   of them (scaled for the bins with NOISE_CONST and NOISE_GIVEN).  If
+   summary is not NULL it covers the fits of all the levels.  Returns -5
+   if out of memory. */
+
+int GCI_marquardt_fitting_engine_pyramid(float xincr, float *trans, int ndata,
+						int rows, int cols, int nlevels,
+						int fit_start, int fit_end,
+						float prompt[], int nprompt,
+						noise_type noise, float sig[],
+						float *param, int paramfree[],
+					   int nparam, restrain_type restrain, const ecf_restraint *restraint,
+					   void (*fitfunc)(float, float [], float *, float [], int),
+					   float *fitted, float *residuals, float chisq[], int iterations[],
+					   float chisq_target, float chisq_delta, int chisq_percent,
+					   ecf_fit_stats stats[], ecf_stats_summary *summary,
+					   int nthreads)
+{
+	ecf_pyramid_level *levels, *lev, *fine;
+	ecf_stats_summary level_summary;
+	ecf_model model;
+	float *child, *bin, scale;
+	int l, b, r, c, i, j, q, ch, nfailed = 0;
+
+	if (trans == NULL || param == NULL || paramfree == NULL || fitfunc == NULL)
+		return -1;
+	if (ndata < 1 || rows < 1 || cols < 1 || nparam < 1 || nparam > MAXFIT)
+		return -2;
+	if (fit_start < 0 || fit_start > fit_end || fit_end > ndata)
+		return -3;
+	if (nlevels < 1 || ((noise == NOISE_CONST || noise == NOISE_GIVEN) && sig == NULL))
+		return -4;
+
+	/* There is no point going beyond a single bin */
+	for (l=1; l<nlevels && ((rows-1) >> (l-1) > 0 || (cols-1) >> (l-1) > 0); l++)
+		;
+	nlevels = l;
+
+	model = ecf_model_of(fitfunc);
+	if (summary != NULL)
+		GCI_ecf_stats_summary_clear(summary);
+
+	/* Build the pyramid, each level from the one below */
+	if ((levels = (ecf_pyramid_level *) calloc((size_t) nlevels, sizeof(ecf_pyramid_level))) == NULL)
+		return -5;
+	for (l=0; l<nlevels; l++) {
+		lev = &levels[l];
+		lev->size = 1 << l;
+		lev->rows = (rows + lev->size - 1) / lev->size;
+		lev->cols = (cols + lev->size - 1) / lev->size;
+		lev->nbins = lev->rows * lev->cols;
+		if (l == 0) {
+			lev->trans = trans;
+			lev->param = param;
+		}
+		else {
+			lev->trans = (float *) calloc((size_t) lev->nbins * ndata, sizeof(float));
+			lev->param = (float *) calloc((size_t) lev->nbins * nparam, sizeof(float));
+		}
+		lev->npix = (int *) calloc((size_t) lev->nbins, sizeof(int));
+		lev->counts = (float *) malloc((size_t) lev->nbins * sizeof(float));
+		lev->iterations = (int *) malloc((size_t) lev->nbins * sizeof(int));
+		if (lev->trans == NULL || lev->param == NULL || lev->npix == NULL ||
+			lev->counts == NULL || lev->iterations == NULL) {
+			ecf_pyramid_free(levels, l+1);
+			return -5;
+		}
+
+		if (l == 0) {
+			for (b=0; b<lev->nbins; b++)
+				lev->npix[b] = 1;
+		}
+		else {
+			/* Sum the (up to) four bins of the level below, and their
+			   initial estimates, parameter by parameter */
+			fine = &levels[l-1];
+			for (c=0; c<fine->cols; c++) {
+				for (r=0; r<fine->rows; r++) {
+					ch = r + c * fine->rows;
+					b = r/2 + (c/2) * lev->rows;
+					child = fine->trans + (size_t) ch * ndata;
+					bin = lev->trans + (size_t) b * ndata;
+					for (i=0; i<ndata; i++)
+						bin[i] += child[i];
+					for (j=0; j<nparam; j++)
+						lev->param[b*nparam+j] += ecf_pyramid_is_linear(model, j) ?
+							fine->param[ch*nparam+j] :
+							fine->param[ch*nparam+j] * fine->npix[ch];
+					lev->npix[b] += fine->npix[ch];
+				}
+			}
+			for (b=0; b<lev->nbins; b++)
+				for (j=0; j<nparam; j++)
+					if (!ecf_pyramid_is_linear(model, j))
+						lev->param[b*nparam+j] /= lev->npix[b];
+		}
+
+		for (b=0; b<lev->nbins; b++) {
+			bin = lev->trans + (size_t) b * ndata;
+			lev->counts[b] = 0.0f;
+			for (i=fit_start; i<fit_end; i++)
+				lev->counts[b] += bin[i];
+		}
+
+		/* The standard deviation of a sum of npix values with the same
+		   standard deviation is sqrt(npix) times as large */
+		lev->sig = NULL;
+		lev->sig_stride = 0;
+		if (l > 0 && noise == NOISE_CONST)
+			lev->sig_stride = 1;
+		else if (l > 0 && noise == NOISE_GIVEN)
+			lev->sig_stride = ndata;
+		if (lev->sig_stride > 0) {
+			if ((lev->sig = (float *) malloc((size_t) lev->nbins * lev->sig_stride *
+											 sizeof(float))) == NULL) {
+				ecf_pyramid_free(levels, l+1);
+				return -5;
+			}
+			for (b=0; b<lev->nbins; b++)
+				for (i=0; i<lev->sig_stride; i++)
+					lev->sig[b*lev->sig_stride+i] = sig[i] * sqrtf((float) lev->npix[b]);
+		}
+	}
+
+	/* Fit from the top down */
+	for (l=nlevels-1; l>=0; l--) {
+		lev = &levels[l];
+
+		if (l < nlevels-1) {
+			ecf_pyramid_level *coarse = &levels[l+1];
+
+			for (c=0; c<lev->cols; c++) {
+				for (r=0; r<lev->rows; r++) {
+					b = r + c * lev->rows;
+					q = r/2 + (c/2) * coarse->rows;
+					if (coarse->iterations[q] < 0 || coarse->counts[q] <= 0.0f ||
+						lev->counts[b] <= 0.0f)
+						continue;  /* keep the initial estimates */
+					scale = lev->counts[b] / coarse->counts[q];
+					for (j=0; j<nparam; j++) {
+						if (!paramfree[j])
+							continue;  /* the bin's own value */
+						lev->param[b*nparam+j] = ecf_pyramid_is_linear(model, j) ?
+							coarse->param[q*nparam+j] * scale :
+							coarse->param[q*nparam+j];
+					}
+				}
+			}
+		}
+
+		nfailed = GCI_marquardt_fitting_engine_batch(xincr, lev->trans, ndata, lev->nbins,
+						fit_start, fit_end, prompt, nprompt, 0,
+						noise, (l == 0) ? sig : lev->sig, lev->sig_stride,
+						lev->param, paramfree, nparam, restrain, restraint, fitfunc,
+						(l == 0) ? fitted : NULL, (l == 0) ? residuals : NULL,
+						(l == 0) ? chisq : NULL, lev->iterations,
+						chisq_target, chisq_delta, chisq_percent,
+						(l == 0) ? stats : NULL,
+						(summary == NULL) ? NULL : &level_summary, nthreads);
+		if (nfailed < 0)
+			break;
+		if (summary != NULL)
+			GCI_ecf_stats_summary_merge(summary, &level_summary);
+	}
+
+	if (nfailed >= 0 && iterations != NULL)
+		for (b=0; b<levels[0].nbins; b++)
+			iterations[b] = levels[0].iterations[b];
+
+	ecf_pyramid_free(levels, nlevels);
+	return nfailed;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
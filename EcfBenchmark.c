@@ -0,0 +1,771 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* EcfBenchmark.c: a standalone benchmark of the fitting library, so that
+   it can be profiled and its performance tracked without MATLAB.
+
+   Decays are simulated as createDecay.m does: photons from one or more
+   exponential components, a Gaussian prompt convolved with them, and
+   uniform background photons, with the start of the transient and of
+   the fit found from the gradients.  For each model and noise type the
+   same decays are then fitted three ways, each of them timed:
+
+     rld       GCI_triple_integral_fitting_engine() from the blind
+               starting values used by mxSlimCurve.c
+     lma       GCI_marquardt_fitting_engine(), from the RLD estimates
+     pipeline  both of them, as mxSlimCurve.c does for each transient
+
+   For each, the number of fits per second, the mean number of
+   iterations, the number of failed fits, the mean reduced chi-squared
+   and the bias and rms error of the fitted lifetime relative to the
+   true one are written out as JSON or CSV.  For the multiexponential
+   models and the true decay the lifetime compared is the intensity
+   weighted mean lifetime sum(A tau^2) / sum(A tau), for the stretched
+   exponential it is tau.
+
+   Usage: EcfBenchmark [options]
+     -n N          decays per model and noise type (1000)
+     -b BINS       number of time bins (256)
+     -r RANGE      time range in ns (10)
+     -t TAU,...    lifetimes of the components in ns (2)
+     -p N,...      photons in each component (10000)
+     -g N          background photons (300)
+     -s SIGMA      standard deviation of the prompt in ns (0.05)
+     -o OFFSET     start of the transient in ns (1)
+     -m M,...      models: 1, 2, 3 exponentials, 4 stretched (1,2,3,4)
+     -e E,...      noise models, as in mxSlimCurve.c (0,1,2,3,4,5)
+     -M METHOD     marquardt or varpro (marquardt)
+     -A ACCURACY   libm or fast (libm)
+     -x SEED       random number seed (1)
+     -f FORMAT     json or csv (json)
+*/
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "Ecf.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BENCH_MAXCOMP 8
+
+static const char *bench_model_names[] = { "", "1exp", "2exp", "3exp", "stretched" };
+static const char *bench_noise_names[] = { "const", "given", "poisson_data",
+										   "poisson_fit", "gaussian_fit", "mle" };
+static const char *bench_stage_names[] = { "rld", "lma", "pipeline" };
+
+/* The benchmark settings */
+typedef struct {
+	int ndecays;
+	int nbins;
+	float range;
+	int ncomp;
+	double tau[BENCH_MAXCOMP];
+	double photons[BENCH_MAXCOMP];
+	double background;
+	double prompt_sigma;
+	double offset;
+	int nmodels;
+	int models[4];
+	int nnoises;
+	int noises[6];
+	method_type method;
+	accuracy_type accuracy;
+	unsigned long seed;
+	int csv;
+} bench_config;
+
+/* One simulated decay, ready to be fitted as mxSlimCurve.c would be */
+typedef struct {
+	float *trans;           /* transient from its rise onwards */
+	float *sig;             /* Poisson standard deviations of trans */
+	float *prompt;
+	int ndata;
+	int nprompt;
+	int fit_start;
+	int fit_end;
+} bench_decay;
+
+/* The results of one stage for one model and noise type */
+typedef struct {
+	double seconds;
+	double iterations;
+	int failures;
+	double chisq;
+	double bias;
+	double rms;
+	int naccurate;
+} bench_result;
+
+
+/********************************************************************
+
+						   RANDOM NUMBERS
+
+ ********************************************************************/
+
+/* xorshift64*, so that the decays are the same on every platform */
+static unsigned long long bench_rng_state = 1;
+
+static void bench_srand(unsigned long seed)
+{
+	bench_rng_state = 0x9E3779B97F4A7C15ULL ^ (unsigned long long) seed;
+	if (bench_rng_state == 0)
+		bench_rng_state = 1;
+}
+
+/* Uniform on (0, 1) */
+static double bench_rand(void)
+{
+	unsigned long long x;
+
+	bench_rng_state ^= bench_rng_state >> 12;
+	bench_rng_state ^= bench_rng_state << 25;
+	bench_rng_state ^= bench_rng_state >> 27;
+	x = bench_rng_state * 0x2545F4914F6CDD1DULL;
+	return ((double) (x >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/* Standard normal, by the Box-Muller method */
+static double bench_randn(void)
+{
+	return sqrt(-2.0 * log(bench_rand())) * cos(6.283185307179586 * bench_rand());
+}
+
+
+/********************************************************************
+
+						  DECAY SIMULATION
+
+ ********************************************************************/
+
+/* Adds a photon at time t to the histogram h of nbins bins of width
+   xincr, dropping it if it is out of range.  (createDecay.m bins with
+   histc at linspace(0, range, nrBins), which is slightly narrower than
+   the xincr it returns; binning at xincr keeps the lifetimes unbiased.) */
+static void bench_bin(double *h, int nbins, double xincr, double t)
+{
+	double k = floor(t / xincr);
+
+	if (k >= 0 && k < nbins)
+		h[(int) k] += 1.0;
+}
+
+/* Index of the first maximum of the MATLAB gradient() of x[0..n-1] */
+static int bench_max_gradient(const double *x, int n)
+{
+	int i, imax = 0;
+	double g, gmax = -HUGE_VAL;
+
+	for (i=0; i<n; i++) {
+		if (n < 2)
+			g = 0.0;
+		else if (i == 0)
+			g = x[1] - x[0];
+		else if (i == n-1)
+			g = x[n-1] - x[n-2];
+		else
+			g = 0.5 * (x[i+1] - x[i-1]);
+		if (g > gmax) {
+			gmax = g;
+			imax = i;
+		}
+	}
+	return imax;
+}
+
+/* Simulates one decay as createDecay.m does.  Returns 0 on success,
+   -1 if out of memory. */
+static int bench_make_decay(const bench_config *cfg, bench_decay *d)
+{
+	int nb = cfg->nbins;
+	double xincr = cfg->range / nb;
+	double *y, *p, *t, pmax, mean;
+	int i, j, k, n, start, imax, iprompt;
+
+	y = (double *) calloc((size_t) nb, sizeof(double));
+	p = (double *) calloc((size_t) nb, sizeof(double));
+	t = (double *) calloc((size_t) nb, sizeof(double));
+	d->trans = (float *) malloc((size_t) nb * sizeof(float));
+	d->sig = (float *) malloc((size_t) nb * sizeof(float));
+	d->prompt = (float *) malloc((size_t) nb * sizeof(float));
+	if (y == NULL || p == NULL || t == NULL ||
+		d->trans == NULL || d->sig == NULL || d->prompt == NULL) {
+		free(y); free(p); free(t);
+		free(d->trans); free(d->sig); free(d->prompt);
+		d->trans = d->sig = d->prompt = NULL;
+		return -1;
+	}
+
+	/* The exponential components */
+	for (i=0, mean=0.0; i<cfg->ncomp; i++) {
+		n = (int) cfg->photons[i];
+		for (j=0; j<n; j++)
+			bench_bin(y, nb, xincr, cfg->offset - log(bench_rand()) * cfg->tau[i]);
+		mean += cfg->photons[i] / cfg->ncomp;
+	}
+
+	/* The normalised prompt, centred on the middle of the range */
+	n = (int) mean;
+	for (j=0; j<n; j++)
+		bench_bin(p, nb, xincr, cfg->range / 2 + cfg->prompt_sigma * bench_randn());
+	for (j=0, pmax=0.0; j<nb; j++)
+		pmax = (p[j] > pmax) ? p[j] : pmax;
+	for (j=0, mean=0.0; j<nb; j++)
+		mean += p[j];
+	for (j=0; j<nb; j++)
+		p[j] /= (mean > 0.0) ? mean : 1.0;
+	pmax /= (mean > 0.0) ? mean : 1.0;
+
+	/* Circular convolution with the prompt, shifted back by its centre
+	   (ifftshift(ifft(fft(y) .* fft(prompt)))) */
+	for (j=0; j<nb; j++) {
+		if (p[j] == 0.0)
+			continue;
+		for (k=0; k<nb; k++)
+			t[((k + j - nb/2) % nb + nb) % nb] += y[k] * p[j];
+	}
+
+	/* The background */
+	n = (int) cfg->background;
+	for (j=0; j<n; j++)
+		bench_bin(t, nb, xincr, cfg->range * bench_rand());
+
+	/* The prompt without its tails */
+	for (j=0, d->nprompt=0; j<nb; j++)
+		if (p[j] > pmax / 100)
+			y[d->nprompt++] = p[j];
+	for (j=0; j<d->nprompt; j++)
+		d->prompt[j] = (float) y[j];
+
+	/* The transient starts where it rises fastest, less the rise of the
+	   prompt; the fit starts half the prompt width beyond its maximum */
+	iprompt = bench_max_gradient(y, d->nprompt);
+	start = bench_max_gradient(t, nb) - iprompt;
+	if (start < 0)
+		start = 0;
+	for (j=0, imax=0; j<nb; j++)
+		if (t[j] > t[imax])
+			imax = j;
+
+	d->ndata = nb - start;
+	d->fit_start = imax + d->nprompt / 2 - start;
+	if (d->fit_start < 0)
+		d->fit_start = 0;
+	if (d->fit_start > d->ndata - 2)
+		d->fit_start = d->ndata - 2;
+	d->fit_end = d->ndata - 1;
+	for (j=0; j<d->ndata; j++) {
+		d->trans[j] = (float) t[start + j];
+		d->sig[j] = (float) sqrt(t[start + j] > 1.0 ? t[start + j] : 1.0);
+	}
+
+	free(y);
+	free(p);
+	free(t);
+	return 0;
+}
+
+static void bench_free_decay(bench_decay *d)
+{
+	free(d->trans);
+	free(d->sig);
+	free(d->prompt);
+}
+
+
+/********************************************************************
+
+							  FITTING
+
+ ********************************************************************/
+
+static double bench_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER f, c;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (double) c.QuadPart / (double) f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+/* The initial estimates for the LMA from those of the RLD, exactly as
+   in mxSlimCurve.c; returns the number of parameters */
+static int bench_initial_params(int model, float z, float a, float tau,
+								float param[], int paramfree[],
+								void (**fitfunc)(float, float [], float *, float [], int))
+{
+	int i, nparam = 0;
+
+	*fitfunc = GCI_multiexp_tau;
+	switch (model) {
+	case 1:
+		nparam = 3;
+		param[0] = z;
+		param[1] = a;
+		param[2] = tau;
+		break;
+	case 2:
+		nparam = 5;
+		param[0] = z;
+		param[1] = 0.75f * a;
+		param[2] = tau;
+		param[3] = 0.25f * a;
+		param[4] = 0.6666667f * tau;
+		break;
+	case 3:
+		nparam = 7;
+		param[0] = z;
+		param[1] = 0.75f * a;
+		param[2] = tau;
+		param[3] = 0.1666667f * a;
+		param[4] = 0.6666667f * tau;
+		param[5] = 0.1666667f * a;
+		param[6] = 0.3333333f * tau;
+		break;
+	case 4:
+		*fitfunc = GCI_stretchedexp;
+		nparam = 4;
+		param[0] = z;
+		param[1] = a;
+		param[2] = tau;
+		param[3] = 1.5f;
+		break;
+	}
+	for (i=0; i<nparam; i++)
+		paramfree[i] = 1;
+	return nparam;
+}
+
+/* The lifetime to compare with the true one */
+static double bench_mean_tau(int model, const float param[], int nparam)
+{
+	double num = 0.0, den = 0.0;
+	int i;
+
+	if (model == 4)
+		return param[2];
+	for (i=1; i<nparam-1; i+=2) {
+		num += (double) param[i] * param[i+1] * param[i+1];
+		den += (double) param[i] * param[i+1];
+	}
+	return (den != 0.0) ? num / den : 0.0;
+}
+
+static void bench_accumulate(bench_result *r, int ret, double chisq, double tau, double tau_true)
+{
+	double err;
+
+	if (ret < 0 || !(tau > 0.0) || tau != tau) {
+		r->failures++;
+		return;
+	}
+	r->iterations += ret;
+	r->chisq += chisq;
+	err = (tau - tau_true) / tau_true;
+	r->bias += err;
+	r->rms += err * err;
+	r->naccurate++;
+}
+
+/* Runs the three stages over all of the decays for one model and noise
+   type.  Returns 0 on success, -1 if out of memory. */
+static int bench_run(const bench_config *cfg, bench_decay *decays, double tau_true,
+					 int model, noise_type noise, bench_result res[3])
+{
+	ecf_workspace *ws;
+	float **covar, **alpha, **erraxes, *fitted, *residuals;
+	float *rld;
+	float param[7], z, a, tau, chisq;
+	int paramfree[7];
+	int i, stage, nparam, ret, df;
+	void (*fitfunc)(float, float [], float *, float [], int);
+	double t0;
+
+	ws = GCI_ecf_workspace(cfg->nbins, 7);
+	covar = GCI_ecf_matrix(7, 7);
+	alpha = GCI_ecf_matrix(7, 7);
+	erraxes = GCI_ecf_matrix(7, 7);
+	fitted = (float *) malloc((size_t) cfg->nbins * sizeof(float));
+	residuals = (float *) malloc((size_t) cfg->nbins * sizeof(float));
+	rld = (float *) malloc((size_t) 3 * cfg->ndecays * sizeof(float));
+	if (ws == NULL || covar == NULL || alpha == NULL || erraxes == NULL ||
+		fitted == NULL || residuals == NULL || rld == NULL) {
+		GCI_ecf_free_workspace(ws);
+		GCI_ecf_free_matrix(covar);
+		GCI_ecf_free_matrix(alpha);
+		GCI_ecf_free_matrix(erraxes);
+		free(fitted);
+		free(residuals);
+		free(rld);
+		return -1;
+	}
+
+	memset(res, 0, 3 * sizeof(bench_result));
+
+	for (stage=0; stage<3; stage++) {
+		t0 = bench_seconds();
+		for (i=0; i<cfg->ndecays; i++) {
+			bench_decay *d = &decays[i];
+
+			/* RLD from the blind estimates of mxSlimCurve.c */
+			if (stage != 1) {
+				z = 0.0f;
+				a = 1000.0f;
+				tau = 2.0f;
+				df = d->fit_end - d->fit_start - 3;
+				ret = GCI_triple_integral_fitting_engine_ws(ws, cfg->range / cfg->nbins,
+							d->trans, d->fit_start, d->fit_end,
+							d->prompt, d->nprompt, noise, d->sig,
+							&z, &a, &tau, fitted, residuals, &chisq, 1.1f * df);
+				if (stage == 0) {
+					rld[3*i] = z;
+					rld[3*i+1] = a;
+					rld[3*i+2] = tau;
+					bench_accumulate(&res[0], ret, chisq / df, tau, tau_true);
+					continue;
+				}
+			} else {
+				z = rld[3*i];
+				a = rld[3*i+1];
+				tau = rld[3*i+2];
+			}
+
+			nparam = bench_initial_params(model, z, a, tau, param, paramfree, &fitfunc);
+			df = d->fit_end - d->fit_start - nparam;
+			ret = GCI_marquardt_fitting_engine_ws(ws, cfg->range / cfg->nbins,
+						d->trans, d->ndata, d->fit_start, d->fit_end,
+						d->prompt, d->nprompt, noise, d->sig,
+						param, paramfree, nparam, ECF_RESTRAIN_DEFAULT, fitfunc,
+						fitted, residuals, &chisq, covar, alpha, erraxes,
+						1.1f * df, 0.001f, 95);
+			bench_accumulate(&res[stage], ret, chisq / df,
+							 bench_mean_tau(model, param, nparam), tau_true);
+		}
+		res[stage].seconds = bench_seconds() - t0;
+	}
+
+	GCI_ecf_free_workspace(ws);
+	GCI_ecf_free_matrix(covar);
+	GCI_ecf_free_matrix(alpha);
+	GCI_ecf_free_matrix(erraxes);
+	free(fitted);
+	free(residuals);
+	free(rld);
+	return 0;
+}
+
+
+/********************************************************************
+
+							   OUTPUT
+
+ ********************************************************************/
+
+static void bench_print_header(const bench_config *cfg, double tau_true)
+{
+	int i;
+
+	if (cfg->csv) {
+		printf("stage,model,noise,method,decays,bins,seconds,fits_per_sec,"
+			   "mean_iterations,failures,mean_chisq,tau_true,tau_bias,tau_rms\n");
+		return;
+	}
+
+	printf("{\n  \"config\": {\"decays\": %d, \"bins\": %d, \"range\": %g, \"tau\": [",
+		   cfg->ndecays, cfg->nbins, cfg->range);
+	for (i=0; i<cfg->ncomp; i++)
+		printf("%s%g", i ? ", " : "", cfg->tau[i]);
+	printf("], \"photons\": [");
+	for (i=0; i<cfg->ncomp; i++)
+		printf("%s%g", i ? ", " : "", cfg->photons[i]);
+	printf("], \"background\": %g, \"prompt_sigma\": %g, \"offset\": %g,\n"
+		   "             \"method\": \"%s\", \"accuracy\": \"%s\", \"seed\": %lu,"
+		   " \"tau_true\": %.6g},\n  \"results\": [",
+		   cfg->background, cfg->prompt_sigma, cfg->offset,
+		   cfg->method == ECF_METHOD_VARPRO ? "varpro" : "marquardt",
+		   cfg->accuracy == ECF_ACCURACY_FAST ? "fast" : "libm",
+		   cfg->seed, tau_true);
+}
+
+static void bench_print_result(const bench_config *cfg, int first, int stage,
+							   int model, int noise, const bench_result *r,
+							   double tau_true)
+{
+	int n = r->naccurate;
+	double fps = (r->seconds > 0.0) ? cfg->ndecays / r->seconds : 0.0;
+	double iters = n ? r->iterations / n : 0.0;
+	double chisq = n ? r->chisq / n : 0.0;
+	double bias = n ? r->bias / n : 0.0;
+	double rms = n ? sqrt(r->rms / n) : 0.0;
+	const char *method = (cfg->method == ECF_METHOD_VARPRO) ? "varpro" : "marquardt";
+
+	if (cfg->csv) {
+		printf("%s,%s,%s,%s,%d,%d,%.6g,%.6g,%.4g,%d,%.6g,%.6g,%.6g,%.6g\n",
+			   bench_stage_names[stage], bench_model_names[model],
+			   bench_noise_names[noise], method, cfg->ndecays, cfg->nbins,
+			   r->seconds, fps, iters, r->failures, chisq, tau_true, bias, rms);
+		return;
+	}
+
+	printf("%s\n    {\"stage\": \"%s\", \"model\": \"%s\", \"noise\": \"%s\","
+		   " \"method\": \"%s\", \"seconds\": %.6g, \"fits_per_sec\": %.6g,\n"
+		   "     \"mean_iterations\": %.4g, \"failures\": %d, \"mean_chisq\": %.6g,"
+		   " \"tau_bias\": %.6g, \"tau_rms\": %.6g}",
+		   first ? "" : ",", bench_stage_names[stage], bench_model_names[model],
+		   bench_noise_names[noise], method, r->seconds, fps,
+		   iters, r->failures, chisq, bias, rms);
+}
+
+
+/********************************************************************
+
+							COMMAND LINE
+
+ ********************************************************************/
+
+/* Parses a comma separated list of at most max numbers; returns how
+   many there were, or -1 on error */
+static int bench_parse_list(const char *s, double *v, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (*s) {
+		if (n == max)
+			return -1;
+		v[n++] = strtod(s, &end);
+		if (end == s)
+			return -1;
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+	return n;
+}
+
+static void bench_usage(void)
+{
+	fprintf(stderr,
+			"Usage: EcfBenchmark [options]\n"
+			"  -n N          decays per model and noise type (1000)\n"
+			"  -b BINS       number of time bins (256)\n"
+			"  -r RANGE      time range in ns (10)\n"
+			"  -t TAU,...    lifetimes of the components in ns (2)\n"
+			"  -p N,...      photons in each component (10000)\n"
+			"  -g N          background photons (300)\n"
+			"  -s SIGMA      standard deviation of the prompt in ns (0.05)\n"
+			"  -o OFFSET     start of the transient in ns (1)\n"
+			"  -m M,...      models: 1, 2, 3 exponentials, 4 stretched (1,2,3,4)\n"
+			"  -e E,...      noise models, as in mxSlimCurve.c (0,1,2,3,4,5)\n"
+			"  -M METHOD     marquardt or varpro (marquardt)\n"
+			"  -A ACCURACY   libm or fast (libm)\n"
+			"  -x SEED       random number seed (1)\n"
+			"  -f FORMAT     json or csv (json)\n");
+}
+
+static int bench_parse_args(int argc, char *argv[], bench_config *cfg)
+{
+	double v[BENCH_MAXCOMP];
+	int i, j, n;
+	char opt;
+	const char *arg;
+
+	cfg->ndecays = 1000;
+	cfg->nbins = 256;
+	cfg->range = 10.0f;
+	cfg->ncomp = 1;
+	cfg->tau[0] = 2.0;
+	cfg->photons[0] = 10000.0;
+	cfg->background = 300.0;
+	cfg->prompt_sigma = 0.05;
+	cfg->offset = 1.0;
+	cfg->nmodels = 4;
+	for (i=0; i<4; i++)
+		cfg->models[i] = i + 1;
+	cfg->nnoises = 6;
+	for (i=0; i<6; i++)
+		cfg->noises[i] = i;
+	cfg->method = ECF_METHOD_MARQUARDT;
+	cfg->accuracy = ECF_ACCURACY_LIBM;
+	cfg->seed = 1;
+	cfg->csv = 0;
+	n = 1;  /* number of photon counts given */
+
+	for (i=1; i<argc; i+=2) {
+		if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i+1 >= argc)
+			return -1;
+		opt = argv[i][1];
+		arg = argv[i+1];
+
+		switch (opt) {
+		case 'n': cfg->ndecays = atoi(arg); break;
+		case 'b': cfg->nbins = atoi(arg); break;
+		case 'r': cfg->range = (float) atof(arg); break;
+		case 'g': cfg->background = atof(arg); break;
+		case 's': cfg->prompt_sigma = atof(arg); break;
+		case 'o': cfg->offset = atof(arg); break;
+		case 'x': cfg->seed = strtoul(arg, NULL, 10); break;
+		case 't':
+			if ((cfg->ncomp = bench_parse_list(arg, cfg->tau, BENCH_MAXCOMP)) < 1)
+				return -1;
+			break;
+		case 'p':
+			if ((n = bench_parse_list(arg, cfg->photons, BENCH_MAXCOMP)) < 1)
+				return -1;
+			break;
+		case 'm':
+			if ((cfg->nmodels = bench_parse_list(arg, v, 4)) < 1)
+				return -1;
+			for (j=0; j<cfg->nmodels; j++) {
+				cfg->models[j] = (int) v[j];
+				if (cfg->models[j] < 1 || cfg->models[j] > 4)
+					return -1;
+			}
+			break;
+		case 'e':
+			if ((cfg->nnoises = bench_parse_list(arg, v, 6)) < 1)
+				return -1;
+			for (j=0; j<cfg->nnoises; j++) {
+				cfg->noises[j] = (int) v[j];
+				if (cfg->noises[j] < 0 || cfg->noises[j] > 5)
+					return -1;
+			}
+			break;
+		case 'M':
+			if (strcmp(arg, "varpro") == 0)
+				cfg->method = ECF_METHOD_VARPRO;
+			else if (strcmp(arg, "marquardt") != 0)
+				return -1;
+			break;
+		case 'A':
+			if (strcmp(arg, "fast") == 0)
+				cfg->accuracy = ECF_ACCURACY_FAST;
+			else if (strcmp(arg, "libm") != 0)
+				return -1;
+			break;
+		case 'f':
+			if (strcmp(arg, "csv") == 0)
+				cfg->csv = 1;
+			else if (strcmp(arg, "json") != 0)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	/* As in createDecay.m, one photon count per lifetime */
+	if (n != cfg->ncomp)
+		return -1;
+	for (j=0; j<cfg->ncomp; j++)
+		if (!(cfg->tau[j] > 0.0) || cfg->photons[j] < 0.0)
+			return -1;
+	if (cfg->ndecays < 1 || cfg->nbins < 8 || !(cfg->range > 0.0f) ||
+		cfg->prompt_sigma < 0.0 || !(cfg->offset > 0.0) || cfg->offset >= cfg->range)
+		return -1;
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	bench_config cfg;
+	bench_decay *decays;
+	bench_result res[3];
+	double num, den, tau_true;
+	int i, m, e, stage, first;
+
+	if (bench_parse_args(argc, argv, &cfg) != 0) {
+		bench_usage();
+		return 1;
+	}
+
+	GCI_set_method(cfg.method);
+	GCI_set_accuracy(cfg.accuracy);
+	bench_srand(cfg.seed);
+
+	/* The intensity weighted mean lifetime of the simulated decays; the
+	   photons of each component are proportional to A tau */
+	for (i=0, num=den=0.0; i<cfg.ncomp; i++) {
+		num += cfg.photons[i] * cfg.tau[i];
+		den += cfg.photons[i];
+	}
+	tau_true = num / den;
+
+	if ((decays = (bench_decay *) calloc((size_t) cfg.ndecays, sizeof(bench_decay))) == NULL) {
+		fprintf(stderr, "EcfBenchmark: out of memory\n");
+		return 2;
+	}
+	for (i=0; i<cfg.ndecays; i++) {
+		if (bench_make_decay(&cfg, &decays[i]) != 0) {
+			fprintf(stderr, "EcfBenchmark: out of memory\n");
+			return 2;
+		}
+	}
+
+	bench_print_header(&cfg, tau_true);
+	first = 1;
+	for (m=0; m<cfg.nmodels; m++) {
+		for (e=0; e<cfg.nnoises; e++) {
+			if (bench_run(&cfg, decays, tau_true, cfg.models[m],
+						  (noise_type) cfg.noises[e], res) != 0) {
+				fprintf(stderr, "EcfBenchmark: out of memory\n");
+				return 2;
+			}
+			for (stage=0; stage<3; stage++) {
+				bench_print_result(&cfg, first, stage, cfg.models[m],
+								   cfg.noises[e], &res[stage], tau_true);
+				first = 0;
+			}
+			fflush(stdout);
+		}
+	}
+	if (!cfg.csv)
+		printf("\n  ]\n}\n");
+
+	for (i=0; i<cfg.ndecays; i++)
+		bench_free_decay(&decays[i]);
+	free(decays);
+	return 0;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
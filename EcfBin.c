@@ -0,0 +1,161 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the spatial binning of FLIM images: each pixel's
+   transient is replaced by the sum of the transients of the pixels
+   around it, to get enough counts to fit.
+
+   The sums come from summed-area tables, one for each time bin: S[c][r]
+   is the total of the pixels in columns 0..c-1 and rows 0..r-1, so the
+   total over any rectangle is four lookups, whatever its size.  A
+   square bin is one rectangle; a circular bin is a column of a
+   different height for each column it covers, one rectangle each.
+
+   Only the columns of the table which the bins of the current column
+   reach are kept, in a ring buffer, so the tables take
+   (2*radius+2)*(rows+1)*ndata doubles rather than the size of the
+   whole image.  The image is read once, a column at a time.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+/* Bin a rows x cols image of transients, each of ndata points, with
+   transient t = r + c*rows (the pixel in row r and column c) at
+   trans[t*ndata..t*ndata+ndata-1], as in a MATLAB array.  binned[],
+   which must not overlap trans[], receives the binned image laid out
+   in the same way.
+
+   With ECF_BIN_SQUARE each pixel gets the sum over the (2*radius+1) x
+   (2*radius+1) pixels centred on it; with ECF_BIN_CIRCLE, over the
+   pixels within radius of it.  Bins are cut off at the edges of the
+   image.  Radius 0 copies the image.
+
+   Returns 0 on success, -1 if the arguments are bad or -2 if out of
+   memory. */
+
+int GCI_ecf_bin_image(float trans[], int ndata, int rows, int cols,
+					  int radius, ecf_bin_shape shape, float binned[])
+{
+	double *ring, *colsum, *s, *prev, *hi, *lo, *hi1, *lo1;
+	int *height = NULL;
+	int nring, r, c, k, j, next, r1, r2, cc;
+	size_t slice;
+	float *in, *out;
+
+	if (trans == NULL || binned == NULL || ndata < 1 || rows < 1 || cols < 1 ||
+		radius < 0 || (shape != ECF_BIN_SQUARE && shape != ECF_BIN_CIRCLE))
+		return -1;
+
+	if (radius == 0) {
+		memcpy(binned, trans, (size_t) rows * cols * ndata * sizeof(float));
+		return 0;
+	}
+
+	/* Column j of the table is held in slot j % nring */
+	nring = 2*radius + 2;
+	slice = (size_t) (rows + 1) * ndata;
+	ring = (double *) malloc((size_t) nring * slice * sizeof(double));
+	colsum = (double *) malloc((size_t) ndata * sizeof(double));
+	if (shape == ECF_BIN_CIRCLE)
+		height = (int *) malloc((size_t) (2*radius + 1) * sizeof(int));
+	if (ring == NULL || colsum == NULL || (shape == ECF_BIN_CIRCLE && height == NULL)) {
+		free(ring);
+		free(colsum);
+		free(height);
+		return -2;
+	}
+
+	/* Half the height of the circle at each column offset */
+	if (height != NULL)
+		for (j=-radius; j<=radius; j++)
+			height[j+radius] = (int) floor(sqrt((double) radius*radius - (double) j*j));
+
+	next = 0;  /* next column of the table to work out */
+	for (c=0; c<cols; c++) {
+		int lo_col = (c - radius < 0) ? 0 : c - radius;
+		int hi_col = (c + radius + 1 > cols) ? cols : c + radius + 1;
+
+		/* Extend the table to column hi_col, adding image column next-1
+		   to the previous column of the table */
+		for ( ; next <= hi_col; next++) {
+			s = ring + (size_t) (next % nring) * slice;
+			if (next == 0) {
+				memset(s, 0, slice * sizeof(double));
+				continue;
+			}
+			prev = ring + (size_t) ((next - 1) % nring) * slice;
+			in = trans + (size_t) (next - 1) * rows * ndata;
+			for (k=0; k<ndata; k++)
+				s[k] = colsum[k] = 0.0;
+			for (r=0; r<rows; r++)
+				for (k=0; k<ndata; k++) {
+					colsum[k] += in[(size_t) r*ndata + k];
+					s[(size_t) (r+1)*ndata + k] = prev[(size_t) (r+1)*ndata + k] + colsum[k];
+				}
+		}
+
+		out = binned + (size_t) c * rows * ndata;
+		if (shape == ECF_BIN_SQUARE) {
+			hi = ring + (size_t) (hi_col % nring) * slice;
+			lo = ring + (size_t) (lo_col % nring) * slice;
+			for (r=0; r<rows; r++) {
+				r1 = (r - radius < 0) ? 0 : r - radius;
+				r2 = (r + radius + 1 > rows) ? rows : r + radius + 1;
+				for (k=0; k<ndata; k++)
+					out[(size_t) r*ndata + k] = (float)
+						(hi[(size_t) r2*ndata + k] - hi[(size_t) r1*ndata + k] -
+						 lo[(size_t) r2*ndata + k] + lo[(size_t) r1*ndata + k]);
+			}
+		}
+		else {
+			for (r=0; r<rows; r++) {
+				for (k=0; k<ndata; k++)
+					colsum[k] = 0.0;
+				for (cc=lo_col; cc<hi_col; cc++) {
+					int h = height[cc - c + radius];
+					r1 = (r - h < 0) ? 0 : r - h;
+					r2 = (r + h + 1 > rows) ? rows : r + h + 1;
+					hi1 = ring + (size_t) ((cc + 1) % nring) * slice;
+					lo1 = ring + (size_t) (cc % nring) * slice;
+					for (k=0; k<ndata; k++)
+						colsum[k] += hi1[(size_t) r2*ndata + k] - hi1[(size_t) r1*ndata + k] -
+							lo1[(size_t) r2*ndata + k] + lo1[(size_t) r1*ndata + k];
+				}
+				for (k=0; k<ndata; k++)
+					out[(size_t) r*ndata + k] = (float) colsum[k];
+			}
+		}
+	}
+
+	free(ring);
+	free(colsum);
+	free(height);
+	return 0;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
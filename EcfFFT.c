@@ -0,0 +1,224 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the FFT convolution used by the instrument response
+   fitting routines of EcfSingle.c when the prompt is long.
+
+   The direct convolution costs O(npts * ninstr) for the model and for
+   each derivative column.  Here all the columns are convolved by FFT
+   instead, at O(N log N) per pair of columns, where N is a power of two
+   long enough that the circular convolution does not wrap around onto
+   the points we want.  The prompt is real, so two real columns can be
+   packed into the real and imaginary parts of one complex transform and
+   multiplied by the prompt spectrum together; the two convolved columns
+   then come straight back out of the real and imaginary parts.
+
+   The prompt spectrum is cached in the fitting workspace, so when a
+   whole image is fitted with the same prompt it is only transformed
+   once per workspace.  The transforms are done in double precision.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* In-place radix-2 complex FFT of z[0..2n-1] (interleaved real and
+   imaginary parts); n must be a power of two and w[] must hold the n/2
+   roots of unity exp(-2 pi i k/n).  Unscaled in both directions. */
+static void ecf_fft(double *z, int n, const double *w, int inverse)
+{
+	int i, j, k, bit, len, half, step;
+	double t, wr, wi, tr, ti;
+	double *a, *b;
+
+	/* bit-reversal permutation */
+	for (i=1, j=0; i<n; i++) {
+		for (bit = n>>1; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			t = z[2*i];   z[2*i] = z[2*j];     z[2*j] = t;
+			t = z[2*i+1]; z[2*i+1] = z[2*j+1]; z[2*j+1] = t;
+		}
+	}
+
+	for (len=2; len<=n; len<<=1) {
+		half = len >> 1;
+		step = n / len;
+		for (i=0; i<n; i+=len) {
+			for (k=0; k<half; k++) {
+				wr = w[2*k*step];
+				wi = inverse ? -w[2*k*step+1] : w[2*k*step+1];
+				a = z + 2*(i+k);
+				b = z + 2*(i+k+half);
+				tr = b[0]*wr - b[1]*wi;
+				ti = b[0]*wi + b[1]*wr;
+				b[0] = a[0] - tr;
+				b[1] = a[1] - ti;
+				a[0] += tr;
+				a[1] += ti;
+			}
+		}
+	}
+}
+
+/* Makes sure that ws holds the spectrum of instr[0..ninstr-1] for
+   transforms of length n, recalculating it only if the prompt or the
+   length have changed.  Returns 0 on success, -1 if out of memory. */
+static int ecf_fft_prompt(ecf_workspace *ws, float instr[], int ninstr, int n)
+{
+	int i;
+	double *p;
+
+	if (n == ws->fft_n && ninstr == ws->fft_ninstr &&
+		memcmp(instr, ws->fft_instr, (size_t) ninstr * sizeof(float)) == 0)
+		return 0;
+
+	if (n > ws->fft_size) {
+		free(ws->fft_prompt);
+		free(ws->fft_buf);
+		free(ws->fft_twiddle);
+		ws->fft_prompt = (double *) malloc((size_t) 2 * n * sizeof(double));
+		ws->fft_buf = (double *) malloc((size_t) 2 * n * sizeof(double));
+		ws->fft_twiddle = (double *) malloc((size_t) n * sizeof(double));
+		ws->fft_size = 0;
+		ws->fft_n = 0;
+		if (ws->fft_prompt == NULL || ws->fft_buf == NULL || ws->fft_twiddle == NULL)
+			return -1;
+		ws->fft_size = n;
+	}
+	if (ninstr > ws->fft_instr_size) {
+		free(ws->fft_instr);
+		ws->fft_instr_size = 0;
+		ws->fft_n = 0;
+		if ((ws->fft_instr = (float *) malloc((size_t) ninstr * sizeof(float))) == NULL)
+			return -1;
+		ws->fft_instr_size = ninstr;
+	}
+
+	if (n != ws->fft_n) {
+		for (i=0; i<n/2; i++) {
+			ws->fft_twiddle[2*i] = cos(2 * M_PI * i / n);
+			ws->fft_twiddle[2*i+1] = -sin(2 * M_PI * i / n);
+		}
+	}
+
+	/* The 1/n of the inverse transform is folded into the spectrum */
+	p = ws->fft_prompt;
+	for (i=0; i<ninstr; i++) {
+		p[2*i] = instr[i] / (double) n;
+		p[2*i+1] = 0.0;
+	}
+	for (i=ninstr; i<n; i++)
+		p[2*i] = p[2*i+1] = 0.0;
+	ecf_fft(p, n, ws->fft_twiddle, 0);
+
+	memcpy(ws->fft_instr, instr, (size_t) ninstr * sizeof(float));
+	ws->fft_ninstr = ninstr;
+	ws->fft_n = n;
+	return 0;
+}
+
+/* Convolves fnvals[0..npts-1] with instr[0..ninstr-1] into
+   yfit[0..npts-1], and likewise each of the derivative columns
+   dy_dparam_pure[.][1..nparam-1] into dy_dparam_conv[.][1..nparam-1],
+   exactly as the direct convolution in EcfSingle.c does.
+   dy_dparam_pure may be NULL if only the function values are wanted.
+   Returns 0 on success, -1 on failure (out of memory), in which case
+   the caller should convolve directly. */
+int ecf_fft_convolve(ecf_workspace *ws, float instr[], int ninstr,
+					 float fnvals[], float **dy_dparam_pure,
+					 float yfit[], float **dy_dparam_conv,
+					 int npts, int nparam)
+{
+	int i, k, n, ncols;
+	double re, im, *z, *h;
+
+	if (npts < 1 || ninstr < 1)
+		return -1;
+
+	/* Prompt values beyond npts can never contribute */
+	if (ninstr > npts)
+		ninstr = npts;
+
+	for (n=2; n < npts + ninstr - 1; n <<= 1)
+		;
+
+	if (ecf_fft_prompt(ws, instr, ninstr, n) != 0)
+		return -1;
+	z = ws->fft_buf;
+	h = ws->fft_prompt;
+
+	/* Column 0 is the function itself, columns 1..nparam-1 the
+	   derivatives; they are done two at a time */
+	ncols = (dy_dparam_pure == NULL) ? 1 : nparam;
+	for (k=0; k<ncols; k+=2) {
+		for (i=0; i<npts; i++) {
+			z[2*i] = (k == 0) ? fnvals[i] : dy_dparam_pure[i][k];
+			z[2*i+1] = (k+1 < ncols) ? dy_dparam_pure[i][k+1] : 0.0;
+		}
+		for (i=npts; i<n; i++)
+			z[2*i] = z[2*i+1] = 0.0;
+
+		ecf_fft(z, n, ws->fft_twiddle, 0);
+		for (i=0; i<n; i++) {
+			re = z[2*i]*h[2*i] - z[2*i+1]*h[2*i+1];
+			im = z[2*i]*h[2*i+1] + z[2*i+1]*h[2*i];
+			z[2*i] = re;
+			z[2*i+1] = im;
+		}
+		ecf_fft(z, n, ws->fft_twiddle, 1);
+
+		for (i=0; i<npts; i++) {
+			if (k == 0)
+				yfit[i] = (float) z[2*i];
+			else
+				dy_dparam_conv[i][k] = (float) z[2*i];
+			if (k+1 < ncols)
+				dy_dparam_conv[i][k+1] = (float) z[2*i+1];
+		}
+	}
+
+	return 0;
+}
+
+/* Frees the FFT arrays of a workspace */
+void ecf_fft_free(ecf_workspace *ws)
+{
+	free(ws->fft_instr);
+	free(ws->fft_prompt);
+	free(ws->fft_buf);
+	free(ws->fft_twiddle);
+	ws->fft_instr = NULL;
+	ws->fft_prompt = ws->fft_buf = ws->fft_twiddle = NULL;
+	ws->fft_n = ws->fft_ninstr = ws->fft_size = ws->fft_instr_size = 0;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
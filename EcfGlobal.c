@@ -0,0 +1,987 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the global analysis: fitting many transients at
+   once, with some of the parameters (the global ones, typically the
+   lifetimes) shared by all of them and the rest (the local ones,
+   typically Z and the amplitudes) belonging to each transient.
+
+   The fit is a single Levenberg-Marquardt fit of all of the
+   parameters, but the normal equations are never formed as one matrix.
+   Each transient's local parameters only touch its own data, so with
+   the local parameters of each transient in turn followed by the global
+   ones, the matrix has the block arrow form
+
+       [ U_1               V_1^T ]   [ dl_1 ]   [ b_1 ]
+       [      U_2          V_2^T ]   [ dl_2 ]   [ b_2 ]
+       [           ...      ...  ] . [  ... ] = [ ... ]
+       [ V_1  V_2  ...     A     ]   [ dg   ]   [ bg  ]
+
+   where U_t and b_t are the sums over transient t of the local
+   parameters, V_t couples them to the global ones, and A and bg are
+   the sums for the global parameters over all of the transients.
+   Eliminating the local parameters leaves the Schur complement
+
+       (A - sum_t V_t U_t^-1 V_t^T) dg = bg - sum_t V_t U_t^-1 b_t
+
+   which is only as big as the number of global parameters, and then
+   each dl_t = U_t^-1 (b_t - V_t^T dg).  So the work and storage grow
+   linearly with the number of transients, and everything to do with
+   one transient (its fit, its blocks, its share of the Schur
+   complement and its step) is done independently of the others, on
+   as many threads as OpenMP gives us.
+
+   The blocks are built, and the sums made, in double precision, since
+   they add up over all of the transients.  The sums of each thread are
+   added together in thread order, so the results do not depend on the
+   timing of the threads.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* How many times the step is worked out again with more of the local
+   parameters held at their restraints, and how many times the local
+   step of a transient is then halved before it is given up (see
+   ecf_global_step()) */
+#define ECF_GLOBAL_PASSES 3
+#define ECF_GLOBAL_HALVINGS 4
+
+/* Everything about a global fit which stays the same from one step to
+   the next */
+typedef struct {
+	float xincr;
+	float **trans;
+	int ndata, ntrans, fit_start, fit_end;
+	float *instr;
+	int ninstr;
+	noise_type noise;
+	float *sig;
+	int nparam;
+	void (*fitfunc)(float, float [], float *, float [], int);
+	restrain_type restrain;
+	const ecf_restraint *restraint;  /* ECF_RESTRAIN_USER limits, or NULL */
+	const int *use;        /* whether each transient is fitted */
+	int loc[MAXFIT], nl;   /* the free local parameters */
+	int glob[MAXFIT], ng;  /* the free global parameters */
+	int nblock;            /* doubles in the blocks of each transient */
+	int nstep;             /* doubles in the step scratch of each transient */
+	int nthreads;
+	ecf_workspace **ws;    /* one per thread */
+	float **yfit;          /* one per thread */
+	double *partial;       /* per-thread sums, nthreads * (ng*ng + ng) */
+	int *held;             /* local parameters held in each transient's step */
+} ecf_global;
+
+/* Cholesky factorisation of the symmetric n x n matrix a[] (by rows) in
+   place, into its lower triangle.  Returns -1 if a[] is not positive
+   definite. */
+static int ecf_global_cholesky(double *a, int n)
+{
+	int i, j, k;
+	double s;
+
+	for (j=0; j<n; j++) {
+		s = a[j*n+j];
+		for (k=0; k<j; k++)
+			s -= a[j*n+k] * a[j*n+k];
+		if (!(s > 0.0))
+			return -1;
+		a[j*n+j] = sqrt(s);
+		for (i=j+1; i<n; i++) {
+			s = a[i*n+j];
+			for (k=0; k<j; k++)
+				s -= a[i*n+k] * a[j*n+k];
+			a[i*n+j] = s / a[j*n+j];
+		}
+	}
+	return 0;
+}
+
+/* Solves a x = b in place in b[], given the factor l[] of a[] */
+static void ecf_global_cholesky_solve(const double *l, int n, double *b)
+{
+	int i, k;
+	double s;
+
+	for (i=0; i<n; i++) {
+		s = b[i];
+		for (k=0; k<i; k++)
+			s -= l[i*n+k] * b[k];
+		b[i] = s / l[i*n+i];
+	}
+	for (i=n-1; i>=0; i--) {
+		s = b[i];
+		for (k=i+1; k<n; k++)
+			s -= l[k*n+i] * b[k];
+		b[i] = s / l[i*n+i];
+	}
+}
+
+/* The weights of point q in the alpha and beta sums and its share of
+   chi-squared, for each type of noise, as in
+   GCI_marquardt_compute_fn_instr(), or if final is set its share of the
+   chi-squared reported at the end, as in
+   GCI_marquardt_compute_fn_final_instr() */
+static float ecf_global_weights(noise_type noise, float sig[], int q,
+								float y, float yfit, float *aw, float *bw,
+								int final)
+{
+	float dy = y - yfit, weight;
+
+	if (final && noise != NOISE_MLE) {
+		switch (noise) {
+			case NOISE_CONST:
+				weight = 1.0f / (sig[0] * sig[0]);
+				break;
+			case NOISE_GIVEN:
+				weight = 1.0f / (sig[q] * sig[q]);
+				break;
+			case NOISE_POISSON_DATA:
+				weight = (y > 1 ? 1.0f / y : 1.0f);
+				break;
+			default:
+				weight = (yfit > 1 ? 1.0f / yfit : 1.0f);
+				break;
+		}
+		*aw = *bw = 0.0f;
+		return weight * dy * dy;
+	}
+
+	switch (noise) {
+		case NOISE_CONST:
+			weight = 1.0f / sig[0];
+			break;
+		case NOISE_GIVEN:
+			weight = 1.0f / (sig[q] * sig[q]);
+			break;
+		case NOISE_POISSON_DATA:
+			weight = (y > 15 ? 1.0f / y : 1.0f / 15);
+			break;
+		case NOISE_POISSON_FIT:
+			weight = (yfit > 15 ? 1.0f / yfit : 1.0f / 15);
+			break;
+		case NOISE_GAUSSIAN_FIT:
+			weight = (yfit > 1.0f ? 1.0f / yfit : 1.0f);
+			break;
+		case NOISE_MLE:
+			weight = (yfit > 1 ? 1.0f / yfit : 1.0f);
+			*aw = weight * y / yfit;
+			*bw = dy * weight;
+			if (yfit <= 0.0f)
+				return 0.0f;
+			return (0.0f == y) ? 2.0f * yfit
+				: 2.0f * (yfit - y) - 2.0f * y * logf(yfit / y);
+		default:
+			weight = 0.0f;
+			break;
+	}
+
+	*aw = weight;
+	*bw = weight * dy;
+	return weight * dy * dy;
+}
+
+/* Fits transient t with param[], returning its chi-squared.  If blk is
+   not NULL, its blocks U_t, V_t and b_t are stored there and its shares
+   of A and bg added to ag[] and bg[]; if it is NULL, this is the final
+   fit and the chi-squared is the one to report.  fitted and residuals,
+   if not NULL, are filled in from fit_start to fit_end-1. */
+static float ecf_global_transient(ecf_global *g, int t, float param[],
+								  ecf_workspace *ws, float yfit[],
+								  double *blk, double *ag, double *bg,
+								  float *fitted, float *residuals)
+{
+	int nl = g->nl, ng = g->ng;
+	double *u = NULL, *v = NULL, *bl = NULL;
+	float *y = g->trans[t], *d, aw, bw;
+	float chisq = 0.0f;
+	int q, a, b, i, j;
+
+	ecf_compute_fn_model_instr(g->xincr, g->fit_start, g->fit_end,
+							   g->instr, g->ninstr, param, g->nparam,
+							   g->fitfunc, yfit, ws);
+
+	if (blk != NULL) {
+		memset(blk, 0, (size_t) g->nblock * sizeof(double));
+		u = blk;
+		v = blk + nl*nl;
+		bl = blk + nl*nl + ng*nl;
+	}
+
+	for (q=g->fit_start; q<g->fit_end; q++) {
+		d = ws->dy_dparam_conv[q];
+		d[0] = 1.0f;
+		yfit[q] += param[0];
+		chisq += ecf_global_weights(g->noise, g->sig, q, y[q], yfit[q],
+									&aw, &bw, blk == NULL);
+
+		if (fitted != NULL)
+			fitted[q] = yfit[q];
+		if (residuals != NULL)
+			residuals[q] = y[q] - yfit[q];
+		if (blk == NULL)
+			continue;
+
+		/* lower triangles only; filled in below */
+		for (a=0; a<nl; a++) {
+			float da = d[g->loc[a]];
+			bl[a] += da * bw;
+			for (b=0; b<=a; b++)
+				u[a*nl+b] += da * d[g->loc[b]] * aw;
+		}
+		for (i=0; i<ng; i++) {
+			float di = d[g->glob[i]];
+			bg[i] += di * bw;
+			for (a=0; a<nl; a++)
+				v[i*nl+a] += di * d[g->loc[a]] * aw;
+			for (j=0; j<=i; j++)
+				ag[i*ng+j] += di * d[g->glob[j]] * aw;
+		}
+	}
+
+	if (blk != NULL)
+		for (a=0; a<nl; a++)
+			for (b=0; b<a; b++)
+				u[b*nl+a] = u[a*nl+b];
+
+	if (g->noise == NOISE_MLE && chisq <= 0.0f)
+		chisq = 1.0e38f;  /* don't let chisq=0 through yfit being all -ve */
+
+	return chisq;
+}
+
+/* Fits all of the transients with the parameters p[t*nparam..], giving
+   their chi-squareds in chisq_t[], and if blk is not NULL the blocks of
+   each of them there and the global sums in ag[] and bg[].  Returns the
+   total chi-squared. */
+static double ecf_global_evaluate(ecf_global *g, float *p, float chisq_t[],
+								  double *blk, double *ag, double *bg)
+{
+	int ng = g->ng, npartial = ng*ng + ng;
+	double chisq;
+	int t, i, j;
+
+	memset(g->partial, 0, (size_t) g->nthreads * npartial * sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(g->nthreads)
+#endif
+	{
+		int id = 0, u;
+		double *part;
+
+#ifdef _OPENMP
+		id = omp_get_thread_num();
+#endif
+		part = g->partial + (size_t) id * npartial;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (u=0; u<g->ntrans; u++) {
+			if (!g->use[u])
+				continue;
+			chisq_t[u] = ecf_global_transient(g, u, p + (size_t) u * g->nparam,
+								g->ws[id], g->yfit[id],
+								(blk == NULL) ? NULL : blk + (size_t) u * g->nblock,
+								part, part + ng*ng, NULL, NULL);
+		}
+	}
+
+	chisq = 0.0;
+	for (t=0; t<g->ntrans; t++)
+		if (g->use[t])
+			chisq += chisq_t[t];
+
+	if (blk != NULL) {
+		for (i=0; i<npartial; i++) {
+			double s = 0.0;
+			for (t=0; t<g->nthreads; t++)
+				s += g->partial[(size_t) t * npartial + i];
+			if (i < ng*ng)
+				ag[i] = s;
+			else
+				bg[i - ng*ng] = s;
+		}
+		for (i=0; i<ng; i++)
+			for (j=0; j<i; j++)
+				ag[j*ng+i] = ag[i*ng+j];
+	}
+
+	return chisq;
+}
+
+/* Checks the trial parameters of one transient against the restraints */
+static int ecf_global_check(ecf_global *g, float param[])
+{
+	if (g->restrain == ECF_RESTRAIN_DEFAULT)
+		return check_ecf_params(param, g->nparam, g->fitfunc);
+	else
+		return check_ecf_user_params(g->restraint, param, g->nparam, g->fitfunc);
+}
+
+/* Works out the step for the given alambda from the blocks blk[] and
+   global sums ag[] and bg[] at the parameters p[], and puts the trial
+   parameters in ptry[].  Returns 0 if they can be tried, 1 if they fail
+   the restraints, or -1 if the equations cannot be solved.  dw[] is
+   scratch space for each transient: U_t^-1 V_t^T followed by
+   U_t^-1 b_t.
+
+   A local parameter which would be taken past its restraints on its
+   own, such as an amplitude already at 0, is held where it is in its
+   transient and the step worked out again, up to ECF_GLOBAL_PASSES
+   times, so that one transient at a limit does not hold up all of the
+   others.  Only if a transient cannot take the global step at all is
+   the whole step rejected. */
+static int ecf_global_step(ecf_global *g, const double *blk,
+						   const double *ag, const double *bg, float alambda,
+						   float *p, float *ptry, double *dw)
+{
+	int nl = g->nl, ng = g->ng, npartial = ng*ng + ng;
+	double s[MAXFIT*MAXFIT], dg[MAXFIT];
+	int t, i, j, pass, failed, bad, changed;
+
+	memset(g->held, 0, (size_t) g->ntrans * sizeof(int));
+
+	for (pass=0; ; pass++) {
+		failed = bad = changed = 0;
+		memset(g->partial, 0, (size_t) g->nthreads * npartial * sizeof(double));
+
+		/* Each transient's share of the Schur complement, with the held
+		   parameters given no step */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(g->nthreads) reduction(+:failed)
+#endif
+		{
+			double ud[MAXFIT*MAXFIT], *part;
+			int id = 0, u, a, b, k;
+
+#ifdef _OPENMP
+			id = omp_get_thread_num();
+#endif
+			part = g->partial + (size_t) id * npartial;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+			for (u=0; u<g->ntrans; u++) {
+				const double *bu = blk + (size_t) u * g->nblock;
+				const double *v = bu + nl*nl;
+				double *w = dw + (size_t) u * g->nstep;
+
+				if (!g->use[u] || nl == 0)
+					continue;
+
+				memcpy(ud, bu, (size_t) nl * nl * sizeof(double));
+				memcpy(w, v, (size_t) (ng*nl + nl) * sizeof(double));
+				for (a=0; a<nl; a++) {
+					if (g->held[u] & (1 << a)) {
+						for (b=0; b<nl; b++)
+							ud[a*nl+b] = ud[b*nl+a] = 0.0;
+						ud[a*nl+a] = 1.0;
+						for (k=0; k<=ng; k++)
+							w[k*nl+a] = 0.0;
+					}
+					else
+						ud[a*nl+a] *= 1.0 + alambda;
+				}
+				if (ecf_global_cholesky(ud, nl) != 0) {
+					failed++;
+					continue;
+				}
+
+				for (k=0; k<=ng; k++)
+					ecf_global_cholesky_solve(ud, nl, w + k*nl);
+
+				for (a=0; a<ng; a++) {
+					for (b=0; b<=a; b++)
+						for (k=0; k<nl; k++)
+							part[a*ng+b] += v[a*nl+k] * w[b*nl+k];
+					for (k=0; k<nl; k++)
+						part[ng*ng+a] += v[a*nl+k] * w[ng*nl+k];
+				}
+			}
+		}
+
+		if (failed)
+			return -1;
+
+		/* The global step */
+		for (i=0; i<ng; i++) {
+			for (j=0; j<=i; j++) {
+				double sum = (i == j) ? ag[i*ng+i] * (1.0 + alambda) : ag[i*ng+j];
+				for (t=0; t<g->nthreads; t++)
+					sum -= g->partial[(size_t) t * npartial + i*ng+j];
+				s[i*ng+j] = s[j*ng+i] = sum;
+			}
+			dg[i] = bg[i];
+			for (t=0; t<g->nthreads; t++)
+				dg[i] -= g->partial[(size_t) t * npartial + ng*ng+i];
+		}
+		if (ng > 0) {
+			if (ecf_global_cholesky(s, ng) != 0)
+				return -1;
+			ecf_global_cholesky_solve(s, ng, dg);
+		}
+
+		/* Back substitution for the local steps, and the trial parameters */
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(g->nthreads) schedule(static) reduction(+:bad, changed)
+#endif
+		for (t=0; t<g->ntrans; t++) {
+			const float *pt = p + (size_t) t * g->nparam;
+			float *tt = ptry + (size_t) t * g->nparam;
+			const double *w = dw + (size_t) t * g->nstep;
+			double step[MAXFIT], dgt[MAXFIT], frac;
+			int a, k, h, held;
+
+			for (k=0; k<g->nparam; k++)
+				tt[k] = pt[k];
+			if (!g->use[t])
+				continue;
+
+			for (k=0; k<ng; k++)
+				tt[g->glob[k]] = pt[g->glob[k]] + (float) dg[k];
+			if (ecf_global_check(g, tt) != 0) {
+				bad++;
+				continue;
+			}
+
+			/* The ECF_RESTRAIN_USER limits clip the global step rather than
+			   fail it, so the local step is that for the clipped one */
+			for (k=0; k<ng; k++)
+				dgt[k] = (tt[g->glob[k]] == pt[g->glob[k]] + (float) dg[k]) ?
+					dg[k] : tt[g->glob[k]] - pt[g->glob[k]];
+			for (a=0; a<nl; a++) {
+				step[a] = w[ng*nl+a];
+				for (k=0; k<ng; k++)
+					step[a] -= w[k*nl+a] * dgt[k];
+				tt[g->loc[a]] = pt[g->loc[a]] + (float) step[a];
+			}
+			if (ecf_global_check(g, tt) == 0)
+				continue;
+
+			/* Hold the parameters which break the restraints on their own */
+			if (pass < ECF_GLOBAL_PASSES) {
+				held = 0;
+				for (a=0; a<nl; a++) {
+					for (k=0; k<nl; k++)
+						tt[g->loc[k]] = pt[g->loc[k]];
+					tt[g->loc[a]] = pt[g->loc[a]] + (float) step[a];
+					if (ecf_global_check(g, tt) != 0) {
+						g->held[t] |= 1 << a;
+						held++;
+					}
+				}
+				if (held > 0) {
+					changed++;
+					continue;
+				}
+			}
+
+			/* Otherwise take as much of the local step as we can */
+			for (h=1, frac=0.5; ; h++, frac*=0.5) {
+				if (h > ECF_GLOBAL_HALVINGS)
+					frac = 0.0;
+				for (a=0; a<nl; a++)
+					tt[g->loc[a]] = pt[g->loc[a]] + (float) (frac * step[a]);
+				if (ecf_global_check(g, tt) == 0)
+					break;
+				if (frac == 0.0) {
+					bad++;
+					break;
+				}
+			}
+		}
+
+		if (changed == 0 || bad > 0)
+			return (bad > 0) ? 1 : 0;
+	}
+}
+
+/* Whether the trial parameters ptry[] differ from p[] anywhere */
+static int ecf_global_moved(const ecf_global *g, const float *p, const float *ptry)
+{
+	size_t i, n = (size_t) g->ntrans * g->nparam;
+
+	for (i=0; i<n; i++)
+		if (ptry[i] != p[i])
+			return 1;
+	return 0;
+}
+
+/* The global Marquardt fit itself, of the transients with use[t] set;
+   see GCI_marquardt_global_generic_instr_ws() */
+static int ecf_global_fit(const ecf_workspace *wsin, float xincr, float **trans,
+						  int ndata, int ntrans, int fit_start, int fit_end,
+						  float instr[], int ninstr,
+						  noise_type noise, float sig[],
+						  float **param, int paramfree[], int nparam, int gparam[],
+						  restrain_type restrain, float chisq_delta,
+						  void (*fitfunc)(float, float [], float *, float [], int),
+						  float **fitted, float **residuals,
+						  float chisq_trans[], float *chisq_global, int *df,
+						  const int use[])
+{
+	ecf_global g;
+	float *p = NULL, *ptry = NULL, *chisq_t = NULL, *chisq_try = NULL, *swapf;
+	double *blk = NULL, *blk_try = NULL, *dw = NULL, *swapd;
+	double ag[MAXFIT*MAXFIT], bg[MAXFIT], ag_try[MAXFIT*MAXFIT], bg_try[MAXFIT];
+	double chisq, ochisq, chisq_new;
+	float alambda;
+	int i, t, k, itst, itst_max, nused, ret;
+
+	memset(&g, 0, sizeof(g));
+	g.xincr = xincr;
+	g.trans = trans;
+	g.ndata = ndata;
+	g.ntrans = ntrans;
+	g.fit_start = fit_start;
+	g.fit_end = fit_end;
+	g.instr = instr;
+	g.ninstr = ninstr;
+	g.noise = noise;
+	g.sig = sig;
+	g.nparam = nparam;
+	g.fitfunc = fitfunc;
+	g.restrain = restrain;
+	g.restraint = (wsin == NULL) ? NULL : wsin->restraint;
+	g.use = use;
+	for (i=0; i<nparam; i++) {
+		if (!paramfree[i])
+			continue;
+		if (gparam[i])
+			g.glob[g.ng++] = i;
+		else
+			g.loc[g.nl++] = i;
+	}
+	g.nblock = g.nl*g.nl + g.ng*g.nl + g.nl;
+	g.nstep = g.ng*g.nl + g.nl;
+	g.nthreads = ecf_batch_nthreads(0);
+
+	for (t=0, nused=0; t<ntrans; t++)
+		if (use[t])
+			nused++;
+
+	/* Working copies of the parameters, with the global ones from param[0] */
+	ret = -1;
+	p = (float *) malloc((size_t) ntrans * nparam * sizeof(float));
+	ptry = (float *) malloc((size_t) ntrans * nparam * sizeof(float));
+	chisq_t = (float *) malloc((size_t) ntrans * sizeof(float));
+	chisq_try = (float *) malloc((size_t) ntrans * sizeof(float));
+	blk = (double *) malloc(((size_t) ntrans * g.nblock + 1) * sizeof(double));
+	blk_try = (double *) malloc(((size_t) ntrans * g.nblock + 1) * sizeof(double));
+	dw = (double *) malloc(((size_t) ntrans * g.nstep + 1) * sizeof(double));
+	g.held = (int *) malloc((size_t) ntrans * sizeof(int));
+	g.ws = (ecf_workspace **) calloc((size_t) g.nthreads, sizeof(ecf_workspace *));
+	g.yfit = (float **) calloc((size_t) g.nthreads, sizeof(float *));
+	g.partial = (double *) malloc(((size_t) g.nthreads * (g.ng*g.ng + g.ng) + 1) *
+								  sizeof(double));
+	if (p == NULL || ptry == NULL || chisq_t == NULL || chisq_try == NULL ||
+		blk == NULL || blk_try == NULL || dw == NULL || g.held == NULL ||
+		g.ws == NULL || g.yfit == NULL || g.partial == NULL)
+		goto done;
+	for (i=0; i<g.nthreads; i++) {
+		if ((g.ws[i] = GCI_ecf_workspace(ndata, nparam)) == NULL ||
+			(g.yfit[i] = (float *) malloc((size_t) ndata * sizeof(float))) == NULL)
+			goto done;
+		g.ws[i]->model = ecf_model_of(fitfunc);
+		GCI_ecf_set_workspace_restraint(g.ws[i], g.restraint);
+		ecf_workspace_settings(g.ws[i], wsin);
+	}
+
+	for (t=0; t<ntrans; t++) {
+		for (i=0; i<nparam; i++)
+			p[(size_t) t * nparam + i] = gparam[i] ? param[0][i] : param[t][i];
+		chisq_t[t] = -1.0f;
+	}
+
+	/* The Marquardt iterations, as in GCI_marquardt_instr(), except that
+	   chisq_delta applies to the average change per transient.  Only
+	   the steps which are taken count towards convergence, as a rejected
+	   step says nothing about being near the minimum, and counting them
+	   stopped fits which had far to go; so that a fit already at its
+	   minimum still stops, a rejected step too small to change any
+	   parameter counts as well.  The steps are numbered from 1, as
+	   GCI_marquardt_instr() numbers the one it takes as it starts. */
+	itst_max = (restrain == ECF_RESTRAIN_DEFAULT) ? 4 : 6;
+	alambda = 0.001f;
+	chisq = ecf_global_evaluate(&g, p, chisq_t, blk, ag, bg);
+
+	k = 0;  /* Iteration counter */
+	itst = 0;
+	for (;;) {
+		k++;
+		if (k > MAXITERS) {
+			ret = -2;
+			break;
+		}
+
+		ochisq = chisq;
+		if ((ret = ecf_global_step(&g, blk, ag, bg, alambda, p, ptry, dw)) < 0) {
+			ret = -3;
+			break;
+		}
+
+		chisq_new = 0.0;
+		if (ret == 0)
+			chisq_new = ecf_global_evaluate(&g, ptry, chisq_try, blk_try,
+											ag_try, bg_try);
+
+		if (ret == 0 && chisq_new < chisq) {
+			/* Success, accept the new solution */
+			alambda *= 0.1f;
+			chisq = chisq_new;
+			swapf = p; p = ptry; ptry = swapf;
+			swapf = chisq_t; chisq_t = chisq_try; chisq_try = swapf;
+			swapd = blk; blk = blk_try; blk_try = swapd;
+			memcpy(ag, ag_try, sizeof(ag));
+			memcpy(bg, bg_try, sizeof(bg));
+			if (ochisq - chisq < (double) chisq_delta * nused)
+				itst++;
+		}
+		else {  /* Failure, increase alambda */
+			alambda *= 10.0f;
+			if (ret == 0 && !ecf_global_moved(&g, p, ptry))
+				itst++;
+		}
+
+		if (itst < itst_max) continue;
+
+		ret = k;  /* We're done now */
+		break;
+	}
+
+	if (ret == -3)
+		goto done;
+
+	/* Hand back what we have, even if we ran out of iterations */
+	for (t=0; t<ntrans; t++) {
+		if (!use[t])
+			continue;
+		for (i=0; i<nparam; i++)
+			param[t][i] = p[(size_t) t * nparam + i];
+	}
+
+	/* and the final fits and chi-squareds */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(g.nthreads)
+#endif
+	{
+		int id = 0, u;
+
+#ifdef _OPENMP
+		id = omp_get_thread_num();
+#endif
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+		for (u=0; u<ntrans; u++) {
+			if (!use[u])
+				continue;
+			chisq_t[u] = ecf_global_transient(&g, u, param[u], g.ws[id], g.yfit[id],
+								NULL, NULL, NULL,
+								(fitted == NULL) ? NULL : fitted[u],
+								(residuals == NULL) ? NULL : residuals[u]);
+		}
+	}
+
+	chisq = 0.0;
+	for (t=0; t<ntrans; t++) {
+		if (!use[t])
+			continue;
+		chisq += chisq_t[t];
+		if (chisq_trans != NULL)
+			chisq_trans[t] = chisq_t[t];
+	}
+	if (chisq_global != NULL)
+		*chisq_global = (float) chisq;
+	if (df != NULL)
+		*df = nused * (fit_end - fit_start) - nused * g.nl - g.ng;
+
+done:
+	if (g.ws != NULL)
+		for (i=0; i<g.nthreads; i++)
+			GCI_ecf_free_workspace(g.ws[i]);
+	if (g.yfit != NULL)
+		for (i=0; i<g.nthreads; i++)
+			free(g.yfit[i]);
+	free(g.ws);
+	free(g.yfit);
+	free(g.partial);
+	free(g.held);
+	free(p);
+	free(ptry);
+	free(chisq_t);
+	free(chisq_try);
+	free(blk);
+	free(blk_try);
+	free(dw);
+	return ret;
+}
+
+static int ecf_global_check_args(float xincr, float **trans,
+								 int ndata, int ntrans, int fit_start, int fit_end,
+								 noise_type noise, float sig[],
+								 float **param, int paramfree[], int nparam)
+{
+	int t;
+
+	if (xincr <= 0 || trans == NULL || param == NULL || paramfree == NULL ||
+		ntrans < 1 || nparam < 1 || nparam > MAXFIT)
+		return -1;
+	if (fit_start < 0 || fit_start >= fit_end || fit_end > ndata)
+		return -1;
+	if ((noise == NOISE_CONST || noise == NOISE_GIVEN) && sig == NULL)
+		return -1;
+	for (t=0; t<ntrans; t++)
+		if (trans[t] == NULL || param[t] == NULL)
+			return -1;
+	return 0;
+}
+
+/* Global fit of ntrans transients trans[t][0..ndata-1] with the
+   function fitfunc, convolved with the instrument response instr[] if
+   ninstr > 0, over the points fit_start to fit_end-1.  The parameters
+   i with gparam[i] set are global, shared by all of the transients; the
+   rest are local to each.  param[t][] holds the starting values of the
+   local parameters of transient t, and param[0][] those of the global
+   ones; on return every param[t][] holds the fitted values, global ones
+   included.  paramfree[] says which parameters are fitted, and is the
+   same for every transient, as is sig[].
+
+   The fit stops when, as in GCI_marquardt_instr(), chi-squared has
+   stopped improving, except that chisq_delta is the change in the
+   average chi-squared of a transient.  fitted[t] and residuals[t], if
+   not NULL, are filled in from fit_start to fit_end-1.  chisq_trans[t]
+   is the chi-squared of transient t, *chisq_global their total, and
+   *df the number of degrees of freedom of the whole fit.
+
+   The restraints are those of GCI_marquardt_instr(), with
+   GCI_set_restrain_limits() giving the limits of ECF_RESTRAIN_USER.
+   GCI_marquardt_global_generic_instr_ws() takes those limits from the
+   workspace ws instead, as the single fits do (see
+   GCI_ecf_set_workspace_restraint()); ws only supplies the settings,
+   the fits having working space of their own, and may be NULL.
+
+   Returns the number of iterations, or -1 if the arguments are bad or
+   out of memory, -2 if the fit did not finish in MAXITERS iterations
+   (the parameters and outputs are those reached so far) or -3 if the
+   normal equations could not be solved. */
+
+int GCI_marquardt_global_generic_instr(float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df)
+{
+	return GCI_marquardt_global_generic_instr_ws(NULL, xincr, trans, ndata, ntrans,
+					fit_start, fit_end, instr, ninstr, noise, sig,
+					param, paramfree, nparam, gparam, restrain, chisq_delta,
+					fitfunc, fitted, residuals, chisq_trans, chisq_global, df);
+}
+
+int GCI_marquardt_global_generic_instr_ws(ecf_workspace *ws, float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df)
+{
+	int *use, t, ret;
+
+	if (ecf_global_check_args(xincr, trans, ndata, ntrans, fit_start, fit_end,
+							  noise, sig, param, paramfree, nparam) != 0 ||
+		gparam == NULL || fitfunc == NULL)
+		return -1;
+
+	if ((use = (int *) malloc((size_t) ntrans * sizeof(int))) == NULL)
+		return -1;
+	for (t=0; t<ntrans; t++)
+		use[t] = 1;
+
+	ret = ecf_global_fit(ws, xincr, trans, ndata, ntrans, fit_start, fit_end,
+						 instr, ninstr, noise, sig,
+						 param, paramfree, nparam, gparam, restrain, chisq_delta,
+						 fitfunc, fitted, residuals, chisq_trans, chisq_global, df,
+						 use);
+	free(use);
+	return ret;
+}
+
+/* Global fit of multiexponentials (ftype FIT_GLOBAL_MULTIEXP, with the
+   parameters Z, A1, tau1, A2, tau2, ...) or of a stretched exponential
+   (FIT_GLOBAL_STRETCHEDEXP, with Z, A, tau, h), with the lifetimes (and
+   h) global and Z and the amplitudes local.  The arguments are as for
+   GCI_marquardt_global_generic_instr(), and those of
+   GCI_marquardt_global_exps_instr_ws() as for
+   GCI_marquardt_global_generic_instr_ws().
+
+   The lifetimes are first held at their starting values in param[0]
+   while the local parameters of each transient are fitted on their
+   own, which is a linear problem, to give good starting values for the
+   global fit.  If that fails for any transient, the whole fit fails
+   with -4, unless drop_bad_transients is set, in which case those
+   transients are left out of the global fit and their chisq_trans is
+   set to -1. */
+
+int GCI_marquardt_global_exps_instr(float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta,
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df,
+					int drop_bad_transients)
+{
+	return GCI_marquardt_global_exps_instr_ws(NULL, xincr, trans, ndata, ntrans,
+					fit_start, fit_end, instr, ninstr, noise, sig, ftype,
+					param, paramfree, nparam, restrain, chisq_delta,
+					fitted, residuals, chisq_trans, chisq_global, df,
+					drop_bad_transients);
+}
+
+int GCI_marquardt_global_exps_instr_ws(ecf_workspace *ws, float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta,
+					float **fitted, float **residuals,
+					float chisq_trans[], float *chisq_global, int *df,
+					int drop_bad_transients)
+{
+	void (*fitfunc)(float, float [], float *, float [], int);
+	int gparam[MAXFIT], localfree[MAXFIT];
+	float gval[MAXFIT];
+	int *use, i, t, nbad = 0, nused = 0, ret;
+
+	if (ecf_global_check_args(xincr, trans, ndata, ntrans, fit_start, fit_end,
+							  noise, sig, param, paramfree, nparam) != 0)
+		return -1;
+
+	for (i=0; i<nparam; i++)
+		gparam[i] = 0;
+	if (ftype == FIT_GLOBAL_MULTIEXP && nparam >= 3 && nparam % 2 == 1) {
+		fitfunc = GCI_multiexp_tau;
+		for (i=2; i<nparam; i+=2)
+			gparam[i] = 1;
+	}
+	else if (ftype == FIT_GLOBAL_STRETCHEDEXP && nparam == 4) {
+		fitfunc = GCI_stretchedexp;
+		gparam[2] = gparam[3] = 1;
+	}
+	else
+		return -1;
+
+	for (i=0; i<nparam; i++) {
+		localfree[i] = paramfree[i] && !gparam[i];
+		gval[i] = param[0][i];
+	}
+
+	if ((use = (int *) malloc((size_t) ntrans * sizeof(int))) == NULL)
+		return -1;
+
+	/* The local parameters of each transient with the global ones fixed */
+#ifdef _OPENMP
+#pragma omp parallel num_threads(ecf_batch_nthreads(0)) reduction(+:nbad)
+#endif
+	{
+		ecf_workspace *wsu = GCI_ecf_workspace(ndata, nparam);
+		float **covar = GCI_ecf_matrix(nparam, nparam);
+		float **alpha = GCI_ecf_matrix(nparam, nparam);
+		float *yfit = (float *) malloc((size_t) ndata * sizeof(float));
+		float *dy = (float *) malloc((size_t) ndata * sizeof(float));
+		int ok = (wsu != NULL && covar != NULL && alpha != NULL &&
+				  yfit != NULL && dy != NULL);
+		float chisq;
+		int u, j;
+
+		if (ok) {
+			GCI_ecf_set_workspace_restraint(wsu, (ws == NULL) ? NULL : ws->restraint);
+			ecf_workspace_settings(wsu, ws);
+		}
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (u=0; u<ntrans; u++) {
+			for (j=0; j<nparam; j++)
+				if (gparam[j])
+					param[u][j] = gval[j];
+			use[u] = ok &&
+				GCI_marquardt_instr_ws(wsu, xincr, trans[u], ndata, fit_start, fit_end,
+									   instr, ninstr, noise, sig,
+									   param[u], localfree, nparam, restrain, fitfunc,
+									   yfit, dy, covar, alpha, &chisq,
+									   chisq_delta, 0.0f, NULL) >= 0;
+			if (!use[u]) {
+				nbad++;
+				if (chisq_trans != NULL)
+					chisq_trans[u] = -1.0f;
+			}
+		}
+
+		GCI_ecf_free_workspace(wsu);
+		GCI_ecf_free_matrix(covar);
+		GCI_ecf_free_matrix(alpha);
+		free(yfit);
+		free(dy);
+	}
+
+	for (t=0; t<ntrans; t++)
+		if (use[t])
+			nused++;
+	if ((nbad > 0 && !drop_bad_transients) || nused == 0) {
+		free(use);
+		return -4;
+	}
+
+	ret = ecf_global_fit(ws, xincr, trans, ndata, ntrans, fit_start, fit_end,
+						 instr, ninstr, noise, sig,
+						 param, paramfree, nparam, gparam, restrain, chisq_delta,
+						 fitfunc, fitted, residuals, chisq_trans, chisq_global, df,
+						 use);
+	free(use);
+	return ret;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
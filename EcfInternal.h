@@ -1,144 +1,233 @@
-/* 
-This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
-
-Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
-
-    This program is free software: you can redistribute it and/or modify
-    it under the terms of the GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    This program is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU General Public License for more details.
-
-    You should have received a copy of the GNU General Public License
-    along with this program.  If not, see <http://www.gnu.org/licenses/>.
- */
-
-/* This is EcfInternal.h, the header file for internal functions in
-   the 2003 version of the ECF library. */
-
-#ifndef _GCI_ECF_INTERNAL
-#define _GCI_ECF_INTERNAL
-
-#include "Ecf.h"  /* in case there's anything we need from there */
-
-#define MAXFIT 20  /* The maximum number of parameters we'll ever try
-		              to fit; saves dynamic allocation of small arrays.
-				      If this is increased, then the arrays chisq50 etc.
-				      in ecf.c will need to be extended.  The values can
-				      be calculated by using the test function at the end
-				      of the file. */
-
-#define MAXITERS 80
-#define MAXREFITS 10
-#define MAXBINS 2048 /* Maximum number of lifetime bins; saves dynamic allocation of small arrays */
-
-/* Functions from EcfSingle.c */
-
-int GCI_marquardt_compute_fn(float x[], float y[], int ndata,
-					 noise_type noise, float sig[],
-					 float param[], int paramfree[], int nparam,
-					 void (*fitfunc)(float, float [], float *, float [], int),
-					 float yfit[], float dy[],
-					 float **alpha, float beta[], float *chisq, float old_chisq,
-					 float alambda);
-int GCI_marquardt_compute_fn_instr(float xincr, float y[], int ndata,
-				   int fit_start, int fit_end,
-				   float instr[], int ninstr,
-				   noise_type noise, float sig[],
-				   float param[], int paramfree[], int nparam,
-				   void (*fitfunc)(float, float [], float *, float [], int),
-				   float yfit[], float dy[],
-				   float **alpha, float beta[], float *chisq, float old_chisq,
-				   float alambda,	
-					float **pfnvals, float ***pdy_dparam_pure, float ***pdy_dparam_conv,
-					int *pfnvals_len, int *pdy_dparam_nparam_size);
-int GCI_marquardt_compute_fn_final(float x[], float y[], int ndata,
-					 noise_type noise, float sig[],
-					 float param[], int paramfree[], int nparam,
-					 void (*fitfunc)(float, float [], float *, float [], int),
-					 float yfit[], float dy[], float *chisq);
-int GCI_marquardt_compute_fn_final_instr(float xincr, float y[], int ndata,
-				   int fit_start, int fit_end,
-				   float instr[], int ninstr,
-				   noise_type noise, float sig[],
-				   float param[], int paramfree[], int nparam,
-				   void (*fitfunc)(float, float [], float *, float [], int),
-				   float yfit[], float dy[], float *chisq,	
-					float **pfnvals, float ***pdy_dparam_pure, float ***pdy_dparam_conv,
-					int *pfnvals_len, int *pdy_dparam_nparam_size);
-
-/* Functions from EcfGlobal.c */
-
-
-/* Functions from EcfUtil.c */
-int GCI_solve_Gaussian(float **a, int n, float *b);
-int GCI_invert_Gaussian(float **a, int n);
-void pivot(float **a, int n, int *order, int col);
-int lu_decomp(float **a, int n, int *order);
-int solve_lu(float **lu, int n, float *b, int *order);
-int GCI_solve_lu_decomp(float **a, int n, float *b);
-int GCI_invert_lu_decomp(float **a, int n);
-int GCI_solve(float **a, int n, float *b);
-int GCI_invert(float **a, int n);
-void GCI_covar_sort(float **covar, int nparam, int paramfree[], int mfit);
-float **GCI_ecf_matrix(long nrows, long ncols);
-void GCI_ecf_free_matrix(float **m);
-float ***GCI_ecf_matrix_array(long nblocks, long nrows, long ncols);
-void GCI_ecf_free_matrix_array(float ***marr);
-void GCI_multiexp_lambda(float x, float param[],
-						 float *y, float dy_dparam[], int nparam);
-int multiexp_lambda_array(float xincr, float param[],
-						  float *y, float **dy_dparam, int nx, int nparam);
-void GCI_multiexp_tau(float x, float param[],
-					  float *y, float dy_dparam[], int nparam);
-int multiexp_tau_array(float xincr, float param[],
-					   float *y, float **dy_dparam, int nx, int nparam);
-void GCI_stretchedexp(float x, float param[],
-					  float *y, float dy_dparam[], int nparam);
-int stretchedexp_array(float xincr, float param[],
-					   float *y, float **dy_dparam, int nx, int nparam);
-int check_ecf_params (float param[], int nparam,
-                      void (*fitfunc)(float, float [], float *, float [], int));
-int GCI_set_restrain_limits(int nparam, int restrain[],
-							float minval[], float maxval[]);
-int check_ecf_user_params (float param[], int nparam,
-                           void (*fitfunc)(float, float [], float *, float [], int));
-int GCI_marquardt_estimate_errors(float **alpha, int nparam, int mfit,
-								  float d[], float **v, float interval);
-float GCI_incomplete_gamma(float a, float x);
-float GCI_log_gamma(float x);
-float GCI_gamma(float x);
-float GCI_gammap(float a, float x);
-int GCI_chisq(int nu, float chisq, float *root);
-int ECF_Find_Float_Max (float data[], int np, float *max_val);
-
-/* For debugging printing */
-extern int ECF_debug;  /* defined in EcfUtil.c */
-int dbgprintf(int dbg_level, const char *format, ...);
-void ECF_ExportParams_start (char path[]);
-void ECF_ExportParams_stop (void);
-void ecf_ExportParams_OpenFile (void);
-void ecf_ExportParams_CloseFile (void);
-void ecf_ExportParams (float param[], int nparam, float chisq);
-
-// Vars for the export of params at each iteration
-int ecf_exportParams;
-char ecf_exportParams_path[256];
-
-void ecf_ExportParams_OpenFile (void);
-void ecf_ExportParams_CloseFile (void);
-void ecf_ExportParams (float param[], int nparam, float chisq);
-
-#endif /* _GCI_ECF_INTERNAL */
-
-
-// Emacs settings:
-// Local variables:
-// mode: c
-// c-basic-offset: 4
-// tab-width: 4
-// End:
+/* 
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This is EcfInternal.h, the header file for internal functions in
+   the 2003 version of the ECF library. */
+
+#ifndef _GCI_ECF_INTERNAL
+#define _GCI_ECF_INTERNAL
+
+#include "Ecf.h"  /* in case there's anything we need from there */
+
+#define MAXFIT 20  /* The maximum number of parameters we'll ever try
+		              to fit; saves dynamic allocation of small arrays.
+				      If this is increased, then the arrays chisq50 etc.
+				      in ecf.c will need to be extended.  The values can
+				      be calculated by using the test function at the end
+				      of the file. */
+
+#define MAXITERS 80
+#define MAXREFITS 10
+
+/* The predefined fitting models, so the fitting routines only need to
+   work out which one they have been given once per fit */
+typedef enum { ECF_MODEL_USER, ECF_MODEL_MULTIEXP_LAMBDA,
+			   ECF_MODEL_MULTIEXP_TAU, ECF_MODEL_STRETCHEDEXP } ecf_model;
+
+/* User-defined parameter restraints (see GCI_ecf_restraint in EcfUtil.c) */
+struct ecf_restraint {
+	int nparam;                /* how many parameters are set up, 0 if none */
+	int restraining[MAXFIT];   /* do we check parameter i? */
+	float minval[MAXFIT];      /* minimum acceptable parameter value */
+	float maxval[MAXFIT];      /* maximum acceptable parameter value */
+};
+
+/* The fitting workspace (see GCI_ecf_workspace in EcfUtil.c).  The
+   arrays are allocated for ndata points and nparam parameters, and are
+   only reallocated if a fit needs more than that. */
+struct ecf_workspace {
+	int ndata;              /* length of the per-point arrays */
+	int nparam;             /* number of columns of the dy_dparam arrays */
+	float *fnvals;          /* unconvolved fitting function values */
+	float *fitted;          /* fitted curve if the caller has no array */
+	float **dy_dparam_pure; /* unconvolved derivatives, [ndata][nparam] */
+	float **dy_dparam_conv; /* convolved derivatives, [ndata][nparam] */
+	float *alpha_weight;    /* per-point weights of the alpha sums */
+	float *beta_weight;     /* per-point weights of the beta sums */
+	ecf_model model;        /* fitfunc of the current fit */
+	const ecf_restraint *restraint;  /* ECF_RESTRAIN_USER limits, or NULL */
+	accuracy_type accuracy; /* log and exp of the predefined models */
+	method_type method;     /* of GCI_marquardt_fitting_engine_ws() */
+	ecf_trace *trace;       /* where the fits record their steps, or NULL */
+	ecf_fit_stats *stats;   /* statistics of the current fit, or NULL */
+
+	/* FFT convolution (see EcfFFT.c); allocated on first use */
+	int fft_size;           /* capacity of the fft arrays, in complex values */
+	int fft_n;              /* transform length of the cached spectrum, 0 if none */
+	int fft_ninstr;         /* length of the cached prompt */
+	int fft_instr_size;     /* capacity of fft_instr */
+	float *fft_instr;       /* copy of the prompt whose spectrum is cached */
+	double *fft_prompt;     /* its spectrum, scaled by 1/fft_n */
+	double *fft_buf;        /* transform scratch space */
+	double *fft_twiddle;    /* roots of unity for fft_n */
+};
+
+/* Functions from EcfSingle.c */
+
+int GCI_marquardt_compute_fn(float x[], float y[], int ndata,
+					 noise_type noise, float sig[],
+					 float param[], int paramfree[], int nparam,
+					 void (*fitfunc)(float, float [], float *, float [], int),
+					 float yfit[], float dy[],
+					 float **alpha, float beta[], float *chisq, float old_chisq,
+					 float alambda, ecf_workspace *ws);
+int GCI_marquardt_compute_fn_instr(float xincr, float y[], int ndata,
+				   int fit_start, int fit_end,
+				   float instr[], int ninstr,
+				   noise_type noise, float sig[],
+				   float param[], int paramfree[], int nparam,
+				   void (*fitfunc)(float, float [], float *, float [], int),
+				   float yfit[], float dy[],
+				   float **alpha, float beta[], float *chisq, float old_chisq,
+				   float alambda,	
+					ecf_workspace *ws);
+int GCI_marquardt_compute_fn_final(float x[], float y[], int ndata,
+					 noise_type noise, float sig[],
+					 float param[], int paramfree[], int nparam,
+					 void (*fitfunc)(float, float [], float *, float [], int),
+					 float yfit[], float dy[], float *chisq);
+int GCI_marquardt_compute_fn_final_instr(float xincr, float y[], int ndata,
+				   int fit_start, int fit_end,
+				   float instr[], int ninstr,
+				   noise_type noise, float sig[],
+				   float param[], int paramfree[], int nparam,
+				   void (*fitfunc)(float, float [], float *, float [], int),
+				   float yfit[], float dy[], float *chisq,	
+					ecf_workspace *ws);
+void ecf_compute_fn_model_instr(float xincr, int fit_start, int fit_end,
+								float instr[], int ninstr,
+								float param[], int nparam,
+								void (*fitfunc)(float, float [], float *, float [], int),
+								float yfit[], ecf_workspace *ws);
+
+/* Functions from EcfBatch.c */
+int ecf_batch_nthreads(int nthreads);
+
+/* Functions from EcfFFT.c */
+
+/* The instrument response fits convolve by FFT rather than directly
+   when ninstr * npts is larger than this */
+#define ECF_FFT_THRESHOLD 16384
+
+int ecf_fft_convolve(ecf_workspace *ws, float instr[], int ninstr,
+					 float fnvals[], float **dy_dparam_pure,
+					 float yfit[], float **dy_dparam_conv,
+					 int npts, int nparam);
+void ecf_fft_free(ecf_workspace *ws);
+
+/* Functions from EcfKernels.c */
+int ecf_alpha_beta_fixed(float **dy_dparam, int paramfree[], int nparam, int mfit,
+						 float alpha_weight[], float beta_weight[],
+						 int fit_start, int fit_end, float **alpha, float beta[]);
+int ecf_solve_normal(float **a, int n, float *b);
+
+/* Functions from EcfSimd.c */
+int ecf_simd_level(void);
+int multiexp_lambda_array_simd(float xincr, float param[],
+							   float *y, float **dy_dparam, int nx, int nparam);
+int multiexp_tau_array_simd(float xincr, float param[],
+							float *y, float **dy_dparam, int nx, int nparam);
+int stretchedexp_array_fast(float xincr, float param[],
+							float *y, float **dy_dparam, int nx, int nparam);
+int ecf_phasor_sums_simd(const float *y, const float *c, const float *s,
+						 int n, double sums[3]);
+
+/* Functions from EcfGlobal.c */
+
+
+/* Functions from EcfTrace.c */
+void ecf_trace_start(ecf_trace *trace);
+void ecf_trace_step(ecf_trace *trace, int iteration, float param[], int nparam,
+					float chisq, float alambda, int accepted);
+ecf_trace *ecf_export_params_begin(void);
+void ecf_export_params_end(ecf_trace *trace);
+int ecf_export_params_active(void);
+void ecf_stats_start(ecf_fit_stats *stats);
+void ecf_stats_step(ecf_fit_stats *stats, float alambda, int accepted);
+void ecf_stats_finish(ecf_fit_stats *stats, int ret, float chisq,
+					  float chisq_target, int refits, int ndf);
+
+/* Functions from EcfUtil.c */
+int GCI_solve_Gaussian(float **a, int n, float *b);
+int GCI_solve_Cholesky(float **a, int n, float *b);
+int GCI_invert_Gaussian(float **a, int n);
+void pivot(float **a, int n, int *order, int col);
+int lu_decomp(float **a, int n, int *order);
+int solve_lu(float **lu, int n, float *b, int *order);
+int GCI_solve_lu_decomp(float **a, int n, float *b);
+int GCI_invert_lu_decomp(float **a, int n);
+int GCI_solve(float **a, int n, float *b);
+int GCI_invert(float **a, int n);
+void GCI_covar_sort(float **covar, int nparam, int paramfree[], int mfit);
+float **GCI_ecf_matrix(long nrows, long ncols);
+void GCI_ecf_free_matrix(float **m);
+float ***GCI_ecf_matrix_array(long nblocks, long nrows, long ncols);
+void GCI_ecf_free_matrix_array(float ***marr);
+ecf_workspace *GCI_ecf_workspace(int ndata, int nparam);
+void GCI_ecf_free_workspace(ecf_workspace *ws);
+int ecf_workspace_reserve(ecf_workspace *ws, int ndata, int nparam);
+void ecf_workspace_settings(ecf_workspace *ws, const ecf_workspace *from);
+void GCI_multiexp_lambda(float x, float param[],
+						 float *y, float dy_dparam[], int nparam);
+int multiexp_lambda_array(float xincr, float param[],
+						  float *y, float **dy_dparam, int nx, int nparam);
+void GCI_multiexp_tau(float x, float param[],
+					  float *y, float dy_dparam[], int nparam);
+int multiexp_tau_array(float xincr, float param[],
+					   float *y, float **dy_dparam, int nx, int nparam);
+int multiexp_lambda_array_instr(float xincr, float param[],
+								float instr[], int ninstr,
+								float *y, float **dy_dparam, int nx, int nparam);
+int multiexp_tau_array_instr(float xincr, float param[],
+							 float instr[], int ninstr,
+							 float *y, float **dy_dparam, int nx, int nparam);
+void GCI_stretchedexp(float x, float param[],
+					  float *y, float dy_dparam[], int nparam);
+int stretchedexp_array(float xincr, float param[],
+					   float *y, float **dy_dparam, int nx, int nparam,
+					   accuracy_type accuracy);
+ecf_model ecf_model_of(void (*fitfunc)(float, float [], float *, float [], int));
+int check_ecf_params (float param[], int nparam,
+                      void (*fitfunc)(float, float [], float *, float [], int));
+int GCI_set_restrain_limits(int nparam, int restrain[],
+							float minval[], float maxval[]);
+int check_ecf_user_params (const ecf_restraint *restraint, float param[], int nparam,
+                           void (*fitfunc)(float, float [], float *, float [], int));
+int GCI_marquardt_estimate_errors(float **alpha, int nparam, int mfit,
+								  float d[], float **v, float interval);
+float GCI_incomplete_gamma(float a, float x);
+float GCI_log_gamma(float x);
+float GCI_gamma(float x);
+float GCI_gammap(float a, float x);
+int GCI_chisq(int nu, float chisq, float *root);
+int ECF_Find_Float_Max (float data[], int np, float *max_val);
+
+/* For debugging printing */
+extern int ECF_debug;  /* defined in EcfUtil.c */
+int dbgprintf(int dbg_level, const char *format, ...);
+
+#endif /* _GCI_ECF_INTERNAL */
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
@@ -0,0 +1,310 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains versions of the inner parts of the Marquardt
+   fitting routines for a fixed number of free parameters.
+
+   The generic code in EcfSingle.c and EcfUtil.c works for any number of
+   parameters, so every loop bound is only known at run time, and the
+   alpha matrix is built up one element at a time with a separate pass
+   over the data for each, and the damped normal equations are solved by
+   general Gaussian elimination.  The functions here are generated by macros
+   for each number of free parameters from 2 to ECF_MAXKERNEL, which
+   covers the 1-, 2- and 3-exponential models (3, 5 and 7 parameters)
+   and the stretched exponential (4 parameters), with or without some
+   of the parameters fixed.  All the loop bounds are then constants, so
+   the compiler can unroll them completely: alpha and beta are built up
+   in a single pass over the data with everything held in registers, and
+   the linear solve has no loops left at all.  Each element of alpha and
+   beta is still summed in the same order as in the generic code.
+
+   The damped normal equations are symmetric and positive definite, so
+   they are solved by LDL^T decomposition as in GCI_solve_Cholesky(),
+   with half the work of Gaussian elimination.  If rounding has spoiled
+   the positive definiteness, Gaussian elimination is used after all.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include "EcfInternal.h"
+
+#define ECF_MAXKERNEL 7
+
+/* Ask the compiler to unroll the following loop completely */
+#if defined(__clang__)
+#define ECF_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define ECF_UNROLL _Pragma("GCC unroll 16")
+#else
+#define ECF_UNROLL
+#endif
+
+/* alpha[i][j] = sum_k dy_dparam[k][idx[i]] * dy_dparam[k][idx[j]] * aw[k]
+   beta[i] = sum_k dy_dparam[k][idx[i]] * bw[k]
+   over k = fit_start..fit_end-1, for the MF free parameters idx[]. */
+#define ECF_DEFINE_ALPHA_BETA(MF)										\
+static void ecf_alpha_beta_##MF(float **dy_dparam, const int idx[],	\
+								const float aw[], const float bw[],		\
+								int fit_start, int fit_end,				\
+								float **alpha, float beta[])			\
+{																		\
+	float a[MF][MF], b[MF], d[MF];										\
+	int i, j, k;														\
+																		\
+	ECF_UNROLL															\
+	for (i=0; i<MF; i++) {												\
+		b[i] = 0.0f;													\
+		ECF_UNROLL														\
+		for (j=0; j<=i; j++)											\
+			a[i][j] = 0.0f;												\
+	}																	\
+																		\
+	for (k=fit_start; k<fit_end; k++) {									\
+		ECF_UNROLL														\
+		for (i=0; i<MF; i++)											\
+			d[i] = dy_dparam[k][idx[i]];								\
+		ECF_UNROLL														\
+		for (i=0; i<MF; i++) {											\
+			ECF_UNROLL													\
+			for (j=0; j<=i; j++)										\
+				a[i][j] += d[i] * d[j] * aw[k];							\
+			b[i] += d[i] * bw[k];										\
+		}																\
+	}																	\
+																		\
+	ECF_UNROLL															\
+	for (i=0; i<MF; i++) {												\
+		beta[i] = b[i];													\
+		ECF_UNROLL														\
+		for (j=0; j<=i; j++)											\
+			alpha[i][j] = alpha[j][i] = a[i][j];						\
+	}																	\
+}
+
+/* Solves a x = b for N x N a, exactly as GCI_solve_Gaussian() does
+   (including its choice of pivot), but leaves a untouched */
+#define ECF_DEFINE_SOLVE(N)												\
+static int ecf_solve_##N(float **a_in, float *b)						\
+{																		\
+	float a[N][N], pivotInverse[N];										\
+	float max, temp;													\
+	int i, j, k, m;														\
+																		\
+	ECF_UNROLL															\
+	for (i=0; i<N; i++) {												\
+		ECF_UNROLL														\
+		for (j=0; j<N; j++)												\
+			a[i][j] = a_in[i][j];										\
+	}																	\
+																		\
+	ECF_UNROLL															\
+	for (k=0; k<N-1; k++) {												\
+		max = fabsf(a[k][k]);											\
+		m = k;															\
+		ECF_UNROLL														\
+		for (i=k+1; i<N; i++) {											\
+			if (max < fabsf(a[i][k])) {									\
+				max = a[i][k];											\
+				m = i;													\
+			}															\
+		}																\
+																		\
+		if (m != k) {													\
+			ECF_UNROLL													\
+			for (i=k; i<N; i++) {										\
+				temp = a[k][i]; a[k][i] = a[m][i]; a[m][i] = temp;		\
+			}															\
+			temp = b[k]; b[k] = b[m]; b[m] = temp;						\
+		}																\
+																		\
+		if (0.0 == a[k][k])												\
+			return -2;  /* singular matrix */							\
+																		\
+		pivotInverse[k] = 1.0f / a[k][k];								\
+		ECF_UNROLL														\
+		for (j=k+1; j<N; j++) {											\
+			temp = -a[j][k] * pivotInverse[k];							\
+			ECF_UNROLL													\
+			for (i=k; i<N; i++)											\
+				a[j][i] += temp * a[k][i];								\
+			b[j] += temp * b[k];										\
+		}																\
+	}																	\
+	pivotInverse[N-1] = 1.0f / a[N-1][N-1];								\
+																		\
+	ECF_UNROLL															\
+	for (k=N-1; k>=0; k--) {											\
+		ECF_UNROLL														\
+		for (i=k+1; i<N; i++)											\
+			b[k] -= a[k][i] * b[i];										\
+		b[k] *= pivotInverse[k];										\
+	}																	\
+																		\
+	return 0;															\
+}
+
+/* Solves a x = b for N x N symmetric positive definite a, exactly as
+   GCI_solve_Cholesky() does, but without touching a; b is left alone
+   and -2 returned if a turns out not to be positive definite */
+#define ECF_DEFINE_CHOLESKY(N)											\
+static int ecf_cholesky_##N(float **a, float *b)						\
+{																		\
+	float l[N][N], d[N], x[N];											\
+	float v;															\
+	int i, j, k;														\
+																		\
+	ECF_UNROLL															\
+	for (i=0; i<N; i++) {												\
+		ECF_UNROLL														\
+		for (j=0; j<i; j++) {											\
+			v = a[i][j];												\
+			ECF_UNROLL													\
+			for (k=0; k<j; k++)											\
+				v -= l[i][k] * d[k] * l[j][k];							\
+			l[i][j] = v / d[j];											\
+		}																\
+		v = a[i][i];													\
+		ECF_UNROLL														\
+		for (k=0; k<i; k++)												\
+			v -= l[i][k] * l[i][k] * d[k];								\
+		if (!(v > a[i][i] * FLT_EPSILON))								\
+			return -2;													\
+		d[i] = v;														\
+	}																	\
+																		\
+	ECF_UNROLL															\
+	for (i=0; i<N; i++) {												\
+		v = b[i];														\
+		ECF_UNROLL														\
+		for (k=0; k<i; k++)												\
+			v -= l[i][k] * x[k];										\
+		x[i] = v;														\
+	}																	\
+	ECF_UNROLL															\
+	for (i=0; i<N; i++)													\
+		x[i] /= d[i];													\
+	ECF_UNROLL															\
+	for (i=N-1; i>=0; i--) {											\
+		v = x[i];														\
+		ECF_UNROLL														\
+		for (k=i+1; k<N; k++)											\
+			v -= l[k][i] * x[k];										\
+		x[i] = v;														\
+	}																	\
+																		\
+	ECF_UNROLL															\
+	for (i=0; i<N; i++)													\
+		b[i] = x[i];													\
+	return 0;															\
+}
+
+ECF_DEFINE_ALPHA_BETA(2)
+ECF_DEFINE_ALPHA_BETA(3)
+ECF_DEFINE_ALPHA_BETA(4)
+ECF_DEFINE_ALPHA_BETA(5)
+ECF_DEFINE_ALPHA_BETA(6)
+ECF_DEFINE_ALPHA_BETA(7)
+
+ECF_DEFINE_SOLVE(2)
+ECF_DEFINE_SOLVE(3)
+ECF_DEFINE_SOLVE(4)
+ECF_DEFINE_SOLVE(5)
+ECF_DEFINE_SOLVE(6)
+ECF_DEFINE_SOLVE(7)
+
+ECF_DEFINE_CHOLESKY(2)
+ECF_DEFINE_CHOLESKY(3)
+ECF_DEFINE_CHOLESKY(4)
+ECF_DEFINE_CHOLESKY(5)
+ECF_DEFINE_CHOLESKY(6)
+ECF_DEFINE_CHOLESKY(7)
+
+typedef void (*ecf_alpha_beta_fn)(float **dy_dparam, const int idx[],
+								  const float aw[], const float bw[],
+								  int fit_start, int fit_end,
+								  float **alpha, float beta[]);
+typedef int (*ecf_solve_fn)(float **a, float *b);
+
+static const ecf_alpha_beta_fn ecf_alpha_beta_kernels[ECF_MAXKERNEL+1] = {
+	NULL, NULL, ecf_alpha_beta_2, ecf_alpha_beta_3, ecf_alpha_beta_4,
+	ecf_alpha_beta_5, ecf_alpha_beta_6, ecf_alpha_beta_7
+};
+
+static const ecf_solve_fn ecf_solve_kernels[ECF_MAXKERNEL+1] = {
+	NULL, NULL, ecf_solve_2, ecf_solve_3, ecf_solve_4,
+	ecf_solve_5, ecf_solve_6, ecf_solve_7
+};
+
+static const ecf_solve_fn ecf_cholesky_kernels[ECF_MAXKERNEL+1] = {
+	NULL, NULL, ecf_cholesky_2, ecf_cholesky_3, ecf_cholesky_4,
+	ecf_cholesky_5, ecf_cholesky_6, ecf_cholesky_7
+};
+
+/* Builds the mfit x mfit alpha matrix and beta vector for the free
+   parameters from the derivatives dy_dparam[k][0..nparam-1] and the
+   weights alpha_weight[k] and beta_weight[k], exactly as the generic
+   code in GCI_marquardt_compute_fn_instr() does.  Returns -1 without
+   doing anything if there is no kernel for mfit free parameters. */
+int ecf_alpha_beta_fixed(float **dy_dparam, int paramfree[], int nparam, int mfit,
+						 float alpha_weight[], float beta_weight[],
+						 int fit_start, int fit_end, float **alpha, float beta[])
+{
+	int idx[MAXFIT];
+	int i, n;
+
+	if (mfit > ECF_MAXKERNEL || ecf_alpha_beta_kernels[mfit] == NULL)
+		return -1;
+
+	for (i=0, n=0; i<nparam && n<mfit; i++)
+		if (paramfree[i])
+			idx[n++] = i;
+	if (n != mfit)
+		return -1;
+
+	(*ecf_alpha_beta_kernels[mfit])(dy_dparam, idx, alpha_weight, beta_weight,
+									fit_start, fit_end, alpha, beta);
+	return 0;
+}
+
+/* Solves the damped normal equations a x = b of a Marquardt step, where
+   a should be symmetric positive definite: by LDL^T decomposition if it
+   is, and by Gaussian elimination if not, using the kernels for this
+   size if there are any.  As with GCI_solve(), b is replaced by the
+   solution and a may be trashed. */
+int ecf_solve_normal(float **a, int n, float *b)
+{
+	if (n <= ECF_MAXKERNEL && ecf_cholesky_kernels[n] != NULL) {
+		if ((*ecf_cholesky_kernels[n])(a, b) == 0)
+			return 0;
+		return (*ecf_solve_kernels[n])(a, b);
+	}
+
+	if (GCI_solve_Cholesky(a, n, b) == 0)
+		return 0;
+	return GCI_solve(a, n, b);
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
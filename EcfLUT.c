@@ -0,0 +1,339 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the lookup table estimates of single exponential
+   decays, for previews at the rate the images come in.
+
+   As in the triple integral (RLD) fits, the fit range is cut into three
+   windows of equal width, and the counts d1, d2 and d3 in them are the
+   statistics.  For the model of the fits, Z plus A exp(-x/tau)
+   convolved with the prompt, dk = A Uk(tau) + Z Lk, where Uk and Lk are
+   the counts that A = 1 and Z = 1 give in window k; as Z is not
+   convolved, Lk is just the number of bins in the window.  Then
+
+      e1 = d1 L2 - d2 L1 = A (U1 L2 - U2 L1)
+      e2 = d2 L3 - d3 L2 = A (U2 L3 - U3 L2)
+
+   do not depend on Z, and r = e2 / e1 depends only on tau; without a
+   prompt, r = exp(-width/tau) as in the triple integral fits.  The
+   table is indexed by u = log(-log r), which is then log(width xincr/tau), so
+   that it resolves short and long lifetimes alike.  At evenly spaced
+   values of u it holds log tau, log(1/(U1 L2 - U2 L1)) and
+   U1/(U1 L2 - U2 L1), all of which are close to straight lines in u,
+   worked out once for the prompt, the bin width and the fit range.
+   Each transient then needs the three sums and one linear
+   interpolation for all of Z, A and tau.  The prompt is allowed for
+   exactly, whatever the fit range.
+
+   GCI_ecf_lut_batch() can polish the estimates with a Marquardt fit,
+   which from them mostly needs only a few steps.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* The forward table of u against tau, worked out to build the lookup
+   table, has this many entries for each of those */
+#define ECF_LUT_OVERSAMPLE 4
+
+struct ecf_lut {
+	float xincr;
+	int fit_start, fit_end;
+	int width;        /* of each of the three windows from fit_start */
+	float *instr;     /* copy of the prompt, for the polishing fits */
+	int ninstr;
+	double L[3];      /* counts of Z = 1 in each window, its width */
+	int n;            /* number of entries */
+	double umin;      /* entry k is for u = umin + k*ustep */
+	double ustep;
+	float *logtau;    /* log tau at each entry */
+	float *logainv;   /* log(1/(U1 L2 - U2 L1)) */
+	float *zcoef;     /* U1/(U1 L2 - U2 L1) */
+};
+
+/* The counts U[0..2] that A = 1 gives in the three windows for the
+   given tau: the convolution c[i] = sum_j instr[j] q^(i-j) is stepped
+   along the bins as c[i] = q c[i-1] + instr[i]. */
+static void ecf_lut_windows(const ecf_lut *lut, double tau, double U[3])
+{
+	double q = exp(-lut->xincr / tau), c = 0;
+	int i, k;
+
+	U[0] = U[1] = U[2] = 0;
+	for (i=0; i<lut->fit_start+3*lut->width; i++) {
+		c = q*c + ((i < lut->ninstr) ? lut->instr[i] : 0);
+		k = (i - lut->fit_start) / lut->width;
+		if (i >= lut->fit_start)
+			U[k] += c;
+	}
+}
+
+/* u = log(-log r) for the window counts U, or 0 if r is not in (0,1) */
+static int ecf_lut_index(const ecf_lut *lut, const double U[3], double *u)
+{
+	double e1 = U[0]*lut->L[1] - U[1]*lut->L[0];
+	double e2 = U[1]*lut->L[2] - U[2]*lut->L[1];
+
+	if (!(e1 > 0 && e2 > 0 && e2 < e1))
+		return 0;
+	*u = log(-log(e2 / e1));
+	return 1;
+}
+
+/* Build the table for single exponential fits of the bins
+   fit_start..fit_end-1 of transients with bin width xincr and the
+   prompt instr[0..ninstr-1] (or none if instr is NULL or ninstr is 0),
+   covering lifetimes from tau_min to tau_max with nentries entries;
+   1024 entries are plenty.
+
+   Returns the table, or NULL if the arguments are bad, if out of
+   memory, or if the windows cannot tell the lifetimes in the range
+   apart (r is not between 0 and 1 and rising with tau). */
+
+ecf_lut *GCI_ecf_lut(float xincr, int fit_start, int fit_end,
+					 float instr[], int ninstr,
+					 float tau_min, float tau_max, int nentries)
+{
+	ecf_lut *lut;
+	double *fwd_u, *fwd_logtau, U[3], u, t, c;
+	int nfwd, i, k;
+
+	if (xincr <= 0 || fit_start < 0 || fit_end - fit_start < 3 ||
+		tau_min <= 0 || tau_max <= tau_min || nentries < 2)
+		return NULL;
+
+	if ((lut = (ecf_lut *) calloc(1, sizeof(ecf_lut))) == NULL)
+		return NULL;
+	lut->xincr = xincr;
+	lut->fit_start = fit_start;
+	lut->fit_end = fit_end;
+	lut->width = (fit_end - fit_start) / 3;
+	lut->n = nentries;
+
+	/* Without a prompt, the decay starts in bin 0 */
+	lut->ninstr = (instr == NULL || ninstr <= 0) ? 1 : ninstr;
+	lut->instr = (float *) malloc((size_t) lut->ninstr * sizeof(float));
+	lut->logtau = (float *) malloc((size_t) 3 * nentries * sizeof(float));
+	nfwd = ECF_LUT_OVERSAMPLE * nentries;
+	fwd_u = (double *) malloc((size_t) 2 * nfwd * sizeof(double));
+	if (lut->instr == NULL || lut->logtau == NULL || fwd_u == NULL) {
+		free(fwd_u);
+		GCI_ecf_free_lut(lut);
+		return NULL;
+	}
+	lut->logainv = lut->logtau + nentries;
+	lut->zcoef = lut->logainv + nentries;
+	fwd_logtau = fwd_u + nfwd;
+	for (i=0; i<lut->ninstr; i++)
+		lut->instr[i] = (instr == NULL || ninstr <= 0) ? 1.0f : instr[i];
+
+	/* Z = 1 gives 1 in every bin, as in GCI_marquardt_compute_fn_instr() */
+	lut->L[0] = lut->L[1] = lut->L[2] = lut->width;
+
+	/* u against tau, with tau evenly spaced in log(tau); u falls as
+	   tau rises */
+	for (i=0; i<nfwd; i++) {
+		fwd_logtau[i] = log(tau_min) + log((double) tau_max / tau_min) * i / (nfwd - 1);
+		ecf_lut_windows(lut, exp(fwd_logtau[i]), U);
+		if (!ecf_lut_index(lut, U, fwd_u + i) ||
+			(i > 0 && !(fwd_u[i] < fwd_u[i-1]))) {
+			free(fwd_u);
+			GCI_ecf_free_lut(lut);
+			return NULL;
+		}
+	}
+
+	/* and log(tau) against u, between the neighbouring entries of the
+	   forward table; the rest are worked out exactly at that tau */
+	lut->umin = fwd_u[nfwd-1];
+	lut->ustep = (fwd_u[0] - fwd_u[nfwd-1]) / (nentries - 1);
+	for (k=0, i=nfwd-1; k<nentries; k++) {
+		u = lut->umin + k * lut->ustep;
+		while (i > 1 && fwd_u[i-1] < u)
+			i--;
+		t = (u - fwd_u[i]) / (fwd_u[i-1] - fwd_u[i]);
+		if (t < 0) t = 0;
+		if (t > 1) t = 1;
+		lut->logtau[k] = (float) (fwd_logtau[i] + t * (fwd_logtau[i-1] - fwd_logtau[i]));
+		ecf_lut_windows(lut, exp(lut->logtau[k]), U);
+		c = 1 / (U[0]*lut->L[1] - U[1]*lut->L[0]);
+		lut->logainv[k] = (float) log(c);
+		lut->zcoef[k] = (float) (U[0] * c);
+	}
+
+	free(fwd_u);
+	return lut;
+}
+
+void GCI_ecf_free_lut(ecf_lut *lut)
+{
+	if (lut == NULL)
+		return;
+	free(lut->instr);
+	free(lut->logtau);  /* logainv and zcoef are in the same block */
+	free(lut);
+}
+
+/* Estimate Z, A and tau of the transient y[0..fit_end-1] from the table.
+   Returns 0, or -1 (with all three 0) if there is no decay, or its
+   lifetime is outside the range of the table. */
+
+int GCI_ecf_lut_estimate(const ecf_lut *lut, float y[], float *Z, float *A, float *tau)
+{
+	double d[3], e1, e2, pos, t;
+	int i, k;
+
+	*Z = *A = *tau = 0;
+
+	for (k=0; k<3; k++) {
+		d[k] = 0;
+		for (i=lut->fit_start+k*lut->width; i<lut->fit_start+(k+1)*lut->width; i++)
+			d[k] += y[i];
+	}
+
+	e1 = d[0]*lut->L[1] - d[1]*lut->L[0];
+	e2 = d[1]*lut->L[2] - d[2]*lut->L[1];
+	if (!(e1 > 0 && e2 > 0 && e2 < e1))
+		return -1;
+	pos = (log(-log(e2 / e1)) - lut->umin) / lut->ustep;
+	if (!(pos >= 0 && pos <= lut->n - 1))
+		return -1;
+
+	k = (int) pos;
+	if (k > lut->n - 2)
+		k = lut->n - 2;
+	t = pos - k;
+
+	*tau = (float) exp(lut->logtau[k] + t * (lut->logtau[k+1] - lut->logtau[k]));
+	*A = (float) (e1 * exp(lut->logainv[k] + t * (lut->logainv[k+1] - lut->logainv[k])));
+	*Z = (float) ((d[0] - e1 * (lut->zcoef[k] + t * (lut->zcoef[k+1] - lut->zcoef[k]))) / lut->L[0]);
+	return 0;
+}
+
+/* Estimate ntrans transients, each of length ndata >= fit_end, stored
+   one after the other in trans[0..ntrans*ndata-1] (the column order of
+   a MATLAB array), giving Z[t], A[t] and tau[t] for transient t.
+
+   If polish is non-zero, each estimate is then the start of a
+   GCI_marquardt_instr() fit of GCI_multiexp_tau() with the given noise
+   model and chisq_delta, and chisq[t] receives its chi-squared; chisq
+   may be NULL, and is not used without polishing.  The polishing fits
+   have no sig[], so the noise model must be one which works out its
+   own errors: NOISE_CONST and NOISE_GIVEN are rejected.
+   A transient whose polishing fit fails keeps its estimate.  The
+   transients are shared between up to nthreads threads (nthreads <= 0
+   uses the default).
+
+   Returns the number of transients which could not be estimated or
+   polished, or -1 if the arguments are bad. */
+
+int GCI_ecf_lut_batch(const ecf_lut *lut, float *trans, int ndata, int ntrans,
+					  int polish, noise_type noise, float chisq_delta,
+					  float Z[], float A[], float tau[], float chisq[],
+					  int nthreads)
+{
+	int nfailed = 0;
+
+	if (lut == NULL || trans == NULL || ndata < lut->fit_end || ntrans < 0 ||
+		Z == NULL || A == NULL || tau == NULL ||
+		(polish && (noise == NOISE_CONST || noise == NOISE_GIVEN)))
+		return -1;
+
+	nthreads = ecf_batch_nthreads(nthreads);
+	if (polish && ecf_export_params_active())
+		nthreads = 1;  /* the export file is shared by all fits */
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) reduction(+:nfailed)
+#endif
+	{
+		/* Per-thread working space for the polishing fits */
+		ecf_workspace *ws = NULL;
+		float **covar = NULL, **alpha = NULL;
+		float *fitted = NULL, *residuals = NULL;
+		float param[3], fitchisq;
+		int paramfree[3] = { 1, 1, 1 };
+		int ok = 1, t;
+
+		if (polish) {
+			ws = GCI_ecf_workspace(ndata, 3);
+			covar = GCI_ecf_matrix(3, 3);
+			alpha = GCI_ecf_matrix(3, 3);
+			fitted = (float *) malloc((size_t) ndata * sizeof(float));
+			residuals = (float *) malloc((size_t) ndata * sizeof(float));
+			ok = (ws != NULL && covar != NULL && alpha != NULL &&
+				  fitted != NULL && residuals != NULL);
+		}
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+		for (t=0; t<ntrans; t++) {
+			float *y = trans + (size_t) t * ndata;
+
+			if (GCI_ecf_lut_estimate(lut, y, Z + t, A + t, tau + t) != 0) {
+				nfailed++;
+				continue;
+			}
+			if (!polish)
+				continue;
+
+			param[0] = Z[t];
+			param[1] = A[t];
+			param[2] = tau[t];
+			if (!ok ||
+				GCI_marquardt_instr_ws(ws, lut->xincr, y, ndata,
+									   lut->fit_start, lut->fit_end,
+									   lut->instr, lut->ninstr, noise, NULL,
+									   param, paramfree, 3, ECF_RESTRAIN_DEFAULT,
+									   GCI_multiexp_tau, fitted, residuals,
+									   covar, alpha, &fitchisq,
+									   chisq_delta, 0.0f, NULL) < 0) {
+				nfailed++;
+				continue;
+			}
+			Z[t] = param[0];
+			A[t] = param[1];
+			tau[t] = param[2];
+			if (chisq != NULL)
+				chisq[t] = fitchisq;
+		}
+
+		free(fitted);
+		free(residuals);
+		GCI_ecf_free_workspace(ws);
+		GCI_ecf_free_matrix(covar);
+		GCI_ecf_free_matrix(alpha);
+	}
+
+	return nfailed;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
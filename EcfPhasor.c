@@ -0,0 +1,532 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the phasor, or polar plot, analysis of transients.
+
+   The phasor of a transient y(t) at harmonic n of the repetition period
+   T is the pair of normalised Fourier coefficients
+
+      g = sum y(t) cos(w t) / sum y(t),   s = sum y(t) sin(w t) / sum y(t)
+
+   with w = 2 pi n / T.  A single exponential decay lies on the universal
+   semicircle, at g = 1/(1 + (w tau)^2), s = w tau g, and a mixture of
+   decays lies inside it, on the chords between its components.  The
+   phase and modulation lifetimes
+
+      tau_phi = s / (w g),   tau_m = sqrt(1/(g^2 + s^2) - 1) / w
+
+   are both tau for a single exponential.
+
+   The transient is the convolution of the decay with the prompt, so
+   over a whole period its phasor, taken as the complex number g + i s,
+   is the product of theirs.  The prompt's phasor is worked out once,
+   and each transient's is divided by it.
+
+   Nothing is iterated: each transient needs three sums over its bins
+   against tables of cos(w t) and sin(w t) made once per call, so an
+   image is read once and takes about as long as reading it does.  The
+   sums are vectorised in EcfSimd.c, and the transients are shared
+   between threads with OpenMP when it is available.
+
+   The phasors also give initial estimates for the multiexponential
+   fits, at less cost than the repeated triple integral fits; see
+   GCI_phasor_estimates() at the end of the file.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include "EcfInternal.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* What is worked out once per call */
+typedef struct {
+	int n;              /* number of bins summed, fit_end - fit_start */
+	float *cosv;        /* cos(w t) for bins fit_start..fit_end-1 */
+	float *sinv;        /* sin(w t) for the same bins */
+	double sumcos;      /* sums of the tables, to take off the background */
+	double sumsin;
+	double omega;       /* w, the angular frequency of the harmonic */
+	double calr;        /* 1 / the prompt's phasor, or 1 if there is none */
+	double cali;
+} ecf_phasor;
+
+/* Make the tables and the prompt calibration.  Without a prompt, t is
+   measured from fit_start, where the decay is taken to start; with one,
+   t is measured from bin 0 for both the transients and the prompt, as
+   in the fits.  Returns 0, -1 if the prompt has no phasor or -2 if out
+   of memory. */
+static int ecf_phasor_setup(ecf_phasor *ph, float xincr, int fit_start, int fit_end,
+							float prompt[], int nprompt, float period, int harmonic)
+{
+	double I, G, S, m2, wt;
+	int i, origin;
+
+	ph->n = fit_end - fit_start;
+	if (period <= 0)
+		period = ph->n * xincr;
+	ph->omega = 2 * M_PI * harmonic / period;
+	origin = (prompt == NULL) ? fit_start : 0;
+
+	if (prompt != NULL) {
+		I = G = S = 0;
+		for (i=0; i<nprompt; i++) {
+			wt = ph->omega * (i - origin) * xincr;
+			I += prompt[i];
+			G += prompt[i] * cos(wt);
+			S += prompt[i] * sin(wt);
+		}
+		m2 = G*G + S*S;
+		if (I <= 0 || m2 <= 0)
+			return -1;
+		/* I / (G + iS) */
+		ph->calr = I * G / m2;
+		ph->cali = -I * S / m2;
+	} else {
+		ph->calr = 1;
+		ph->cali = 0;
+	}
+
+	ph->cosv = (float *) malloc((size_t) 2 * ph->n * sizeof(float));
+	if (ph->cosv == NULL)
+		return -2;
+	ph->sinv = ph->cosv + ph->n;
+
+	ph->sumcos = ph->sumsin = 0;
+	for (i=0; i<ph->n; i++) {
+		wt = ph->omega * (fit_start + i - origin) * xincr;
+		ph->cosv[i] = (float) cos(wt);
+		ph->sinv[i] = (float) sin(wt);
+		ph->sumcos += ph->cosv[i];
+		ph->sumsin += ph->sinv[i];
+	}
+
+	return 0;
+}
+
+/* The phasor of one transient, y[0..ph->n-1] being its bins from
+   fit_start; any of the results may be NULL.  Returns 0, or -1 if the
+   transient has no counts above the background, when the results are
+   all 0. */
+static int ecf_phasor_transient(const ecf_phasor *ph, const float y[], float Z,
+								float *g, float *s, float *taup, float *taum,
+								float *intensity)
+{
+	double sums[3], I, G, S, m2;
+	int i;
+
+	if (ecf_phasor_sums_simd(y, ph->cosv, ph->sinv, ph->n, sums) < 0) {
+		sums[0] = sums[1] = sums[2] = 0;
+		for (i=0; i<ph->n; i++) {
+			sums[0] += y[i];
+			sums[1] += (double) y[i] * ph->cosv[i];
+			sums[2] += (double) y[i] * ph->sinv[i];
+		}
+	}
+
+	I = sums[0] - ph->n * (double) Z;
+	if (intensity != NULL) *intensity = (float) I;
+	if (I <= 0) {
+		if (g != NULL) *g = 0;
+		if (s != NULL) *s = 0;
+		if (taup != NULL) *taup = 0;
+		if (taum != NULL) *taum = 0;
+		return -1;
+	}
+
+	G = (sums[1] - Z * ph->sumcos) / I;
+	S = (sums[2] - Z * ph->sumsin) / I;
+	m2 = G * ph->calr - S * ph->cali;
+	S = G * ph->cali + S * ph->calr;
+	G = m2;
+	m2 = G*G + S*S;
+
+	if (g != NULL) *g = (float) G;
+	if (s != NULL) *s = (float) S;
+	if (taup != NULL) *taup = (G != 0) ? (float) (S / (ph->omega * G)) : 0;
+	if (taum != NULL)
+		*taum = (m2 > 0 && m2 < 1) ? (float) (sqrt(1/m2 - 1) / ph->omega) : 0;
+
+	return 0;
+}
+
+/********************************************************************
+
+						   PHASOR ANALYSIS
+
+ ********************************************************************/
+
+/* Work out the phasors of ntrans transients, each of length ndata,
+   stored one after the other in trans[0..ntrans*ndata-1] (the column
+   order of a MATLAB array), over the bins fit_start..fit_end-1.
+
+   The phasors are taken at harmonic harmonic (1 for the fundamental)
+   of the repetition period period; if period <= 0, the bins
+   fit_start..fit_end-1 are taken to be one whole period.  Z, the
+   background per bin, is taken off every bin first.  If there is a
+   prompt (prompt != NULL and nprompt > 0), the phasors are divided by
+   the prompt's, bin 0 of the prompt and of the transients being at the
+   same time.  This is only exact if the transients cover the whole
+   period, so fit_start should then be 0.
+
+   g[t] and s[t] receive the phasor of transient t, taup[t] and taum[t]
+   its phase and modulation lifetimes and intensity[t] its total count
+   above the background; any of these arrays may be NULL.  Transients
+   with no counts above the background get all 0.  The transients are
+   shared between up to nthreads threads (nthreads <= 0 uses the
+   default).
+
+   Returns the number of transients with no counts, or -1 if the
+   arguments are bad or -2 if out of memory. */
+
+int GCI_phasor_batch(float xincr, float *trans, int ndata, int ntrans,
+					 int fit_start, int fit_end, float prompt[], int nprompt,
+					 float Z, float period, int harmonic,
+					 float g[], float s[], float taup[], float taum[],
+					 float intensity[], int nthreads)
+{
+	ecf_phasor ph;
+	int t, nempty = 0, ret;
+
+	if (xincr <= 0 || trans == NULL || ndata <= 0 || ntrans < 0 ||
+		fit_start < 0 || fit_end > ndata || fit_start >= fit_end || harmonic < 1)
+		return -1;
+	if (nprompt <= 0)
+		prompt = NULL;
+
+	if ((ret = ecf_phasor_setup(&ph, xincr, fit_start, fit_end,
+								prompt, nprompt, period, harmonic)) != 0)
+		return ret;
+	nthreads = ecf_batch_nthreads(nthreads);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(nthreads) reduction(+:nempty)
+#endif
+	for (t=0; t<ntrans; t++) {
+		if (ecf_phasor_transient(&ph, trans + (size_t) t * ndata + fit_start, Z,
+								 (g == NULL) ? NULL : g + t,
+								 (s == NULL) ? NULL : s + t,
+								 (taup == NULL) ? NULL : taup + t,
+								 (taum == NULL) ? NULL : taum + t,
+								 (intensity == NULL) ? NULL : intensity + t) != 0)
+			nempty++;
+	}
+
+	free(ph.cosv);
+	return nempty;
+}
+
+/* The phasor of the single transient y[0..fit_end-1]; the arguments are
+   as for GCI_phasor_batch().  Returns 0, -1 if the arguments are bad or
+   the transient has no counts, or -2 if out of memory. */
+
+int GCI_phasor(float xincr, float y[], int fit_start, int fit_end,
+			   float prompt[], int nprompt, float Z, float period, int harmonic,
+			   float *g, float *s, float *taup, float *taum)
+{
+	int ret;
+
+	ret = GCI_phasor_batch(xincr, y, fit_end, 1, fit_start, fit_end,
+						   prompt, nprompt, Z, period, harmonic,
+						   g, s, taup, taum, NULL, 1);
+	return (ret > 0) ? -1 : ret;
+}
+
+/********************************************************************
+
+					  PHASOR INITIAL ESTIMATES
+
+ ********************************************************************/
+
+/* The phasors of a decay over the bins of the fit, with the period
+   taken to be the fit window of n bins, so that w = exp(2 pi i / n) is
+   the n'th root of unity.  A component decaying by q per bin, wherever
+   it is cut off, then has the phasor (1-q) / (1 - q w^h) at harmonic h,
+   and a background none at all.  The phasor of two components,
+
+      z(w) = (f1 (1-q1) (1 - q2 w) + f2 (1-q2) (1 - q1 w)) / (1 - a w + b w^2)
+
+   with a = q1+q2 and b = q1 q2, is linear in a, b and the two
+   coefficients of the numerator, so harmonics 1 and 2 give four
+   equations for them.  q1 and q2 are the roots of x^2 - a x + b: the
+   points where the line through the phasor cuts the curve of single
+   exponentials.  One component needs only harmonic 1. */
+
+/* The number of harmonics the estimates are fitted to; more are
+   noisier, and give worse estimates */
+#define ECF_PHASOR_NHARM 2
+
+/* Sum the transient against w^(h k) for h = 1..ECF_PHASOR_NHARM;
+   zr[h] + i zi[h] is the phasor at harmonic h, and zr[0] the total
+   count.  The powers of w are stepped along in double. */
+static void ecf_phasor_harmonics(const float y[], int n, double zr[], double zi[])
+{
+	double cs[ECF_PHASOR_NHARM+1], sn[ECF_PHASOR_NHARM+1];
+	double er[ECF_PHASOR_NHARM+1], ei[ECF_PHASOR_NHARM+1], t;
+	int h, k;
+
+	for (h=0; h<=ECF_PHASOR_NHARM; h++) {
+		cs[h] = cos(2 * M_PI * h / n);
+		sn[h] = sin(2 * M_PI * h / n);
+		er[h] = 1;
+		ei[h] = 0;
+		zr[h] = zi[h] = 0;
+	}
+	for (k=0; k<n; k++)
+		for (h=0; h<=ECF_PHASOR_NHARM; h++) {
+			zr[h] += y[k] * er[h];
+			zi[h] += y[k] * ei[h];
+			t = er[h]*cs[h] - ei[h]*sn[h];
+			ei[h] = er[h]*sn[h] + ei[h]*cs[h];
+			er[h] = t;
+		}
+}
+
+/* Solve the phasors zr[1..H] + i zi[1..H] for ncomp = 1 or 2
+   components, giving q[] and the fractions f[] of the counts in each;
+   returns 0, or -1 if there is no solution with 0 < q < 1 and positive
+   fractions.  Two components must also have lifetimes shorter than the
+   window and no shorter than qmin gives. */
+static int ecf_phasor_components(int n, double zr[], double zi[], int ncomp,
+								 double qmin, double q[2], double f[2])
+{
+	double wr[2*ECF_PHASOR_NHARM+1], wi[2*ECF_PHASOR_NHARM+1];
+	double row[2][4], rhs[2], m[4][5], x[4], pr1, pi1, pr2, pi2, t;
+	double disc, u1, u2;
+	int h, r, j, k, piv, nx = 2*ncomp;
+
+	/* wr[h] + i wi[h] = w^h */
+	for (h=1; h<=2*ECF_PHASOR_NHARM; h++) {
+		wr[h] = cos(2 * M_PI * h / n);
+		wi[h] = sin(2 * M_PI * h / n);
+	}
+
+	/* At harmonic h, z (1 - a w^h + b w^2h) = c0 - c1 w^h with the
+	   unknowns (a, b, c0, c1), or z (1 - q w^h) = c0 with (q, c0) for
+	   one component; the real and imaginary parts of these are solved
+	   by least squares over the harmonics */
+	for (j=0; j<nx; j++)
+		for (k=0; k<=nx; k++)
+			m[j][k] = 0;
+	for (h=1; h<=ECF_PHASOR_NHARM; h++) {
+		pr1 = zr[h]*wr[h] - zi[h]*wi[h];
+		pi1 = zr[h]*wi[h] + zi[h]*wr[h];
+		pr2 = zr[h]*wr[2*h] - zi[h]*wi[2*h];
+		pi2 = zr[h]*wi[2*h] + zi[h]*wr[2*h];
+		if (ncomp == 1) {
+			row[0][0] = pr1; row[0][1] = 1;
+			row[1][0] = pi1; row[1][1] = 0;
+		} else {
+			row[0][0] = pr1; row[0][1] = -pr2; row[0][2] = 1; row[0][3] = -wr[h];
+			row[1][0] = pi1; row[1][1] = -pi2; row[1][2] = 0; row[1][3] = -wi[h];
+		}
+		rhs[0] = zr[h];
+		rhs[1] = zi[h];
+		for (r=0; r<2; r++)
+			for (j=0; j<nx; j++) {
+				for (k=0; k<nx; k++)
+					m[j][k] += row[r][j] * row[r][k];
+				m[j][nx] += row[r][j] * rhs[r];
+			}
+	}
+
+	/* Gaussian elimination with partial pivoting */
+	for (j=0; j<nx; j++) {
+		piv = j;
+		for (r=j+1; r<nx; r++)
+			if (fabs(m[r][j]) > fabs(m[piv][j]))
+				piv = r;
+		if (m[piv][j] == 0)
+			return -1;
+		for (k=j; k<=nx; k++) {
+			t = m[j][k]; m[j][k] = m[piv][k]; m[piv][k] = t;
+		}
+		for (r=j+1; r<nx; r++) {
+			t = m[r][j] / m[j][j];
+			for (k=j; k<=nx; k++)
+				m[r][k] -= t * m[j][k];
+		}
+	}
+	for (j=nx-1; j>=0; j--) {
+		x[j] = m[j][nx];
+		for (k=j+1; k<nx; k++)
+			x[j] -= m[j][k] * x[k];
+		x[j] /= m[j][j];
+	}
+
+	if (ncomp == 1) {
+		q[0] = x[0];
+		if (q[0] <= 0 || q[0] >= 1) return -1;
+		f[0] = x[1] / (1 - q[0]);
+		return (f[0] > 0) ? 0 : -1;
+	}
+
+	/* q1 and q2 are the roots of q^2 - a q + b */
+	disc = x[0]*x[0] - 4*x[1];
+	if (disc <= 0) return -1;
+	q[0] = 0.5 * (x[0] + sqrt(disc));  /* the longer lifetime first */
+	q[1] = 0.5 * (x[0] - sqrt(disc));
+	if (q[1] <= 0 || q[0] >= 1) return -1;
+
+	/* c0 = u1 + u2 and c1 = u1 q2 + u2 q1, where uk = fk (1 - qk) */
+	u1 = (x[2]*q[0] - x[3]) / (q[0] - q[1]);
+	u2 = (x[3] - x[2]*q[1]) / (q[0] - q[1]);
+	f[0] = u1 / (1 - q[0]);
+	f[1] = u2 / (1 - q[1]);
+	if (f[0] <= 0 || f[1] <= 0) return -1;
+
+	/* Noise mostly shows up as a long lifetime traded against the
+	   background, or as a lifetime too short to see, whose amplitude at
+	   x = 0 is then wild */
+	return (q[1] >= qmin && pow(q[0], n) < exp(-1.0)) ? 0 : -1;
+}
+
+/* Whether x fits in a float; C89 has no isfinite() */
+static int ecf_phasor_finite(double x)
+{
+	return x == x && x <= FLT_MAX && x >= -FLT_MAX;
+}
+
+/* Initial estimates for a fit of GCI_multiexp_tau() from the phasors
+   of the transient y[fit_start..fit_end-1], which should start after
+   the prompt, as for GCI_triple_integral_instr().  param[] receives Z
+   and the amplitudes and lifetimes of nparam = 3, 5 or 7 parameters,
+   the amplitudes being at x = 0 as in the fits, and allowing for the
+   prompt instr[0..ninstr-1] if there is one.
+
+   For two components the lifetimes come from the phasors as above;
+   for three, the middle lifetime is the geometric mean of these and
+   its amplitude a quarter of theirs.  If the transient only gives one
+   component, it is split between the others in the same ratios as in
+   TRI2.  Returns the number of components found, 1 or 2, or -1 if the
+   arguments are bad, there is no decay to be found, or the amplitudes
+   it gives are too large for a float, when the caller should start the
+   fit some other way. */
+
+int GCI_phasor_estimates(float xincr, float y[], int fit_start, int fit_end,
+						 float instr[], int ninstr, float param[], int nparam)
+{
+	double zr[ECF_PHASOR_NHARM+1], zi[ECF_PHASOR_NHARM+1];
+	double q[2], f[2], A[2], tau[2], g, logq, fz, m0, m1, m2, width;
+	int n, ncomp, k, j, jlast;
+
+	n = fit_end - fit_start;
+	if (xincr <= 0 || y == NULL || fit_start < 0 || n < 3 ||
+		(nparam != 3 && nparam != 5 && nparam != 7))
+		return -1;
+	if (instr == NULL || ninstr <= 0) {
+		instr = NULL;
+		ninstr = 0;
+	}
+
+	/* Two components can be no closer than twice the standard deviation
+	   of the prompt, or a bin, to lifetime 0 */
+	m0 = m1 = m2 = 0;
+	for (j=0; j<ninstr; j++) {
+		m0 += instr[j];
+		m1 += j * instr[j];
+		m2 += (double) j * j * instr[j];
+	}
+	width = 1;
+	if (m0 > 0 && m2/m0 - (m1/m0)*(m1/m0) > 0.25)
+		width = 2 * sqrt(m2/m0 - (m1/m0)*(m1/m0));
+
+	ecf_phasor_harmonics(y + fit_start, n, zr, zi);
+	if (zr[0] <= 0)
+		return -1;
+	for (k=1; k<=ECF_PHASOR_NHARM; k++) {
+		zr[k] /= zr[0];
+		zi[k] /= zr[0];
+	}
+
+	ncomp = (nparam == 3) ? 1 : 2;
+	if (ncomp == 2 &&
+		ecf_phasor_components(n, zr, zi, 2, exp(-1/width), q, f) != 0)
+		ncomp = 1;
+	if (ncomp == 1 && ecf_phasor_components(n, zr, zi, 1, 0, q, f) != 0)
+		return -1;
+
+	/* The count fz not in the components is the background.  The count
+	   of a component is A g q^fit_start (1 - q^n)/(1 - q), where g is
+	   the sum of instr[j] q^-j; the powers of q are taken from the last
+	   bin of the prompt, and the rest done in logs, as q^-j overflows
+	   for long prompts and short lifetimes. */
+	jlast = (ninstr > 0) ? ninstr - 1 : 0;
+	fz = 1;
+	for (k=0; k<ncomp; k++) {
+		logq = log(q[k]);
+		g = 0;
+		for (j=0; j<ninstr; j++)
+			g += instr[j] * exp((jlast - j) * logq);
+		if (g <= 0)
+			g = 1;
+		A[k] = f[k] * zr[0] * (1 - q[k]) / (g * (1 - exp(n * logq))) *
+			exp(-(fit_start - jlast) * logq);
+		tau[k] = -xincr / logq;
+		fz -= f[k];
+	}
+	param[0] = (float) (fz * zr[0] / n);
+
+	if (ncomp == 1) {
+		if (!ecf_phasor_finite(A[0]))
+			return -1;
+		param[1] = (float) A[0];
+		param[2] = (float) tau[0];
+		switch (nparam) {
+		case 5:
+			param[1] = (float) (0.75 * A[0]);
+			param[3] = (float) (0.25 * A[0]);
+			param[4] = (float) (0.6666667 * tau[0]);
+			break;
+		case 7:
+			param[1] = (float) (0.75 * A[0]);
+			param[3] = param[5] = (float) (0.1666667 * A[0]);
+			param[4] = (float) (0.6666667 * tau[0]);
+			param[6] = (float) (0.3333333 * tau[0]);
+			break;
+		}
+		return 1;
+	}
+
+	if (!(ecf_phasor_finite(A[0]) && ecf_phasor_finite(A[1])))
+		return -1;
+	param[1] = (float) A[0];
+	param[2] = (float) tau[0];
+	if (nparam == 5) {
+		param[3] = (float) A[1];
+		param[4] = (float) tau[1];
+	} else {
+		param[3] = (float) (0.25 * (A[0] + A[1]));
+		param[4] = (float) sqrt(tau[0] * tau[1]);
+		param[5] = (float) A[1];
+		param[6] = (float) tau[1];
+	}
+	return 2;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
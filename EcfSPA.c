@@ -0,0 +1,829 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the support plane analysis (SPA): one or two of
+   the parameters are held at each of a grid of values in turn while the
+   others are fitted, and the chi-squared of each fit is recorded, to
+   give the confidence intervals of those parameters.
+
+   Each fit starts from the fit of a neighbouring grid point, which is
+   usually very close to its answer.  For the single transient fits the
+   grid is shared out between threads with OpenMP: the first column (the
+   values of the first parameter, with the second at its lowest value)
+   is cut into one run of neighbouring points per thread, each run
+   starting from the caller's parameters, and then each row is fitted
+   along from its first point, the rows being handed out to the threads
+   as they become free.  The global fits are already spread over the
+   threads by GCI_marquardt_global_generic_instr(), so their grid is
+   fitted one point at a time, row by row in alternate directions so
+   that each point follows a neighbour.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "EcfInternal.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* The single transient support plane.  The fits are by GCI_marquardt()
+   if x is not NULL, otherwise by GCI_marquardt_fitting_engine(). */
+typedef struct {
+	float *x;
+	float xincr;
+	float *y;
+	int ndata, fit_start, fit_end;
+	float *instr;
+	int ninstr;
+	noise_type noise;
+	float *sig;
+	float *param;
+	int *paramfree;
+	int nparam;
+	restrain_type restrain;
+	float chisq_delta, chisq_target;
+	void (*fitfunc)(float, float [], float *, float [], int);
+	int spa_param1, spa_nvalues1;
+	float spa_low1, spa_high1;
+	int spa_param2, spa_nvalues2;  /* -1 and 1 for a one dimensional plane */
+	float spa_low2, spa_high2;
+	void (*progressfunc)(float);
+	int done;                      /* grid points fitted so far */
+} ecf_spa;
+
+/* The global support plane; fitfunc is NULL for the exps fits */
+typedef struct {
+	float xincr;
+	float **trans;
+	int ndata, ntrans, fit_start, fit_end;
+	float *instr;
+	int ninstr;
+	noise_type noise;
+	float *sig;
+	int ftype;
+	float **param;
+	int *paramfree;
+	int nparam;
+	int *gparam;
+	restrain_type restrain;
+	float chisq_delta;
+	int drop_bad_transients;
+	void (*fitfunc)(float, float [], float *, float [], int);
+	int spa_param1, spa_nvalues1;
+	float spa_low1, spa_high1;
+	int spa_param2, spa_nvalues2;
+	float spa_low2, spa_high2;
+	void (*progressfunc)(float);
+} ecf_spa_global;
+
+/* The value of grid point i of nvalues from low to high */
+static float ecf_spa_value(float low, float high, int nvalues, int i)
+{
+	return (nvalues > 1) ? low + (high - low) * i / (nvalues - 1) : low;
+}
+
+static int ecf_spa_check_args(int nparam, int spa_param1, int spa_nvalues1,
+							  int spa_param2, int spa_nvalues2)
+{
+	if (nparam < 1 || nparam > MAXFIT)
+		return -1;
+	if (spa_param1 < 0 || spa_param1 >= nparam || spa_nvalues1 < 1)
+		return -1;
+	if (spa_param2 != -1 &&
+		(spa_param2 < 0 || spa_param2 >= nparam || spa_param2 == spa_param1 ||
+		 spa_nvalues2 < 1))
+		return -1;
+	return 0;
+}
+
+/* Fits grid point (i, j), starting from start[], which on success is
+   given the fitted parameters to start the next point from.  Returns
+   the chi-squared, or -1 if the fit fails. */
+static float ecf_spa_point(ecf_spa *spa, ecf_workspace *ws,
+						   float **covar, float **alpha,
+						   float *fitted, float *residuals,
+						   int i, int j, float start[])
+{
+	float param[MAXFIT], chisq = 0.0f;
+	int paramfree[MAXFIT], k, ret, done;
+
+	for (k=0; k<spa->nparam; k++) {
+		param[k] = start[k];
+		paramfree[k] = spa->paramfree[k];
+	}
+	param[spa->spa_param1] =
+		ecf_spa_value(spa->spa_low1, spa->spa_high1, spa->spa_nvalues1, i);
+	paramfree[spa->spa_param1] = 0;
+	if (spa->spa_param2 >= 0) {
+		param[spa->spa_param2] =
+			ecf_spa_value(spa->spa_low2, spa->spa_high2, spa->spa_nvalues2, j);
+		paramfree[spa->spa_param2] = 0;
+	}
+
+	if (spa->x != NULL)
+		ret = GCI_marquardt_ws(ws, spa->x, spa->y, spa->ndata,
+							   spa->noise, spa->sig,
+							   param, paramfree, spa->nparam, spa->restrain,
+							   spa->fitfunc, fitted, residuals,
+							   covar, alpha, &chisq,
+							   spa->chisq_delta, 0.0f, NULL);
+	else
+		ret = GCI_marquardt_fitting_engine_ws(ws, spa->xincr, spa->y, spa->ndata,
+							   spa->fit_start, spa->fit_end,
+							   spa->instr, spa->ninstr, spa->noise, spa->sig,
+							   param, paramfree, spa->nparam, spa->restrain,
+							   spa->fitfunc, fitted, residuals, &chisq,
+							   covar, alpha, NULL,
+							   spa->chisq_target, spa->chisq_delta, 0);
+
+	/* Only the first thread reports progress, so the callback need not
+	   be thread safe */
+#ifdef _OPENMP
+#pragma omp critical(ecf_spa_progress)
+#endif
+	done = ++spa->done;
+	if (spa->progressfunc != NULL) {
+#ifdef _OPENMP
+		if (omp_get_thread_num() == 0)
+#endif
+			(*spa->progressfunc)((float) done /
+								 (spa->spa_nvalues1 * spa->spa_nvalues2));
+	}
+
+	if (ret < 0)
+		return -1.0f;
+	for (k=0; k<spa->nparam; k++)
+		start[k] = param[k];
+	return chisq;
+}
+
+/* Fits the whole grid, putting the chi-squared of point (i, j) in
+   chisq[i*spa_nvalues2 + j].  Returns the number of fits which failed,
+   or -2 if out of memory. */
+static int ecf_spa_grid(ecf_spa *spa, float chisq[])
+{
+	int n1 = spa->spa_nvalues1, n2 = spa->spa_nvalues2, nparam = spa->nparam;
+	int nthreads, nruns, nfailed = 0, nomem = 0;
+	float *rowstart;
+
+	nthreads = ecf_batch_nthreads(0);
+	if (ecf_export_params_active())
+		nthreads = 1;  /* the export file is shared by all fits */
+	nruns = (nthreads < n1) ? nthreads : n1;
+
+	if ((rowstart = (float *) malloc((size_t) n1 * nparam * sizeof(float))) == NULL)
+		return -2;
+	spa->done = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) reduction(+:nfailed, nomem)
+#endif
+	{
+		ecf_workspace *ws = GCI_ecf_workspace(spa->ndata, nparam);
+		float **covar = GCI_ecf_matrix(nparam, nparam);
+		float **alpha = GCI_ecf_matrix(nparam, nparam);
+		float *fitted = (float *) malloc((size_t) spa->ndata * sizeof(float));
+		float *residuals = (float *) malloc((size_t) spa->ndata * sizeof(float));
+		int ok = (ws != NULL && covar != NULL && alpha != NULL &&
+				  fitted != NULL && residuals != NULL);
+		float start[MAXFIT];
+		int r, i, j;
+
+		if (!ok)
+			nomem++;
+
+		/* The first column, in runs of neighbouring points */
+#ifdef _OPENMP
+#pragma omp for schedule(static, 1)
+#endif
+		for (r=0; r<nruns; r++) {
+			memcpy(start, spa->param, (size_t) nparam * sizeof(float));
+			for (i = r*n1/nruns; i < (r+1)*n1/nruns; i++) {
+				chisq[(size_t) i*n2] = ok ?
+					ecf_spa_point(spa, ws, covar, alpha, fitted, residuals,
+								  i, 0, start) : -1.0f;
+				if (chisq[(size_t) i*n2] < 0.0f)
+					nfailed++;
+				memcpy(rowstart + (size_t) i*nparam, start,
+					   (size_t) nparam * sizeof(float));
+			}
+		}
+
+		/* and then each row from its first point */
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1)
+#endif
+		for (i=0; i<n1; i++) {
+			memcpy(start, rowstart + (size_t) i*nparam, (size_t) nparam * sizeof(float));
+			for (j=1; j<n2; j++) {
+				chisq[(size_t) i*n2 + j] = ok ?
+					ecf_spa_point(spa, ws, covar, alpha, fitted, residuals,
+								  i, j, start) : -1.0f;
+				if (chisq[(size_t) i*n2 + j] < 0.0f)
+					nfailed++;
+			}
+		}
+
+		GCI_ecf_free_workspace(ws);
+		GCI_ecf_free_matrix(covar);
+		GCI_ecf_free_matrix(alpha);
+		free(fitted);
+		free(residuals);
+	}
+
+	free(rowstart);
+	if (spa->progressfunc != NULL)
+		(*spa->progressfunc)(1.0f);
+	return (nomem > 0) ? -2 : nfailed;
+}
+
+/* Fits the global grid one point at a time, giving the chi-squared
+   and degrees of freedom of point (i, j) in chisq_global[i*n2 + j] and
+   df[i*n2 + j], where n2 is spa_nvalues2.  Returns the number of fits which failed, or -2 if out
+   of memory. */
+static int ecf_spa_global_grid(ecf_spa_global *spa, float chisq_global[], int df[])
+{
+	int n1 = spa->spa_nvalues1, n2 = spa->spa_nvalues2, nparam = spa->nparam;
+	int ntrans = spa->ntrans, nfailed = 0, paramfree[MAXFIT];
+	float **work, *rows, *saved;
+	int i, j, jj, t, k, ret;
+	size_t size = (size_t) ntrans * nparam * sizeof(float);
+
+	work = (float **) malloc((size_t) ntrans * sizeof(float *));
+	rows = (float *) malloc(size);
+	saved = (float *) malloc(size);
+	if (work == NULL || rows == NULL || saved == NULL) {
+		free(work);
+		free(rows);
+		free(saved);
+		return -2;
+	}
+	for (t=0; t<ntrans; t++) {
+		work[t] = rows + (size_t) t * nparam;
+		memcpy(work[t], spa->param[t], (size_t) nparam * sizeof(float));
+	}
+
+	for (k=0; k<nparam; k++)
+		paramfree[k] = spa->paramfree[k];
+	paramfree[spa->spa_param1] = 0;
+	if (spa->spa_param2 >= 0)
+		paramfree[spa->spa_param2] = 0;
+
+	for (i=0; i<n1; i++) {
+		for (jj=0; jj<n2; jj++) {
+			j = (i % 2 == 0) ? jj : n2-1-jj;
+			memcpy(saved, rows, size);
+
+			/* The fixed values go in every transient, so they hold whether
+			   the parameters are global or local */
+			for (t=0; t<ntrans; t++) {
+				work[t][spa->spa_param1] =
+					ecf_spa_value(spa->spa_low1, spa->spa_high1, n1, i);
+				if (spa->spa_param2 >= 0)
+					work[t][spa->spa_param2] =
+						ecf_spa_value(spa->spa_low2, spa->spa_high2, n2, j);
+			}
+
+			if (spa->fitfunc == NULL)
+				ret = GCI_marquardt_global_exps_instr(spa->xincr, spa->trans,
+							spa->ndata, ntrans, spa->fit_start, spa->fit_end,
+							spa->instr, spa->ninstr, spa->noise, spa->sig, spa->ftype,
+							work, paramfree, nparam, spa->restrain, spa->chisq_delta,
+							NULL, NULL, NULL,
+							&chisq_global[(size_t) i*n2 + j], &df[(size_t) i*n2 + j],
+							spa->drop_bad_transients);
+			else
+				ret = GCI_marquardt_global_generic_instr(spa->xincr, spa->trans,
+							spa->ndata, ntrans, spa->fit_start, spa->fit_end,
+							spa->instr, spa->ninstr, spa->noise, spa->sig,
+							work, paramfree, nparam, spa->gparam,
+							spa->restrain, spa->chisq_delta, spa->fitfunc,
+							NULL, NULL, NULL,
+							&chisq_global[(size_t) i*n2 + j], &df[(size_t) i*n2 + j]);
+
+			if (ret < 0) {
+				/* the next point starts from the last good fit */
+				nfailed++;
+				chisq_global[(size_t) i*n2 + j] = -1.0f;
+				df[(size_t) i*n2 + j] = -1;
+				memcpy(rows, saved, size);
+			}
+
+			if (spa->progressfunc != NULL)
+				(*spa->progressfunc)((float) (i*n2 + jj + 1) / (n1 * n2));
+		}
+	}
+
+	free(work);
+	free(rows);
+	free(saved);
+	return nfailed;
+}
+
+/* Copies the results of a two dimensional grid out into the caller's
+   array */
+static void ecf_spa_copy_2D(float *from, float **to, int n1, int n2)
+{
+	int i, j;
+
+	for (i=0; i<n1; i++)
+		for (j=0; j<n2; j++)
+			to[i][j] = from[(size_t) i*n2 + j];
+}
+
+
+/********************************************************************
+
+					  SINGLE TRANSIENT SUPPORT PLANES
+
+ ********************************************************************/
+
+/* The support plane of parameter spa_param over spa_nvalues values from
+   spa_low to spa_high: chisq[i] is the chi-squared of the fit of the
+   other free parameters with spa_param held at the i'th value.  The
+   other arguments are as for GCI_marquardt(); param[] holds the
+   starting values, and is not changed.  progressfunc, if not NULL, is
+   called from time to time with the fraction of the fits done, always
+   from the calling thread.
+
+   Returns the number of fits which failed (their chisq is -1), or -1
+   if the arguments are bad or -2 if out of memory. */
+
+int GCI_SPA_1D_marquardt(
+				float x[], float y[], int ndata,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param, int spa_nvalues,
+				float spa_low, float spa_high,
+				float chisq[], void (*progressfunc)(float))
+{
+	ecf_spa spa;
+
+	if (x == NULL || y == NULL || param == NULL || paramfree == NULL ||
+		fitfunc == NULL || chisq == NULL || ndata < 1 ||
+		ecf_spa_check_args(nparam, spa_param, spa_nvalues, -1, 1) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.x = x;
+	spa.y = y;
+	spa.ndata = ndata;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.fitfunc = fitfunc;
+	spa.spa_param1 = spa_param;
+	spa.spa_nvalues1 = spa_nvalues;
+	spa.spa_low1 = spa_low;
+	spa.spa_high1 = spa_high;
+	spa.spa_param2 = -1;
+	spa.spa_nvalues2 = 1;
+	spa.progressfunc = progressfunc;
+
+	return ecf_spa_grid(&spa, chisq);
+}
+
+/* As GCI_SPA_1D_marquardt(), over the grid of spa_nvalues1 values of
+   spa_param1 and spa_nvalues2 values of spa_param2, with the fit of the
+   i'th value of one and the j'th of the other in chisq[i][j]. */
+
+int GCI_SPA_2D_marquardt(
+				float x[], float y[], int ndata,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param1, int spa_nvalues1,
+				float spa_low1, float spa_high1,
+				int spa_param2, int spa_nvalues2,
+				float spa_low2, float spa_high2,
+				float **chisq, void (*progressfunc)(float))
+{
+	ecf_spa spa;
+	float *grid;
+	int ret;
+
+	if (x == NULL || y == NULL || param == NULL || paramfree == NULL ||
+		fitfunc == NULL || chisq == NULL || ndata < 1 ||
+		ecf_spa_check_args(nparam, spa_param1, spa_nvalues1,
+						   spa_param2, spa_nvalues2) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.x = x;
+	spa.y = y;
+	spa.ndata = ndata;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.fitfunc = fitfunc;
+	spa.spa_param1 = spa_param1;
+	spa.spa_nvalues1 = spa_nvalues1;
+	spa.spa_low1 = spa_low1;
+	spa.spa_high1 = spa_high1;
+	spa.spa_param2 = spa_param2;
+	spa.spa_nvalues2 = spa_nvalues2;
+	spa.spa_low2 = spa_low2;
+	spa.spa_high2 = spa_high2;
+	spa.progressfunc = progressfunc;
+
+	if ((grid = (float *) malloc((size_t) spa_nvalues1 * spa_nvalues2 *
+								 sizeof(float))) == NULL)
+		return -2;
+	if ((ret = ecf_spa_grid(&spa, grid)) >= 0)
+		ecf_spa_copy_2D(grid, chisq, spa_nvalues1, spa_nvalues2);
+	free(grid);
+	return ret;
+}
+
+/* As GCI_SPA_1D_marquardt(), with the fits made by
+   GCI_marquardt_fitting_engine(), which refits until chi-squared
+   reaches chisq_target or stops improving. */
+
+int GCI_SPA_1D_marquardt_instr(
+				float xincr, float y[],
+				int ndata, int fit_start, int fit_end,
+				float instr[], int ninstr,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param, int spa_nvalues,
+				float spa_low, float spa_high,
+				float chisq[], float chisq_target, void (*progressfunc)(float))
+{
+	ecf_spa spa;
+
+	if (y == NULL || param == NULL || paramfree == NULL ||
+		fitfunc == NULL || chisq == NULL || xincr <= 0 ||
+		fit_start < 0 || fit_start > fit_end || fit_end > ndata ||
+		ecf_spa_check_args(nparam, spa_param, spa_nvalues, -1, 1) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.xincr = xincr;
+	spa.y = y;
+	spa.ndata = ndata;
+	spa.fit_start = fit_start;
+	spa.fit_end = fit_end;
+	spa.instr = instr;
+	spa.ninstr = ninstr;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.chisq_target = chisq_target;
+	spa.fitfunc = fitfunc;
+	spa.spa_param1 = spa_param;
+	spa.spa_nvalues1 = spa_nvalues;
+	spa.spa_low1 = spa_low;
+	spa.spa_high1 = spa_high;
+	spa.spa_param2 = -1;
+	spa.spa_nvalues2 = 1;
+	spa.progressfunc = progressfunc;
+
+	return ecf_spa_grid(&spa, chisq);
+}
+
+int GCI_SPA_2D_marquardt_instr(
+				float xincr, float y[],
+				int ndata, int fit_start, int fit_end,
+				float instr[], int ninstr,
+				noise_type noise, float sig[],
+				float param[], int paramfree[], int nparam,
+				restrain_type restrain, float chisq_delta,
+				void (*fitfunc)(float, float [], float *, float [], int),
+				int spa_param1, int spa_nvalues1,
+				float spa_low1, float spa_high1,
+				int spa_param2, int spa_nvalues2,
+				float spa_low2, float spa_high2,
+				float **chisq, float chisq_target, void (*progressfunc)(float))
+{
+	ecf_spa spa;
+	float *grid;
+	int ret;
+
+	if (y == NULL || param == NULL || paramfree == NULL ||
+		fitfunc == NULL || chisq == NULL || xincr <= 0 ||
+		fit_start < 0 || fit_start > fit_end || fit_end > ndata ||
+		ecf_spa_check_args(nparam, spa_param1, spa_nvalues1,
+						   spa_param2, spa_nvalues2) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.xincr = xincr;
+	spa.y = y;
+	spa.ndata = ndata;
+	spa.fit_start = fit_start;
+	spa.fit_end = fit_end;
+	spa.instr = instr;
+	spa.ninstr = ninstr;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.chisq_target = chisq_target;
+	spa.fitfunc = fitfunc;
+	spa.spa_param1 = spa_param1;
+	spa.spa_nvalues1 = spa_nvalues1;
+	spa.spa_low1 = spa_low1;
+	spa.spa_high1 = spa_high1;
+	spa.spa_param2 = spa_param2;
+	spa.spa_nvalues2 = spa_nvalues2;
+	spa.spa_low2 = spa_low2;
+	spa.spa_high2 = spa_high2;
+	spa.progressfunc = progressfunc;
+
+	if ((grid = (float *) malloc((size_t) spa_nvalues1 * spa_nvalues2 *
+								 sizeof(float))) == NULL)
+		return -2;
+	if ((ret = ecf_spa_grid(&spa, grid)) >= 0)
+		ecf_spa_copy_2D(grid, chisq, spa_nvalues1, spa_nvalues2);
+	free(grid);
+	return ret;
+}
+
+
+/********************************************************************
+
+						 GLOBAL SUPPORT PLANES
+
+ ********************************************************************/
+
+/* The support planes of the global fits: chisq_global[i] and df[i] are
+   those of the global fit with spa_param held at the i'th value in
+   every transient.  The other arguments are as for
+   GCI_marquardt_global_exps_instr(); param is not changed.  Returns as
+   GCI_SPA_1D_marquardt() does, with df -1 for the fits which failed. */
+
+int GCI_SPA_1D_marquardt_global_exps_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta, int drop_bad_transients,
+					int spa_param, int spa_nvalues,
+					float spa_low, float spa_high,
+					float chisq_global[], int df[], void (*progressfunc)(float))
+{
+	ecf_spa_global spa;
+
+	if (trans == NULL || param == NULL || paramfree == NULL ||
+		chisq_global == NULL || df == NULL || ntrans < 1 ||
+		ecf_spa_check_args(nparam, spa_param, spa_nvalues, -1, 1) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.xincr = xincr;
+	spa.trans = trans;
+	spa.ndata = ndata;
+	spa.ntrans = ntrans;
+	spa.fit_start = fit_start;
+	spa.fit_end = fit_end;
+	spa.instr = instr;
+	spa.ninstr = ninstr;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.ftype = ftype;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.drop_bad_transients = drop_bad_transients;
+	spa.spa_param1 = spa_param;
+	spa.spa_nvalues1 = spa_nvalues;
+	spa.spa_low1 = spa_low;
+	spa.spa_high1 = spa_high;
+	spa.spa_param2 = -1;
+	spa.spa_nvalues2 = 1;
+	spa.progressfunc = progressfunc;
+
+	return ecf_spa_global_grid(&spa, chisq_global, df);
+}
+
+int GCI_SPA_2D_marquardt_global_exps_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[], int ftype,
+					float **param, int paramfree[], int nparam,
+					restrain_type restrain, float chisq_delta, int drop_bad_transients,
+					int spa_param1, int spa_nvalues1,
+					float spa_low1, float spa_high1,
+					int spa_param2, int spa_nvalues2,
+					float spa_low2, float spa_high2,
+					float **chisq_global, int **df, void (*progressfunc)(float))
+{
+	ecf_spa_global spa;
+	float *grid;
+	int *griddf, ret, i, j;
+
+	if (trans == NULL || param == NULL || paramfree == NULL ||
+		chisq_global == NULL || df == NULL || ntrans < 1 ||
+		ecf_spa_check_args(nparam, spa_param1, spa_nvalues1,
+						   spa_param2, spa_nvalues2) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.xincr = xincr;
+	spa.trans = trans;
+	spa.ndata = ndata;
+	spa.ntrans = ntrans;
+	spa.fit_start = fit_start;
+	spa.fit_end = fit_end;
+	spa.instr = instr;
+	spa.ninstr = ninstr;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.ftype = ftype;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.drop_bad_transients = drop_bad_transients;
+	spa.spa_param1 = spa_param1;
+	spa.spa_nvalues1 = spa_nvalues1;
+	spa.spa_low1 = spa_low1;
+	spa.spa_high1 = spa_high1;
+	spa.spa_param2 = spa_param2;
+	spa.spa_nvalues2 = spa_nvalues2;
+	spa.spa_low2 = spa_low2;
+	spa.spa_high2 = spa_high2;
+	spa.progressfunc = progressfunc;
+
+	grid = (float *) malloc((size_t) spa_nvalues1 * spa_nvalues2 * sizeof(float));
+	griddf = (int *) malloc((size_t) spa_nvalues1 * spa_nvalues2 * sizeof(int));
+	ret = -2;
+	if (grid != NULL && griddf != NULL &&
+		(ret = ecf_spa_global_grid(&spa, grid, griddf)) >= 0) {
+		ecf_spa_copy_2D(grid, chisq_global, spa_nvalues1, spa_nvalues2);
+		for (i=0; i<spa_nvalues1; i++)
+			for (j=0; j<spa_nvalues2; j++)
+				df[i][j] = griddf[(size_t) i*spa_nvalues2 + j];
+	}
+	free(grid);
+	free(griddf);
+	return ret;
+}
+
+/* As GCI_SPA_1D_marquardt_global_exps_instr(), for the fits of
+   GCI_marquardt_global_generic_instr() */
+
+int GCI_SPA_1D_marquardt_global_generic_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					int spa_param, int spa_nvalues,
+					float spa_low, float spa_high,
+					float chisq_global[], int df[], void (*progressfunc)(float))
+{
+	ecf_spa_global spa;
+
+	if (trans == NULL || param == NULL || paramfree == NULL || gparam == NULL ||
+		fitfunc == NULL || chisq_global == NULL || df == NULL || ntrans < 1 ||
+		ecf_spa_check_args(nparam, spa_param, spa_nvalues, -1, 1) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.xincr = xincr;
+	spa.trans = trans;
+	spa.ndata = ndata;
+	spa.ntrans = ntrans;
+	spa.fit_start = fit_start;
+	spa.fit_end = fit_end;
+	spa.instr = instr;
+	spa.ninstr = ninstr;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.gparam = gparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.fitfunc = fitfunc;
+	spa.spa_param1 = spa_param;
+	spa.spa_nvalues1 = spa_nvalues;
+	spa.spa_low1 = spa_low;
+	spa.spa_high1 = spa_high;
+	spa.spa_param2 = -1;
+	spa.spa_nvalues2 = 1;
+	spa.progressfunc = progressfunc;
+
+	return ecf_spa_global_grid(&spa, chisq_global, df);
+}
+
+int GCI_SPA_2D_marquardt_global_generic_instr(
+					float xincr, float **trans,
+					int ndata, int ntrans, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float **param, int paramfree[], int nparam, int gparam[],
+					restrain_type restrain, float chisq_delta,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					int spa_param1, int spa_nvalues1,
+					float spa_low1, float spa_high1,
+					int spa_param2, int spa_nvalues2,
+					float spa_low2, float spa_high2,
+					float **chisq_global, int **df, void (*progressfunc)(float))
+{
+	ecf_spa_global spa;
+	float *grid;
+	int *griddf, ret, i, j;
+
+	if (trans == NULL || param == NULL || paramfree == NULL || gparam == NULL ||
+		fitfunc == NULL || chisq_global == NULL || df == NULL || ntrans < 1 ||
+		ecf_spa_check_args(nparam, spa_param1, spa_nvalues1,
+						   spa_param2, spa_nvalues2) != 0)
+		return -1;
+
+	memset(&spa, 0, sizeof(spa));
+	spa.xincr = xincr;
+	spa.trans = trans;
+	spa.ndata = ndata;
+	spa.ntrans = ntrans;
+	spa.fit_start = fit_start;
+	spa.fit_end = fit_end;
+	spa.instr = instr;
+	spa.ninstr = ninstr;
+	spa.noise = noise;
+	spa.sig = sig;
+	spa.param = param;
+	spa.paramfree = paramfree;
+	spa.nparam = nparam;
+	spa.gparam = gparam;
+	spa.restrain = restrain;
+	spa.chisq_delta = chisq_delta;
+	spa.fitfunc = fitfunc;
+	spa.spa_param1 = spa_param1;
+	spa.spa_nvalues1 = spa_nvalues1;
+	spa.spa_low1 = spa_low1;
+	spa.spa_high1 = spa_high1;
+	spa.spa_param2 = spa_param2;
+	spa.spa_nvalues2 = spa_nvalues2;
+	spa.spa_low2 = spa_low2;
+	spa.spa_high2 = spa_high2;
+	spa.progressfunc = progressfunc;
+
+	grid = (float *) malloc((size_t) spa_nvalues1 * spa_nvalues2 * sizeof(float));
+	griddf = (int *) malloc((size_t) spa_nvalues1 * spa_nvalues2 * sizeof(int));
+	ret = -2;
+	if (grid != NULL && griddf != NULL &&
+		(ret = ecf_spa_global_grid(&spa, grid, griddf)) >= 0) {
+		ecf_spa_copy_2D(grid, chisq_global, spa_nvalues1, spa_nvalues2);
+		for (i=0; i<spa_nvalues1; i++)
+			for (j=0; j<spa_nvalues2; j++)
+				df[i][j] = griddf[(size_t) i*spa_nvalues2 + j];
+	}
+	free(grid);
+	free(griddf);
+	return ret;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
@@ -0,0 +1,804 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains vectorised versions of the multiexponential array
+   functions of EcfUtil.c, which evaluate the model and its derivatives
+   for a whole transient at a time.
+
+   The scalar functions run along the bins and keep exp(-x/tau) for each
+   component as a double recurrence, which is hard for a compiler to
+   vectorise.  Here each component is done in turn over a tile of bins,
+   a vector of consecutive bins at a time, and the results are written
+   as contiguous columns of the tile, which are then copied into the
+   rows: the double recurrence is kept, but each lane steps by
+   exp(-W*xincr/tau) for W lanes.  The float arithmetic after
+   that is done in the same order as in the scalar functions, so the
+   results agree with them to within the last bit or so of the
+   exponentials.
+
+   The stretched exponential needs a log and two exps per bin, with no
+   recurrence to help.  In the ECF_ACCURACY_FAST mode (see
+   GCI_ecf_set_workspace_accuracy) these are replaced by the Cephes
+   polynomial approximations, evaluated a vector of bins at a time.
+   The error in the result is then dominated, as it is with the C
+   library, by the rounding of the float argument of the outer exp():
+   both give a relative error of about 3e-7 * max(1, (x/tau)^(1/h)).
+
+   The instruction set is chosen at run time (AVX-512F, AVX2 with FMA, or
+   SSE2) on x86 with gcc or clang; elsewhere, or if ECF_NO_SIMD is
+   defined, the plain C versions are used.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+#if !defined(ECF_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define ECF_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Number of bins done at a time by the row layout functions */
+#define ECF_SIMD_TILE 64
+
+/* Returns the instruction set the kernels will use: 0 for plain C,
+   1 for SSE2, 2 for AVX2 and FMA, and 3 for AVX-512F. */
+int ecf_simd_level(void)
+{
+#ifdef ECF_X86_SIMD
+	static int level = -1;
+	int l;
+
+	/* The fits call this from their worker threads, so the cached level
+	   is read and written atomically; any thread working it out gets the
+	   same answer */
+	l = __atomic_load_n(&level, __ATOMIC_ACQUIRE);
+	if (l < 0) {
+		l = 0;
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f")) l = 3;
+		else if (__builtin_cpu_supports("avx2") &&
+				 __builtin_cpu_supports("fma")) l = 2;
+		else if (__builtin_cpu_supports("sse2")) l = 1;
+		__atomic_store_n(&level, l, __ATOMIC_RELEASE);
+	}
+	return l;
+#else
+	return 0;
+#endif
+}
+
+#ifdef ECF_X86_SIMD
+
+/* The kernels each do one component over bins i0..i0+n-1 (n a multiple
+   of 8, or the last call for the transient):
+
+      dA[t] = (float) e(i0+t)                   where e(i) = q^i
+      y[t]  = (first ? 0 : y[t]) + dA[t]*amp
+      dr[t] = dA[t]*amp * xincr * (float)(i0+t) * dfac
+
+   and they return e(i0+n), starting from e = e(i0).  For taus,
+   dfac = 1/tau^2; for lambdas, dfac = -1. */
+
+__attribute__((target("sse2")))
+static double ecf_expcol_sse2(double e, double q, float amp, float xincr, float dfac,
+							  int first, int i0, int n, float *y, float *dA, float *dr)
+{
+	double q2 = q*q, q4 = q2*q2;
+	__m128d elo = _mm_set_pd(e*q, e), ehi = _mm_set_pd(e*q2*q, e*q2);
+	__m128d step = _mm_set1_pd(q4);
+	__m128 vamp = _mm_set1_ps(amp), vxincr = _mm_set1_ps(xincr), vdfac = _mm_set1_ps(dfac);
+	__m128 vi = _mm_set_ps((float)(i0+3), (float)(i0+2), (float)(i0+1), (float) i0);
+	__m128 four = _mm_set1_ps(4.0f);
+	float tmp[3][4];
+	int t, k;
+
+	for (t=0; t<n; t+=4) {
+		__m128 ef = _mm_movelh_ps(_mm_cvtpd_ps(elo), _mm_cvtpd_ps(ehi));
+		__m128 ex = _mm_mul_ps(ef, vamp);
+		__m128 d = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(ex, vxincr), vi), vdfac);
+
+		if (t+4 <= n) {
+			_mm_storeu_ps(dA+t, ef);
+			_mm_storeu_ps(y+t, first ? ex : _mm_add_ps(_mm_loadu_ps(y+t), ex));
+			_mm_storeu_ps(dr+t, d);
+		} else {
+			_mm_storeu_ps(tmp[0], ef);
+			_mm_storeu_ps(tmp[1], ex);
+			_mm_storeu_ps(tmp[2], d);
+			for (k=0; t+k<n; k++) {
+				dA[t+k] = tmp[0][k];
+				y[t+k] = first ? tmp[1][k] : y[t+k] + tmp[1][k];
+				dr[t+k] = tmp[2][k];
+			}
+		}
+
+		elo = _mm_mul_pd(elo, step);
+		ehi = _mm_mul_pd(ehi, step);
+		vi = _mm_add_ps(vi, four);
+	}
+
+	return _mm_cvtsd_f64(elo);
+}
+
+__attribute__((target("avx2")))
+static double ecf_expcol_avx2(double e, double q, float amp, float xincr, float dfac,
+							  int first, int i0, int n, float *y, float *dA, float *dr)
+{
+	double q2 = q*q, q4 = q2*q2, q8 = q4*q4;
+	__m256d elo = _mm256_set_pd(e*q2*q, e*q2, e*q, e);
+	__m256d ehi = _mm256_set_pd(e*q4*q2*q, e*q4*q2, e*q4*q, e*q4);
+	__m256d step = _mm256_set1_pd(q8);
+	__m256 vamp = _mm256_set1_ps(amp), vxincr = _mm256_set1_ps(xincr);
+	__m256 vdfac = _mm256_set1_ps(dfac);
+	__m256 vi = _mm256_set_ps((float)(i0+7), (float)(i0+6), (float)(i0+5), (float)(i0+4),
+							  (float)(i0+3), (float)(i0+2), (float)(i0+1), (float) i0);
+	__m256 eight = _mm256_set1_ps(8.0f);
+	float tmp[3][8];
+	int t, k;
+
+	for (t=0; t<n; t+=8) {
+		__m256 ef = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(elo)),
+										 _mm256_cvtpd_ps(ehi), 1);
+		__m256 ex = _mm256_mul_ps(ef, vamp);
+		__m256 d = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(ex, vxincr), vi), vdfac);
+
+		if (t+8 <= n) {
+			_mm256_storeu_ps(dA+t, ef);
+			_mm256_storeu_ps(y+t, first ? ex : _mm256_add_ps(_mm256_loadu_ps(y+t), ex));
+			_mm256_storeu_ps(dr+t, d);
+		} else {
+			_mm256_storeu_ps(tmp[0], ef);
+			_mm256_storeu_ps(tmp[1], ex);
+			_mm256_storeu_ps(tmp[2], d);
+			for (k=0; t+k<n; k++) {
+				dA[t+k] = tmp[0][k];
+				y[t+k] = first ? tmp[1][k] : y[t+k] + tmp[1][k];
+				dr[t+k] = tmp[2][k];
+			}
+		}
+
+		elo = _mm256_mul_pd(elo, step);
+		ehi = _mm256_mul_pd(ehi, step);
+		vi = _mm256_add_ps(vi, eight);
+	}
+
+	return _mm256_cvtsd_f64(elo);
+}
+
+__attribute__((target("avx512f")))
+static double ecf_expcol_avx512(double e, double q, float amp, float xincr, float dfac,
+								int first, int i0, int n, float *y, float *dA, float *dr)
+{
+	double q2 = q*q, q4 = q2*q2, q8 = q4*q4;
+	__m512d ev = _mm512_set_pd(e*q4*q2*q, e*q4*q2, e*q4*q, e*q4,
+							   e*q2*q, e*q2, e*q, e);
+	__m512d step = _mm512_set1_pd(q8);
+	__m256 vamp = _mm256_set1_ps(amp), vxincr = _mm256_set1_ps(xincr);
+	__m256 vdfac = _mm256_set1_ps(dfac);
+	__m256 vi = _mm256_set_ps((float)(i0+7), (float)(i0+6), (float)(i0+5), (float)(i0+4),
+							  (float)(i0+3), (float)(i0+2), (float)(i0+1), (float) i0);
+	__m256 eight = _mm256_set1_ps(8.0f);
+	float tmp[3][8];
+	int t, k;
+
+	for (t=0; t<n; t+=8) {
+		__m256 ef = _mm512_cvtpd_ps(ev);
+		__m256 ex = _mm256_mul_ps(ef, vamp);
+		__m256 d = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(ex, vxincr), vi), vdfac);
+
+		if (t+8 <= n) {
+			_mm256_storeu_ps(dA+t, ef);
+			_mm256_storeu_ps(y+t, first ? ex : _mm256_add_ps(_mm256_loadu_ps(y+t), ex));
+			_mm256_storeu_ps(dr+t, d);
+		} else {
+			_mm256_storeu_ps(tmp[0], ef);
+			_mm256_storeu_ps(tmp[1], ex);
+			_mm256_storeu_ps(tmp[2], d);
+			for (k=0; t+k<n; k++) {
+				dA[t+k] = tmp[0][k];
+				y[t+k] = first ? tmp[1][k] : y[t+k] + tmp[1][k];
+				dr[t+k] = tmp[2][k];
+			}
+		}
+
+		ev = _mm512_mul_pd(ev, step);
+		vi = _mm256_add_ps(vi, eight);
+	}
+
+	return _mm_cvtsd_f64(_mm512_castpd512_pd128(ev));
+}
+
+typedef double (*ecf_expcol_fn)(double e, double q, float amp, float xincr, float dfac,
+								int first, int i0, int n, float *y, float *dA, float *dr);
+
+static ecf_expcol_fn ecf_expcol_kernel(void)
+{
+	switch (ecf_simd_level()) {
+	case 3: return ecf_expcol_avx512;
+	case 2: return ecf_expcol_avx2;
+	case 1: return ecf_expcol_sse2;
+	default: return NULL;
+	}
+}
+
+/* Sets up q = exp(-rate*xincr) and dfac for each component, exactly as
+   multiexp_lambda_array() and multiexp_tau_array() do.  Returns -1 for
+   the same bad parameters as they do. */
+static int ecf_multiexp_setup(float xincr, float param[], int nparam, int tau,
+							  double q[], float dfac[])
+{
+	int j;
+
+	if (xincr <= 0) return -1;
+
+	for (j=1; j<nparam-1; j+=2) {
+		if (param[j+1] < 0) return -1;
+		if (tau) {
+			q[j] = exp(-xincr / (double) param[j+1]);
+			dfac[j] = 1 / (param[j+1] * param[j+1]);
+		} else {
+			q[j] = exp(-(double) param[j+1] * xincr);
+			dfac[j] = -1.0f;
+		}
+	}
+	return 0;
+}
+
+static int ecf_multiexp_rows(float xincr, float param[], int tau,
+							 float *y, float **dy_dparam, int nx, int nparam)
+{
+	ecf_expcol_fn kernel = ecf_expcol_kernel();
+	double q[MAXFIT], e[MAXFIT];
+	float dfac[MAXFIT];
+	float tile[MAXFIT][ECF_SIMD_TILE];
+	int ncols = 2 * ((nparam - 1) / 2);  /* derivative columns written */
+	int i0, n, i, j;
+
+	if (kernel == NULL || nparam > MAXFIT)
+		return -1;
+	if (ecf_multiexp_setup(xincr, param, nparam, tau, q, dfac) != 0)
+		return -1;
+
+	for (j=1; j<nparam-1; j+=2)
+		e[j] = 1.0;
+
+	for (i0=0; i0<nx; i0+=ECF_SIMD_TILE) {
+		n = (nx - i0 < ECF_SIMD_TILE) ? nx - i0 : ECF_SIMD_TILE;
+
+		if (nparam < 3)
+			for (i=0; i<n; i++)
+				y[i0+i] = 0;
+
+		for (j=1; j<nparam-1; j+=2)
+			e[j] = (*kernel)(e[j], q[j], param[j], xincr, dfac[j], j == 1, i0, n,
+							 y + i0, tile[j], tile[j+1]);
+
+		/* and into the row layout the fitting routines use */
+		for (i=0; i<n; i++)
+			for (j=1; j<=ncols; j++)
+				dy_dparam[i0+i][j] = tile[j][i];
+	}
+
+	return 0;
+}
+
+#else /* ECF_X86_SIMD */
+
+static int ecf_multiexp_rows(float xincr, float param[], int tau,
+							 float *y, float **dy_dparam, int nx, int nparam)
+{
+	(void) xincr; (void) param; (void) tau;
+	(void) y; (void) dy_dparam; (void) nx; (void) nparam;
+	return -1;
+}
+
+#endif /* ECF_X86_SIMD */
+
+/* Vectorised multiexp_lambda_array() and multiexp_tau_array(); same
+   arguments and results.  These return -1 without doing anything if
+   there is no vector unit to use, so the caller should then use the
+   plain C versions. */
+int multiexp_lambda_array_simd(float xincr, float param[],
+							   float *y, float **dy_dparam, int nx, int nparam)
+{
+	return ecf_multiexp_rows(xincr, param, 0, y, dy_dparam, nx, nparam);
+}
+
+int multiexp_tau_array_simd(float xincr, float param[],
+							float *y, float **dy_dparam, int nx, int nparam)
+{
+	return ecf_multiexp_rows(xincr, param, 1, y, dy_dparam, nx, nparam);
+}
+
+
+/********************************************************************
+
+					   STRETCHED EXPONENTIALS
+
+ ********************************************************************/
+
+/* The accuracy mode of the fits in a workspace, and the default given to
+   new workspaces; changing the default does not affect those which
+   already exist, so it is safe while they are fitting */
+static accuracy_type ecf_accuracy = ECF_ACCURACY_LIBM;
+
+void GCI_set_accuracy(accuracy_type accuracy)
+{
+	ecf_accuracy = accuracy;
+}
+
+accuracy_type GCI_get_accuracy(void)
+{
+	return ecf_accuracy;
+}
+
+void GCI_ecf_set_workspace_accuracy(ecf_workspace *ws, accuracy_type accuracy)
+{
+	ws->accuracy = accuracy;
+}
+
+/* The Cephes single precision logf and expf, vectorised below.  log(x)
+   is found from x = m * 2^e with m in [sqrt(1/2), sqrt(2)), and exp(x)
+   from x = n ln(2) + r with |r| <= ln(2)/2; ln(2) is split into a high
+   and a low part so the reduction is exact enough.  exp() saturates to
+   0 or infinity outside +/-88.376, and log() is only good for normal
+   x > 0, which is all that is needed here. */
+
+#define ECF_SQRTHF   0.707106781186547524f
+#define ECF_LOG2E    1.44269504088896341f
+#define ECF_LN2_HI   0.693359375f
+#define ECF_LN2_LO   -2.12194440e-4f
+#define ECF_EXP_MAX  88.3762626647949f
+
+#define ECF_LOG_P0   7.0376836292e-2f
+#define ECF_LOG_P1   -1.1514610310e-1f
+#define ECF_LOG_P2   1.1676998740e-1f
+#define ECF_LOG_P3   -1.2420140846e-1f
+#define ECF_LOG_P4   1.4249322787e-1f
+#define ECF_LOG_P5   -1.6668057665e-1f
+#define ECF_LOG_P6   2.0000714765e-1f
+#define ECF_LOG_P7   -2.4999993993e-1f
+#define ECF_LOG_P8   3.3333331174e-1f
+
+#define ECF_EXP_P0   1.9875691500e-4f
+#define ECF_EXP_P1   1.3981999507e-3f
+#define ECF_EXP_P2   8.3334519073e-3f
+#define ECF_EXP_P3   4.1665795894e-2f
+#define ECF_EXP_P4   1.6666665459e-1f
+#define ECF_EXP_P5   5.0000001201e-1f
+
+/* The stretched exponential kernels do bins i0..i0+n-1 as in
+   stretchedexp_array() (bin 0 comes out as rubbish and the caller
+   replaces it):
+
+      xa  = i * xaincr
+      d1  = exp(-xa^(1/h))
+      y   = amp * d1
+      d2  = y * xa^(1/h) / h / tau
+      d3  = y * xa^(1/h) / h * log(xa) / h
+
+   with a2inv = 1/tau and a3inv = 1/h. */
+
+#ifdef ECF_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+static __m256 ecf_log_avx2(__m256 x)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256i xi = _mm256_castps_si256(x);
+	__m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(xi, 23),
+												   _mm256_set1_epi32(126)));
+	__m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+					_mm256_and_si256(xi, _mm256_set1_epi32(0x007fffff)),
+					_mm256_set1_epi32(0x3f000000)));
+	__m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(ECF_SQRTHF), _CMP_LT_OQ);
+	__m256 z, y;
+
+	/* m < sqrt(1/2): e -= 1, m = 2m - 1; otherwise m = m - 1 */
+	e = _mm256_sub_ps(e, _mm256_and_ps(one, small));
+	m = _mm256_add_ps(_mm256_sub_ps(m, one), _mm256_and_ps(m, small));
+
+	z = _mm256_mul_ps(m, m);
+	y = _mm256_fmadd_ps(_mm256_set1_ps(ECF_LOG_P0), m, _mm256_set1_ps(ECF_LOG_P1));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P2));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P3));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P4));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P5));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P6));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P7));
+	y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(ECF_LOG_P8));
+	y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+	y = _mm256_fmadd_ps(e, _mm256_set1_ps(ECF_LN2_LO), y);
+	y = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, y);
+	return _mm256_fmadd_ps(e, _mm256_set1_ps(ECF_LN2_HI), _mm256_add_ps(m, y));
+}
+
+__attribute__((target("avx2,fma")))
+static __m256 ecf_exp_avx2(__m256 x)
+{
+	__m256 n, z, y;
+	__m256i pow2n;
+
+	x = _mm256_min_ps(x, _mm256_set1_ps(ECF_EXP_MAX));
+	x = _mm256_max_ps(x, _mm256_set1_ps(-ECF_EXP_MAX));
+
+	n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(ECF_LOG2E), _mm256_set1_ps(0.5f)));
+	x = _mm256_fnmadd_ps(n, _mm256_set1_ps(ECF_LN2_HI), x);
+	x = _mm256_fnmadd_ps(n, _mm256_set1_ps(ECF_LN2_LO), x);
+
+	z = _mm256_mul_ps(x, x);
+	y = _mm256_fmadd_ps(_mm256_set1_ps(ECF_EXP_P0), x, _mm256_set1_ps(ECF_EXP_P1));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(ECF_EXP_P2));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(ECF_EXP_P3));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(ECF_EXP_P4));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(ECF_EXP_P5));
+	y = _mm256_add_ps(_mm256_fmadd_ps(y, z, x), _mm256_set1_ps(1.0f));
+
+	pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n),
+											   _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(y, _mm256_castsi256_ps(pow2n));
+}
+
+__attribute__((target("avx2,fma")))
+static void ecf_stretched_avx2(float xaincr, float amp, float a2inv, float a3inv,
+							   int i0, int n, float *y, float *d1, float *d2, float *d3)
+{
+	__m256 vxaincr = _mm256_set1_ps(xaincr), vamp = _mm256_set1_ps(amp);
+	__m256 va2inv = _mm256_set1_ps(a2inv), va3inv = _mm256_set1_ps(a3inv);
+	__m256 vi = _mm256_set_ps((float)(i0+7), (float)(i0+6), (float)(i0+5), (float)(i0+4),
+							  (float)(i0+3), (float)(i0+2), (float)(i0+1), (float) i0);
+	__m256 eight = _mm256_set1_ps(8.0f);
+	__m256 lxa, xah, ex, e1, e2, e3;
+	float tmp[4][8];
+	int t, k;
+
+	for (t=0; t<n; t+=8) {
+		lxa = ecf_log_avx2(_mm256_mul_ps(vi, vxaincr));
+		xah = ecf_exp_avx2(_mm256_mul_ps(lxa, va3inv));
+		e1 = ecf_exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), xah));
+		ex = _mm256_mul_ps(e1, vamp);
+		e3 = _mm256_mul_ps(ex, _mm256_mul_ps(xah, va3inv));
+		e2 = _mm256_mul_ps(e3, va2inv);
+		e3 = _mm256_mul_ps(_mm256_mul_ps(e3, lxa), va3inv);
+
+		if (t+8 <= n) {
+			_mm256_storeu_ps(y+t, ex);
+			_mm256_storeu_ps(d1+t, e1);
+			_mm256_storeu_ps(d2+t, e2);
+			_mm256_storeu_ps(d3+t, e3);
+		} else {
+			_mm256_storeu_ps(tmp[0], ex);
+			_mm256_storeu_ps(tmp[1], e1);
+			_mm256_storeu_ps(tmp[2], e2);
+			_mm256_storeu_ps(tmp[3], e3);
+			for (k=0; t+k<n; k++) {
+				y[t+k] = tmp[0][k];
+				d1[t+k] = tmp[1][k];
+				d2[t+k] = tmp[2][k];
+				d3[t+k] = tmp[3][k];
+			}
+		}
+
+		vi = _mm256_add_ps(vi, eight);
+	}
+}
+
+__attribute__((target("avx512f")))
+static __m512 ecf_log_avx512(__m512 x)
+{
+	const __m512 one = _mm512_set1_ps(1.0f);
+	__m512i xi = _mm512_castps_si512(x);
+	__m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(xi, 23),
+												   _mm512_set1_epi32(126)));
+	__m512 m = _mm512_castsi512_ps(_mm512_or_si512(
+					_mm512_and_si512(xi, _mm512_set1_epi32(0x007fffff)),
+					_mm512_set1_epi32(0x3f000000)));
+	__mmask16 small = _mm512_cmp_ps_mask(m, _mm512_set1_ps(ECF_SQRTHF), _CMP_LT_OQ);
+	__m512 z, y;
+
+	/* m < sqrt(1/2): e -= 1, m = 2m - 1; otherwise m = m - 1 */
+	e = _mm512_mask_sub_ps(e, small, e, one);
+	m = _mm512_mask_add_ps(_mm512_sub_ps(m, one), small, _mm512_sub_ps(m, one), m);
+
+	z = _mm512_mul_ps(m, m);
+	y = _mm512_fmadd_ps(_mm512_set1_ps(ECF_LOG_P0), m, _mm512_set1_ps(ECF_LOG_P1));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P2));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P3));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P4));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P5));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P6));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P7));
+	y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(ECF_LOG_P8));
+	y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+	y = _mm512_fmadd_ps(e, _mm512_set1_ps(ECF_LN2_LO), y);
+	y = _mm512_fnmadd_ps(_mm512_set1_ps(0.5f), z, y);
+	return _mm512_fmadd_ps(e, _mm512_set1_ps(ECF_LN2_HI), _mm512_add_ps(m, y));
+}
+
+__attribute__((target("avx512f")))
+static __m512 ecf_exp_avx512(__m512 x)
+{
+	__m512 n, z, y;
+	__m512i pow2n;
+
+	x = _mm512_min_ps(x, _mm512_set1_ps(ECF_EXP_MAX));
+	x = _mm512_max_ps(x, _mm512_set1_ps(-ECF_EXP_MAX));
+
+	n = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(ECF_LOG2E), _mm512_set1_ps(0.5f)),
+							 _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+	x = _mm512_fnmadd_ps(n, _mm512_set1_ps(ECF_LN2_HI), x);
+	x = _mm512_fnmadd_ps(n, _mm512_set1_ps(ECF_LN2_LO), x);
+
+	z = _mm512_mul_ps(x, x);
+	y = _mm512_fmadd_ps(_mm512_set1_ps(ECF_EXP_P0), x, _mm512_set1_ps(ECF_EXP_P1));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(ECF_EXP_P2));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(ECF_EXP_P3));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(ECF_EXP_P4));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(ECF_EXP_P5));
+	y = _mm512_add_ps(_mm512_fmadd_ps(y, z, x), _mm512_set1_ps(1.0f));
+
+	pow2n = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(n),
+											   _mm512_set1_epi32(127)), 23);
+	return _mm512_mul_ps(y, _mm512_castsi512_ps(pow2n));
+}
+
+__attribute__((target("avx512f")))
+static void ecf_stretched_avx512(float xaincr, float amp, float a2inv, float a3inv,
+								 int i0, int n, float *y, float *d1, float *d2, float *d3)
+{
+	__m512 vxaincr = _mm512_set1_ps(xaincr), vamp = _mm512_set1_ps(amp);
+	__m512 va2inv = _mm512_set1_ps(a2inv), va3inv = _mm512_set1_ps(a3inv);
+	__m512 vi = _mm512_add_ps(_mm512_set1_ps((float) i0),
+							  _mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8,
+											7, 6, 5, 4, 3, 2, 1, 0));
+	__m512 sixteen = _mm512_set1_ps(16.0f);
+	__m512 lxa, xah, ex, e1, e2, e3;
+	__mmask16 mask;
+	int t;
+
+	for (t=0; t<n; t+=16) {
+		lxa = ecf_log_avx512(_mm512_mul_ps(vi, vxaincr));
+		xah = ecf_exp_avx512(_mm512_mul_ps(lxa, va3inv));
+		e1 = ecf_exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), xah));
+		ex = _mm512_mul_ps(e1, vamp);
+		e3 = _mm512_mul_ps(ex, _mm512_mul_ps(xah, va3inv));
+		e2 = _mm512_mul_ps(e3, va2inv);
+		e3 = _mm512_mul_ps(_mm512_mul_ps(e3, lxa), va3inv);
+
+		mask = (t+16 <= n) ? (__mmask16) 0xffff : (__mmask16) ((1u << (n-t)) - 1);
+		_mm512_mask_storeu_ps(y+t, mask, ex);
+		_mm512_mask_storeu_ps(d1+t, mask, e1);
+		_mm512_mask_storeu_ps(d2+t, mask, e2);
+		_mm512_mask_storeu_ps(d3+t, mask, e3);
+
+		vi = _mm512_add_ps(vi, sixteen);
+	}
+}
+
+#endif /* ECF_X86_SIMD */
+
+typedef void (*ecf_stretched_fn)(float xaincr, float amp, float a2inv, float a3inv,
+								 int i0, int n, float *y, float *d1, float *d2, float *d3);
+
+/* stretchedexp_array() with the polynomial log and exp; same arguments
+   and results to within the accuracy of those.  This returns -1 without
+   doing anything if there is no AVX2 or AVX-512 (a scalar polynomial is
+   no faster than the C library), or if tau is not positive or h is
+   zero, so the caller should then use the C library versions. */
+int stretchedexp_array_fast(float xincr, float param[],
+							float *y, float **dy_dparam, int nx, int nparam)
+{
+	ecf_stretched_fn kernel = NULL;
+	float tile[3][ECF_SIMD_TILE];
+	float xaincr, a2inv, a3inv;
+	int i0, n, i;
+
+	(void) nparam;  /* always 4, as for stretchedexp_array() */
+
+#ifdef ECF_X86_SIMD
+	if (ecf_simd_level() == 3)
+		kernel = ecf_stretched_avx512;
+	else if (ecf_simd_level() == 2)
+		kernel = ecf_stretched_avx2;
+#endif
+
+	if (kernel == NULL || xincr <= 0 || param[2] <= 0 || param[3] == 0)
+		return -1;
+
+	xaincr = xincr / param[2];
+	a2inv = 1/param[2];
+	a3inv = 1/param[3];
+
+	for (i0=0; i0<nx; i0+=ECF_SIMD_TILE) {
+		n = (nx - i0 < ECF_SIMD_TILE) ? nx - i0 : ECF_SIMD_TILE;
+		(*kernel)(xaincr, param[1], a2inv, a3inv, i0, n,
+				  y + i0, tile[0], tile[1], tile[2]);
+		for (i=0; i<n; i++) {
+			dy_dparam[i0+i][1] = tile[0][i];
+			dy_dparam[i0+i][2] = tile[1][i];
+			dy_dparam[i0+i][3] = tile[2][i];
+		}
+	}
+
+	/* When x=0; the kernels don't know about this */
+	if (nx > 0) {
+		y[0] = param[1];
+		dy_dparam[0][1] = 1;
+		dy_dparam[0][2] = dy_dparam[0][3] = 0;
+	}
+
+	return 0;
+}
+
+
+/********************************************************************
+
+						  PHASOR SUMS
+
+ ********************************************************************/
+
+/* The kernels work out sum y[i], sum y[i]*c[i] and sum y[i]*s[i] over
+   i = 0..n-1 for the phasors of EcfPhasor.c.  The bins are widened to
+   double as they are loaded and every lane sums in double, as the C
+   version does, so the phasors do not depend on the instruction set
+   even for long transients with many counts. */
+
+#ifdef ECF_X86_SIMD
+
+typedef void (*ecf_phasor_fn)(const float *y, const float *c, const float *s,
+							  int n, double sums[3]);
+
+__attribute__((target("sse2")))
+static void ecf_phasor_sse2(const float *y, const float *c, const float *s,
+							int n, double sums[3])
+{
+	__m128d vy = _mm_setzero_pd(), vc = _mm_setzero_pd(), vs = _mm_setzero_pd();
+	__m128 yf, cf, sf;
+	__m128d yi;
+	double tmp[3][2];
+	int i, k;
+
+	for (i=0; i+4<=n; i+=4) {
+		yf = _mm_loadu_ps(y+i);
+		cf = _mm_loadu_ps(c+i);
+		sf = _mm_loadu_ps(s+i);
+		yi = _mm_cvtps_pd(yf);
+		vy = _mm_add_pd(vy, yi);
+		vc = _mm_add_pd(vc, _mm_mul_pd(yi, _mm_cvtps_pd(cf)));
+		vs = _mm_add_pd(vs, _mm_mul_pd(yi, _mm_cvtps_pd(sf)));
+		yi = _mm_cvtps_pd(_mm_movehl_ps(yf, yf));
+		vy = _mm_add_pd(vy, yi);
+		vc = _mm_add_pd(vc, _mm_mul_pd(yi, _mm_cvtps_pd(_mm_movehl_ps(cf, cf))));
+		vs = _mm_add_pd(vs, _mm_mul_pd(yi, _mm_cvtps_pd(_mm_movehl_ps(sf, sf))));
+	}
+	_mm_storeu_pd(tmp[0], vy);
+	_mm_storeu_pd(tmp[1], vc);
+	_mm_storeu_pd(tmp[2], vs);
+
+	sums[0] = sums[1] = sums[2] = 0;
+	for (k=0; k<2; k++) {
+		sums[0] += tmp[0][k];
+		sums[1] += tmp[1][k];
+		sums[2] += tmp[2][k];
+	}
+	for (; i<n; i++) {
+		sums[0] += y[i];
+		sums[1] += (double) y[i] * c[i];
+		sums[2] += (double) y[i] * s[i];
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void ecf_phasor_avx2(const float *y, const float *c, const float *s,
+							int n, double sums[3])
+{
+	__m256d vy = _mm256_setzero_pd(), vc = _mm256_setzero_pd(), vs = _mm256_setzero_pd();
+	__m256d yi;
+	double tmp[3][4];
+	int i, k;
+
+	for (i=0; i+4<=n; i+=4) {
+		yi = _mm256_cvtps_pd(_mm_loadu_ps(y+i));
+		vy = _mm256_add_pd(vy, yi);
+		vc = _mm256_fmadd_pd(yi, _mm256_cvtps_pd(_mm_loadu_ps(c+i)), vc);
+		vs = _mm256_fmadd_pd(yi, _mm256_cvtps_pd(_mm_loadu_ps(s+i)), vs);
+	}
+	_mm256_storeu_pd(tmp[0], vy);
+	_mm256_storeu_pd(tmp[1], vc);
+	_mm256_storeu_pd(tmp[2], vs);
+
+	sums[0] = sums[1] = sums[2] = 0;
+	for (k=0; k<4; k++) {
+		sums[0] += tmp[0][k];
+		sums[1] += tmp[1][k];
+		sums[2] += tmp[2][k];
+	}
+	for (; i<n; i++) {
+		sums[0] += y[i];
+		sums[1] += (double) y[i] * c[i];
+		sums[2] += (double) y[i] * s[i];
+	}
+}
+
+__attribute__((target("avx512f")))
+static void ecf_phasor_avx512(const float *y, const float *c, const float *s,
+							  int n, double sums[3])
+{
+	__m512d vy = _mm512_setzero_pd(), vc = _mm512_setzero_pd(), vs = _mm512_setzero_pd();
+	__m512d yi;
+	double tmp[3][8];
+	int i, k;
+
+	for (i=0; i+8<=n; i+=8) {
+		yi = _mm512_cvtps_pd(_mm256_loadu_ps(y+i));
+		vy = _mm512_add_pd(vy, yi);
+		vc = _mm512_fmadd_pd(yi, _mm512_cvtps_pd(_mm256_loadu_ps(c+i)), vc);
+		vs = _mm512_fmadd_pd(yi, _mm512_cvtps_pd(_mm256_loadu_ps(s+i)), vs);
+	}
+	_mm512_storeu_pd(tmp[0], vy);
+	_mm512_storeu_pd(tmp[1], vc);
+	_mm512_storeu_pd(tmp[2], vs);
+
+	sums[0] = sums[1] = sums[2] = 0;
+	for (k=0; k<8; k++) {
+		sums[0] += tmp[0][k];
+		sums[1] += tmp[1][k];
+		sums[2] += tmp[2][k];
+	}
+	for (; i<n; i++) {
+		sums[0] += y[i];
+		sums[1] += (double) y[i] * c[i];
+		sums[2] += (double) y[i] * s[i];
+	}
+}
+
+#endif /* ECF_X86_SIMD */
+
+/* The three phasor sums of y[0..n-1] against the tables c[] and s[].
+   This returns -1 without doing anything if there is no vector unit to
+   use, so the caller should then sum in C. */
+int ecf_phasor_sums_simd(const float *y, const float *c, const float *s,
+						 int n, double sums[3])
+{
+#ifdef ECF_X86_SIMD
+	ecf_phasor_fn kernel;
+
+	switch (ecf_simd_level()) {
+	case 3: kernel = ecf_phasor_avx512; break;
+	case 2: kernel = ecf_phasor_avx2; break;
+	case 1: kernel = ecf_phasor_sse2; break;
+	default: return -1;
+	}
+
+	(*kernel)(y, c, s, n, sums);
+	return 0;
+#else
+	(void) y; (void) c; (void) s; (void) n; (void) sums;
+	return -1;
+#endif
+}
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
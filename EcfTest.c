@@ -0,0 +1,796 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* EcfTest.c: checks of the fitting library, run by CTest.
+
+   Each test fits decays worked out exactly from the model, convolved
+   with a Gaussian prompt, so that a fit which converges must find the
+   parameters they were made with.  Some also check the library's
+   internal functions (EcfInternal.h) against plain sums.
+
+   Usage: EcfTest [TEST...]
+   runs the named tests, or all of them; the exit status is the number
+   of tests which failed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TEST_NBINS 256
+#define TEST_NPROMPT 32
+
+static const float test_xincr = 10.0f / TEST_NBINS;
+
+static int test_check(int ok, const char *what)
+{
+	if (!ok)
+		printf("  failed: %s\n", what);
+	return ok ? 0 : 1;
+}
+
+/* A Gaussian prompt normalised to 1, peaking at bin 10 */
+static void test_make_prompt(float prompt[TEST_NPROMPT])
+{
+	double sum = 0.0;
+	int i;
+
+	for (i=0; i<TEST_NPROMPT; i++) {
+		prompt[i] = (float) exp(-0.5 * pow((i - 10) * test_xincr / 0.08, 2));
+		sum += prompt[i];
+	}
+	for (i=0; i<TEST_NPROMPT; i++)
+		prompt[i] /= (float) sum;
+}
+
+/* Z plus the sum of A exp(-x/tau) over the ncomp components in
+   param[1..2*ncomp], convolved with the prompt as in the fits */
+static void test_make_decay(const float prompt[TEST_NPROMPT], const float param[],
+							int ncomp, float y[TEST_NBINS])
+{
+	int i, j, k;
+	double v;
+
+	for (i=0; i<TEST_NBINS; i++) {
+		v = 0.0;
+		for (j=0; j<TEST_NPROMPT && j<=i; j++)
+			for (k=0; k<ncomp; k++)
+				v += prompt[j] * param[2*k+1] * exp(-(i-j) * test_xincr / param[2*k+2]);
+		y[i] = (float) (param[0] + v);
+	}
+}
+
+
+/********************************************************************
+
+						 LOOKUP TABLE FITS
+
+ ********************************************************************/
+
+#define TEST_LUT_NTRANS 4
+
+/* GCI_ecf_lut_batch(), with and without polishing under each noise
+   model; the polishing fits have no sig[], so must refuse NOISE_CONST
+   and NOISE_GIVEN.  The prompt is normalised to 1 and then not, as the
+   background is not convolved with it and must come out the same
+   either way */
+static int test_lut_polish(void)
+{
+	static const float taus[TEST_LUT_NTRANS] = { 0.5f, 1.0f, 2.0f, 4.0f };
+	static const float scales[2] = { 1.0f, 35.45f };
+	float prompt[TEST_NPROMPT], trans[TEST_LUT_NTRANS*TEST_NBINS], param[3];
+	float Z[TEST_LUT_NTRANS], A[TEST_LUT_NTRANS], tau[TEST_LUT_NTRANS];
+	float chisq[TEST_LUT_NTRANS];
+	ecf_lut *lut;
+	noise_type noise;
+	int i, s, t, ret, polish, failed = 0;
+	char what[100];
+
+	for (s=0; s<2; s++) {
+		test_make_prompt(prompt);
+		for (i=0; i<TEST_NPROMPT; i++)
+			prompt[i] *= scales[s];
+		for (t=0; t<TEST_LUT_NTRANS; t++) {
+			param[0] = 3.0f;
+			param[1] = 2000.0f;
+			param[2] = taus[t];
+			test_make_decay(prompt, param, 1, trans + t*TEST_NBINS);
+		}
+
+		lut = GCI_ecf_lut(test_xincr, 30, TEST_NBINS, prompt, TEST_NPROMPT, 0.05f, 20.0f, 1024);
+		if (test_check(lut != NULL, "GCI_ecf_lut")) {
+			failed++;
+			continue;
+		}
+
+		for (polish=0; polish<2; polish++) {
+			for (noise=NOISE_CONST; noise<=NOISE_MLE; noise++) {
+				if (!polish && noise != NOISE_CONST)
+					continue;  /* the noise model is only used to polish */
+				for (t=0; t<TEST_LUT_NTRANS; t++)
+					Z[t] = A[t] = tau[t] = chisq[t] = -1.0f;
+				ret = GCI_ecf_lut_batch(lut, trans, TEST_NBINS, TEST_LUT_NTRANS,
+										polish, noise, 1e-4f, Z, A, tau, chisq, 0);
+
+				if (polish && (noise == NOISE_CONST || noise == NOISE_GIVEN)) {
+					sprintf(what, "polish with noise %d returned %d, not -1", noise, ret);
+					failed += test_check(ret == -1, what);
+					continue;
+				}
+				sprintf(what, "prompt %g polish %d noise %d returned %d",
+						scales[s], polish, noise, ret);
+				failed += test_check(ret == 0, what);
+				for (t=0; t<TEST_LUT_NTRANS; t++) {
+					sprintf(what, "prompt %g polish %d noise %d: tau %g, not %g",
+							scales[s], polish, noise, tau[t], taus[t]);
+					failed += test_check(fabs(tau[t] / taus[t] - 1) < 1e-3, what);
+					/* The table's error in Z is in proportion to the counts;
+					   the bug this guards against divided Z by the scale */
+					sprintf(what, "prompt %g polish %d noise %d: Z %g A %g, not 3 2000",
+							scales[s], polish, noise, Z[t], A[t]);
+					failed += test_check(fabs(Z[t] - 3) < 0.05 * scales[s] &&
+										 fabs(A[t] / 2000 - 1) < 1e-3, what);
+					/* With NOISE_MLE an exact fit's chisq of 0 is reported as 1e38 */
+					if (polish && noise != NOISE_MLE) {
+						sprintf(what, "polish noise %d: chisq %g", noise, chisq[t]);
+						failed += test_check(chisq[t] >= 0 && chisq[t] < 1e-2, what);
+					}
+				}
+			}
+		}
+
+		GCI_ecf_free_lut(lut);
+	}
+
+	return failed;
+}
+
+
+/********************************************************************
+
+						   CONVOLUTION
+
+ ********************************************************************/
+
+#define TEST_LONG_NPROMPT 200
+
+/* The largest difference between the columns 0..ncols-1 of the
+   convolution of f (column 0) and df (columns 1..) with the prompt, as
+   the fits do it, and the plain sum in double, relative to the largest
+   value of each column */
+static double test_conv_error(const float prompt[], int nprompt,
+							  const float f[], float **df,
+							  const float y[], float **dy, int ncols)
+{
+	double sum, big, err, worst = 0.0;
+	int i, j, k;
+
+	for (k=0; k<ncols; k++) {
+		big = err = 0.0;
+		for (i=0; i<TEST_NBINS; i++) {
+			sum = 0.0;
+			for (j=0; j<nprompt && j<=i; j++)
+				sum += prompt[j] * (double) ((k == 0) ? f[i-j] : df[i-j][k]);
+			if (fabs(sum) > big)
+				big = fabs(sum);
+			err = fmax(err, fabs(((k == 0) ? y[i] : dy[i][k]) - sum));
+		}
+		if (big > 0 && err / big > worst)
+			worst = err / big;
+	}
+	return worst;
+}
+
+/* The FFT convolution of a stretched exponential and its derivatives
+   with a prompt long enough that the fits use it, twice in the same
+   workspace with different prompts so that the cached spectrum must be
+   replaced, and the recursive convolution of a multiexponential, must
+   agree with the direct sums */
+static int test_fft_convolution(void)
+{
+	float prompt[TEST_LONG_NPROMPT], f[TEST_NBINS], y[TEST_NBINS];
+	float stretched[4] = { 0.0f, 1000.0f, 1.5f, 1.3f };
+	float multi[5] = { 0.0f, 1000.0f, 2.5f, 500.0f, 0.5f };
+	float **df, **dy;
+	ecf_workspace *ws;
+	double err;
+	int i, pass, ret, failed = 0;
+	char what[100];
+
+	sprintf(what, "prompt of %d bins is not convolved by FFT", TEST_LONG_NPROMPT);
+	if (test_check(TEST_LONG_NPROMPT * TEST_NBINS > ECF_FFT_THRESHOLD, what))
+		return 1;
+
+	df = GCI_ecf_matrix(TEST_NBINS, 5);
+	dy = GCI_ecf_matrix(TEST_NBINS, 5);
+	ws = GCI_ecf_workspace(TEST_NBINS, 5);
+	if (test_check(df != NULL && dy != NULL && ws != NULL, "out of memory")) {
+		GCI_ecf_free_matrix(df);
+		GCI_ecf_free_matrix(dy);
+		GCI_ecf_free_workspace(ws);
+		return 1;
+	}
+
+	for (i=0; i<TEST_NBINS; i++)
+		GCI_stretchedexp(i * test_xincr, stretched, &f[i], df[i], 4);
+
+	for (pass=0; pass<2; pass++) {
+		/* A broad, unnormalised prompt, then one with a long tail */
+		for (i=0; i<TEST_LONG_NPROMPT; i++)
+			prompt[i] = (pass == 0) ?
+				(float) (3.0 * exp(-0.5 * pow((i - 60) / 25.0, 2))) :
+				(float) (exp(-i / 40.0) + 0.01);
+
+		ret = ecf_fft_convolve(ws, prompt, TEST_LONG_NPROMPT, f, df, y, dy, TEST_NBINS, 4);
+		sprintf(what, "prompt %d: ecf_fft_convolve() returned %d", pass, ret);
+		if (test_check(ret == 0, what)) {
+			failed++;
+			continue;
+		}
+		err = test_conv_error(prompt, TEST_LONG_NPROMPT, f, df, y, dy, 4);
+		sprintf(what, "prompt %d: FFT convolution is out by %g", pass, err);
+		failed += test_check(err < 1e-5, what);
+	}
+
+	/* The multiexponentials are convolved as they are evaluated */
+	for (i=0; i<TEST_NBINS; i++)
+		GCI_multiexp_tau(i * test_xincr, multi, &f[i], df[i], 5);
+	ret = multiexp_tau_array_instr(test_xincr, multi, prompt, TEST_LONG_NPROMPT,
+								   y, dy, TEST_NBINS, 5);
+	sprintf(what, "multiexp_tau_array_instr() returned %d", ret);
+	if (!test_check(ret == 0, what)) {
+		err = test_conv_error(prompt, TEST_LONG_NPROMPT, f, df, y, dy, 5);
+		sprintf(what, "recursive convolution is out by %g", err);
+		failed += test_check(err < 1e-5, what);
+	}
+	else
+		failed++;
+
+	GCI_ecf_free_matrix(df);
+	GCI_ecf_free_matrix(dy);
+	GCI_ecf_free_workspace(ws);
+	return failed;
+}
+
+
+/********************************************************************
+
+						   IMAGE BINNING
+
+ ********************************************************************/
+
+#define TEST_BIN_ROWS 7
+#define TEST_BIN_COLS 11
+#define TEST_BIN_NDATA 5
+#define TEST_BIN_SIZE (TEST_BIN_ROWS * TEST_BIN_COLS * TEST_BIN_NDATA)
+
+/* GCI_ecf_bin_image() against summing the pixels of each bin one by
+   one, for square and circular bins of radii from 0 to beyond the size
+   of the image, so that the bins are cut off at every edge and the ring
+   of table columns wraps around many times.  The counts are whole
+   numbers, so the sums must be exact. */
+static int test_bin_image(void)
+{
+	float trans[TEST_BIN_SIZE], binned[TEST_BIN_SIZE];
+	ecf_bin_shape shape;
+	double sum;
+	int radius, r, c, rr, cc, k, ret, nbad, failed = 0;
+	char what[100];
+
+	for (c=0; c<TEST_BIN_COLS; c++)
+		for (r=0; r<TEST_BIN_ROWS; r++)
+			for (k=0; k<TEST_BIN_NDATA; k++)
+				trans[(r + c*TEST_BIN_ROWS)*TEST_BIN_NDATA + k] =
+					(float) ((37*r + 101*c + 13*k*k) % 97);
+
+	for (shape=ECF_BIN_SQUARE; shape<=ECF_BIN_CIRCLE; shape++) {
+		for (radius=0; radius<=TEST_BIN_COLS; radius++) {
+			ret = GCI_ecf_bin_image(trans, TEST_BIN_NDATA, TEST_BIN_ROWS, TEST_BIN_COLS,
+									radius, shape, binned);
+			sprintf(what, "shape %d radius %d returned %d", shape, radius, ret);
+			if (test_check(ret == 0, what)) {
+				failed++;
+				continue;
+			}
+
+			nbad = 0;
+			for (c=0; c<TEST_BIN_COLS; c++)
+				for (r=0; r<TEST_BIN_ROWS; r++)
+					for (k=0; k<TEST_BIN_NDATA; k++) {
+						sum = 0.0;
+						for (cc=c-radius; cc<=c+radius; cc++)
+							for (rr=r-radius; rr<=r+radius; rr++)
+								if (cc >= 0 && cc < TEST_BIN_COLS &&
+									rr >= 0 && rr < TEST_BIN_ROWS &&
+									(shape == ECF_BIN_SQUARE ||
+									 (rr-r)*(rr-r) + (cc-c)*(cc-c) <= radius*radius))
+									sum += trans[(rr + cc*TEST_BIN_ROWS)*TEST_BIN_NDATA + k];
+						if (binned[(r + c*TEST_BIN_ROWS)*TEST_BIN_NDATA + k] != sum)
+							nbad++;
+					}
+			sprintf(what, "shape %d radius %d: %d sums wrong", shape, radius, nbad);
+			failed += test_check(nbad == 0, what);
+		}
+	}
+
+	return failed;
+}
+
+
+/********************************************************************
+
+							 PHASORS
+
+ ********************************************************************/
+
+#define TEST_PHASOR_NTAU 3
+
+/* The phasors of single exponentials over one period of TEST_NBINS
+   bins.  Summed over the bins, A q^i with q = exp(-xincr/tau) has the
+   phasor (1 - q) / (1 - q exp(i theta)), theta = 2 pi harmonic / TEST_NBINS,
+   which tends to the semicircle as the bins get finer.  A periodic decay
+   convolved (around the period) with a prompt has the same phasor once
+   divided by the prompt's, and a background Z given to GCI_phasor() is
+   taken off first.  GCI_phasor_batch() must give the same. */
+static int test_phasor(void)
+{
+	static const float taus[TEST_PHASOR_NTAU] = { 0.5f, 2.0f, 5.0f };
+	float prompt[TEST_NPROMPT], trans[TEST_PHASOR_NTAU*TEST_NBINS];
+	float g, s, taup, taum, gb[TEST_PHASOR_NTAU], sb[TEST_PHASOR_NTAU];
+	double q, theta, dr, di, m2, ge, se, v;
+	int withprompt, harmonic, t, i, j, ret, failed = 0;
+	float Z;
+	char what[120];
+
+	test_make_prompt(prompt);
+	for (withprompt=0; withprompt<2; withprompt++) {
+		Z = withprompt ? 5.0f : 0.0f;
+		for (t=0; t<TEST_PHASOR_NTAU; t++) {
+			q = exp(-test_xincr / taus[t]);
+			for (i=0; i<TEST_NBINS; i++) {
+				if (withprompt) {
+					v = 0.0;
+					for (j=0; j<TEST_NPROMPT; j++)
+						v += prompt[j] * pow(q, (i - j + TEST_NBINS) % TEST_NBINS) /
+							(1 - pow(q, TEST_NBINS));
+				}
+				else
+					v = pow(q, i);
+				trans[t*TEST_NBINS+i] = (float) (Z + 1000.0 * v);
+			}
+		}
+
+		for (harmonic=1; harmonic<=2; harmonic++) {
+			ret = GCI_phasor_batch(test_xincr, trans, TEST_NBINS, TEST_PHASOR_NTAU,
+								   0, TEST_NBINS, withprompt ? prompt : NULL,
+								   withprompt ? TEST_NPROMPT : 0, Z, 0.0f, harmonic,
+								   gb, sb, NULL, NULL, NULL, 0);
+			sprintf(what, "prompt %d harmonic %d: GCI_phasor_batch() returned %d",
+					withprompt, harmonic, ret);
+			failed += test_check(ret == 0, what);
+
+			for (t=0; t<TEST_PHASOR_NTAU; t++) {
+				ret = GCI_phasor(test_xincr, trans + t*TEST_NBINS, 0, TEST_NBINS,
+								 withprompt ? prompt : NULL, withprompt ? TEST_NPROMPT : 0,
+								 Z, 0.0f, harmonic, &g, &s, &taup, &taum);
+				sprintf(what, "prompt %d harmonic %d tau %g: GCI_phasor() returned %d",
+						withprompt, harmonic, taus[t], ret);
+				if (test_check(ret == 0, what)) {
+					failed++;
+					continue;
+				}
+
+				q = exp(-test_xincr / taus[t]);
+				theta = 2 * M_PI * harmonic / TEST_NBINS;
+				dr = 1 - q * cos(theta);
+				di = -q * sin(theta);
+				m2 = dr*dr + di*di;
+				ge = (1 - q) * dr / m2;
+				se = -(1 - q) * di / m2;
+
+				sprintf(what, "prompt %d harmonic %d tau %g: (g, s) = (%g, %g), not (%g, %g)",
+						withprompt, harmonic, taus[t], g, s, ge, se);
+				failed += test_check(fabs(g - ge) < 1e-5 && fabs(s - se) < 1e-5, what);
+				sprintf(what, "prompt %d harmonic %d tau %g: batch (%g, %g), not (%g, %g)",
+						withprompt, harmonic, taus[t], gb[t], sb[t], g, s);
+				failed += test_check(gb[t] == g && sb[t] == s, what);
+			}
+		}
+	}
+
+	return failed;
+}
+
+
+/********************************************************************
+
+						  GLOBAL ANALYSIS
+
+ ********************************************************************/
+
+#define TEST_GLOBAL_MAXTRANS 4
+
+/* Both global fitters on noise-free biexponential decays with lifetimes
+   2.5 and 0.5, from 3.5 and 0.8, must converge as GCI_marquardt_instr()
+   does from there; rejected steps once stopped them well short */
+static int test_global_convergence(void)
+{
+	float prompt[TEST_NPROMPT], truth[5];
+	float trans_data[TEST_GLOBAL_MAXTRANS][TEST_NBINS];
+	float param_data[TEST_GLOBAL_MAXTRANS][5];
+	float fitted_data[TEST_GLOBAL_MAXTRANS][TEST_NBINS];
+	float residuals_data[TEST_GLOBAL_MAXTRANS][TEST_NBINS];
+	float *trans[TEST_GLOBAL_MAXTRANS], *param[TEST_GLOBAL_MAXTRANS];
+	float *fitted[TEST_GLOBAL_MAXTRANS], *residuals[TEST_GLOBAL_MAXTRANS];
+	float chisq_trans[TEST_GLOBAL_MAXTRANS], chisq, **covar, **alpha;
+	int paramfree[5] = { 1, 1, 1, 1, 1 }, gparam[5] = { 0, 0, 1, 0, 1 };
+	int ntrans, t, fitter, ret, df, failed = 0;
+	char what[120];
+
+	test_make_prompt(prompt);
+	for (t=0; t<TEST_GLOBAL_MAXTRANS; t++) {
+		truth[0] = 2.0f;
+		truth[1] = 1000.0f + 100.0f * t;
+		truth[2] = 2.5f;
+		truth[3] = 500.0f + 50.0f * t;
+		truth[4] = 0.5f;
+		test_make_decay(prompt, truth, 2, trans_data[t]);
+		trans[t] = trans_data[t];
+		param[t] = param_data[t];
+		fitted[t] = fitted_data[t];
+		residuals[t] = residuals_data[t];
+	}
+
+	covar = GCI_ecf_matrix(5, 5);
+	alpha = GCI_ecf_matrix(5, 5);
+	if (test_check(covar != NULL && alpha != NULL, "GCI_ecf_matrix"))
+		return 1;
+
+	for (ntrans=1; ntrans<=TEST_GLOBAL_MAXTRANS; ntrans+=TEST_GLOBAL_MAXTRANS-1) {
+		for (fitter=0; fitter<3; fitter++) {
+			for (t=0; t<ntrans; t++) {
+				param[t][0] = 2.0f;
+				param[t][1] = 1000.0f;
+				param[t][2] = 3.5f;
+				param[t][3] = 500.0f;
+				param[t][4] = 0.8f;
+			}
+			if (fitter == 0)
+				ret = GCI_marquardt_global_exps_instr(test_xincr, trans, TEST_NBINS, ntrans,
+							15, 250, prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+							FIT_GLOBAL_MULTIEXP, param, paramfree, 5,
+							ECF_RESTRAIN_DEFAULT, 0.01f, fitted, residuals,
+							chisq_trans, &chisq, &df, 0);
+			else if (fitter == 1)
+				ret = GCI_marquardt_global_generic_instr(test_xincr, trans, TEST_NBINS, ntrans,
+							15, 250, prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+							param, paramfree, 5, gparam,
+							ECF_RESTRAIN_DEFAULT, 0.01f, GCI_multiexp_tau,
+							fitted, residuals, chisq_trans, &chisq, &df);
+			else if (ntrans == 1)  /* the single fit it should agree with */
+				ret = GCI_marquardt_instr(test_xincr, trans[0], TEST_NBINS, 15, 250,
+							prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+							param[0], paramfree, 5, ECF_RESTRAIN_DEFAULT,
+							GCI_multiexp_tau, fitted[0], residuals[0],
+							covar, alpha, &chisq, 0.01f, 0.0f, NULL);
+			else
+				continue;
+
+			sprintf(what, "fitter %d, %d transients: returned %d", fitter, ntrans, ret);
+			failed += test_check(ret >= 0, what);
+			sprintf(what, "fitter %d, %d transients: taus %g %g chisq %g, not 2.5 0.5 0",
+					fitter, ntrans, param[0][2], param[0][4], chisq);
+			failed += test_check(fabs(param[0][2] / 2.5 - 1) < 1e-3 &&
+								 fabs(param[0][4] / 0.5 - 1) < 1e-3 &&
+								 chisq < 1e-3 * ntrans, what);
+		}
+	}
+
+	GCI_ecf_free_matrix(covar);
+	GCI_ecf_free_matrix(alpha);
+	return failed;
+}
+
+
+/* The restraints of ECF_RESTRAIN_USER attached to the workspace given to
+   the global fitters must hold: with the second lifetime kept to 0.6..1
+   it must end at 0.6, while the default restraints let it find 0.5 */
+static int test_global_restraint(void)
+{
+	float prompt[TEST_NPROMPT], truth[5];
+	float trans_data[2][TEST_NBINS], param_data[2][5];
+	float *trans[2], *param[2];
+	float minval[5] = { 0, 0, 0, 0, 0.6f }, maxval[5] = { 0, 0, 0, 0, 1.0f };
+	int restrain[5] = { 0, 0, 0, 0, 1 };
+	int paramfree[5] = { 1, 1, 1, 1, 1 }, gparam[5] = { 0, 0, 1, 0, 1 };
+	ecf_restraint *restraint;
+	ecf_workspace *ws;
+	restrain_type rtype;
+	float chisq;
+	int t, fitter, ret, df, failed = 0;
+	char what[120];
+
+	test_make_prompt(prompt);
+	for (t=0; t<2; t++) {
+		truth[0] = 2.0f;
+		truth[1] = 1000.0f + 100.0f * t;
+		truth[2] = 2.5f;
+		truth[3] = 500.0f + 50.0f * t;
+		truth[4] = 0.5f;
+		test_make_decay(prompt, truth, 2, trans_data[t]);
+		trans[t] = trans_data[t];
+		param[t] = param_data[t];
+	}
+
+	restraint = GCI_ecf_restraint(5, restrain, minval, maxval);
+	ws = GCI_ecf_workspace(TEST_NBINS, 5);
+	if (test_check(restraint != NULL && ws != NULL, "GCI_ecf_restraint"))
+		return 1;
+
+	for (fitter=0; fitter<4; fitter++) {
+		/* fitters 0 and 1 have the restraint, 2 and 3 do not */
+		GCI_ecf_set_workspace_restraint(ws, (fitter < 2) ? restraint : NULL);
+		rtype = (fitter < 2) ? ECF_RESTRAIN_USER : ECF_RESTRAIN_DEFAULT;
+		for (t=0; t<2; t++) {
+			param[t][0] = 2.0f;
+			param[t][1] = 1000.0f;
+			param[t][2] = 2.0f;
+			param[t][3] = 500.0f;
+			param[t][4] = 0.8f;
+		}
+		if (fitter % 2 == 0)
+			ret = GCI_marquardt_global_exps_instr_ws(ws, test_xincr, trans, TEST_NBINS, 2,
+						15, 250, prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+						FIT_GLOBAL_MULTIEXP, param, paramfree, 5,
+						rtype, 0.01f, NULL, NULL, NULL, &chisq, &df, 0);
+		else
+			ret = GCI_marquardt_global_generic_instr_ws(ws, test_xincr, trans, TEST_NBINS, 2,
+						15, 250, prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+						param, paramfree, 5, gparam, rtype, 0.01f,
+						GCI_multiexp_tau, NULL, NULL, NULL, &chisq, &df);
+
+		sprintf(what, "fitter %d returned %d", fitter, ret);
+		failed += test_check(ret >= 0, what);
+		sprintf(what, "fitter %d: tau2 %g, not %g", fitter, param[1][4],
+				(fitter < 2) ? 0.6 : 0.5);
+		failed += test_check(fabs(param[1][4] - ((fitter < 2) ? 0.6 : 0.5)) < 1e-3, what);
+	}
+
+	GCI_ecf_free_workspace(ws);
+	GCI_ecf_free_restraint(restraint);
+	return failed;
+}
+
+
+/********************************************************************
+
+						   PYRAMID FITS
+
+ ********************************************************************/
+
+#define TEST_PYRAMID_ROWS 5
+#define TEST_PYRAMID_COLS 3
+#define TEST_PYRAMID_NPIX (TEST_PYRAMID_ROWS * TEST_PYRAMID_COLS)
+
+/* GCI_marquardt_fitting_engine_pyramid() with Z, and then tau, fixed at
+   a different value in each pixel: the fits of the bins above must not
+   replace them, and the free parameters must still be found */
+static int test_pyramid_fixed(void)
+{
+	float prompt[TEST_NPROMPT], truth[TEST_PYRAMID_NPIX*3];
+	float trans[TEST_PYRAMID_NPIX*TEST_NBINS], param[TEST_PYRAMID_NPIX*3];
+	float chisq[TEST_PYRAMID_NPIX];
+	int paramfree[3];
+	int fixed, t, j, ret, failed = 0;
+	char what[100];
+
+	test_make_prompt(prompt);
+	for (t=0; t<TEST_PYRAMID_NPIX; t++) {
+		truth[t*3+0] = 1.0f + 0.5f * t;
+		truth[t*3+1] = 1000.0f + 50.0f * t;
+		truth[t*3+2] = 1.0f + 0.1f * t;
+		test_make_decay(prompt, truth + t*3, 1, trans + t*TEST_NBINS);
+	}
+
+	for (fixed=0; fixed<3; fixed+=2) {
+		for (j=0; j<3; j++)
+			paramfree[j] = (j != fixed);
+		for (t=0; t<TEST_PYRAMID_NPIX; t++) {
+			param[t*3+0] = 0.0f;
+			param[t*3+1] = 500.0f;
+			param[t*3+2] = 2.0f;
+			param[t*3+fixed] = truth[t*3+fixed];
+		}
+
+		ret = GCI_marquardt_fitting_engine_pyramid(test_xincr, trans, TEST_NBINS,
+						TEST_PYRAMID_ROWS, TEST_PYRAMID_COLS, 3, 15, 250,
+						prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+						param, paramfree, 3, ECF_RESTRAIN_DEFAULT, NULL,
+						GCI_multiexp_tau, NULL, NULL, chisq, NULL,
+						1.0f, 1e-4f, 0, NULL, NULL, 0);
+		sprintf(what, "parameter %d fixed returned %d", fixed, ret);
+		failed += test_check(ret == 0, what);
+
+		for (t=0; t<TEST_PYRAMID_NPIX; t++) {
+			sprintf(what, "pixel %d: fixed parameter %d is %g, not %g",
+					t, fixed, param[t*3+fixed], truth[t*3+fixed]);
+			failed += test_check(param[t*3+fixed] == truth[t*3+fixed], what);
+			for (j=0; j<3; j++) {
+				if (j == fixed)
+					continue;
+				sprintf(what, "pixel %d: parameter %d is %g, not %g",
+						t, j, param[t*3+j], truth[t*3+j]);
+				failed += test_check(fabs(param[t*3+j] - truth[t*3+j]) <
+									 1e-3 * fabs(truth[t*3+j]) + 1e-2, what);
+			}
+		}
+	}
+
+	return failed;
+}
+
+
+/********************************************************************
+
+						 WORKSPACE SETTINGS
+
+ ********************************************************************/
+
+/* The Marquardt steps of a fit of a two component decay in ws, from a
+   poor start, or -1 if it fails */
+static int test_fit_steps(ecf_workspace *ws, const float prompt[], float trans[])
+{
+	float param[5] = { 0.0f, 500.0f, 4.0f, 500.0f, 0.2f };
+	int paramfree[5] = { 1, 1, 1, 1, 1 };
+	float fitted[TEST_NBINS], residuals[TEST_NBINS], chisq;
+	float **covar = GCI_ecf_matrix(5, 5), **alpha = GCI_ecf_matrix(5, 5);
+	ecf_fit_stats stats;
+	int ret = -1;
+
+	GCI_ecf_set_workspace_stats(ws, &stats);
+	if (covar != NULL && alpha != NULL &&
+		GCI_marquardt_fitting_engine_ws(ws, test_xincr, trans, TEST_NBINS,
+					15, 250, (float *) prompt, TEST_NPROMPT, NOISE_POISSON_FIT, NULL,
+					param, paramfree, 5, ECF_RESTRAIN_DEFAULT, GCI_multiexp_tau,
+					fitted, residuals, &chisq, covar, alpha, NULL,
+					1.0f, 0.01f, 0) >= 0)
+		ret = stats.iterations;
+	GCI_ecf_set_workspace_stats(ws, NULL);
+	GCI_ecf_free_matrix(covar);
+	GCI_ecf_free_matrix(alpha);
+	return ret;
+}
+
+/* GCI_set_method() only sets the method of workspaces made after it,
+   and GCI_ecf_set_workspace_method() that of the one workspace */
+static int test_workspace_settings(void)
+{
+	float prompt[TEST_NPROMPT], trans[TEST_NBINS];
+	float truth[5] = { 2.0f, 1000.0f, 2.5f, 500.0f, 0.5f };
+	ecf_workspace *ws1, *ws2;
+	int marquardt, varpro, n, failed = 0;
+	char what[80];
+
+	test_make_prompt(prompt);
+	test_make_decay(prompt, truth, 2, trans);
+
+	GCI_set_method(ECF_METHOD_MARQUARDT);
+	ws1 = GCI_ecf_workspace(TEST_NBINS, 5);
+	GCI_set_method(ECF_METHOD_VARPRO);
+	ws2 = GCI_ecf_workspace(TEST_NBINS, 5);
+	GCI_set_method(ECF_METHOD_MARQUARDT);
+	if (test_check(ws1 != NULL && ws2 != NULL, "GCI_ecf_workspace")) {
+		GCI_ecf_free_workspace(ws1);
+		GCI_ecf_free_workspace(ws2);
+		return 1;
+	}
+
+	marquardt = test_fit_steps(ws1, prompt, trans);
+	varpro = test_fit_steps(ws2, prompt, trans);
+	sprintf(what, "Marquardt %d steps, varpro %d", marquardt, varpro);
+	failed += test_check(marquardt > 0 && varpro > 0 && marquardt != varpro, what);
+
+	/* A new default leaves the existing workspaces alone */
+	GCI_set_method(ECF_METHOD_VARPRO);
+	n = test_fit_steps(ws1, prompt, trans);
+	GCI_set_method(ECF_METHOD_MARQUARDT);
+	sprintf(what, "%d steps after GCI_set_method(), not %d", n, marquardt);
+	failed += test_check(n == marquardt, what);
+
+	GCI_ecf_set_workspace_method(ws1, ECF_METHOD_VARPRO);
+	n = test_fit_steps(ws1, prompt, trans);
+	sprintf(what, "%d steps after GCI_ecf_set_workspace_method(), not %d", n, varpro);
+	failed += test_check(n == varpro, what);
+
+	GCI_ecf_free_workspace(ws1);
+	GCI_ecf_free_workspace(ws2);
+	return failed;
+}
+
+
+/********************************************************************
+
+							  MAIN
+
+ ********************************************************************/
+
+typedef struct {
+	const char *name;
+	int (*fn)(void);
+} test_entry;
+
+static const test_entry tests[] = {
+	{ "lut_polish", test_lut_polish },
+	{ "global_convergence", test_global_convergence },
+	{ "global_restraint", test_global_restraint },
+	{ "workspace_settings", test_workspace_settings },
+	{ "pyramid_fixed", test_pyramid_fixed },
+	{ "fft_convolution", test_fft_convolution },
+	{ "bin_image", test_bin_image },
+	{ "phasor", test_phasor },
+};
+
+#define TEST_COUNT ((int) (sizeof(tests) / sizeof(tests[0])))
+
+int main(int argc, char *argv[])
+{
+	int i, j, nfailed = 0;
+
+	for (i=0; i<TEST_COUNT; i++) {
+		if (argc > 1) {
+			for (j=1; j<argc; j++)
+				if (strcmp(argv[j], tests[i].name) == 0)
+					break;
+			if (j == argc)
+				continue;
+		}
+		if (tests[i].fn() != 0) {
+			printf("%s: FAILED\n", tests[i].name);
+			nfailed++;
+		}
+		else
+			printf("%s: passed\n", tests[i].name);
+	}
+
+	for (j=1; j<argc; j++) {
+		for (i=0; i<TEST_COUNT; i++)
+			if (strcmp(argv[j], tests[i].name) == 0)
+				break;
+		if (i == TEST_COUNT) {
+			printf("%s: no such test\n", argv[j]);
+			nfailed++;
+		}
+	}
+
+	return nfailed;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
@@ -0,0 +1,425 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the tracing of the iterations of the Marquardt
+   fits, and the statistics of how the fits went.
+
+   A trace is attached to a fitting workspace, and the fits in that
+   workspace record the parameters, chi-squared and alambda of every
+   step in it, along with whether the step was accepted.  Recording only
+   copies the values into a ring buffer, or hands them to a callback, so
+   it does no I/O and takes no locks; like the workspace, a trace must
+   only be used by one thread at a time.  The records are written out
+   afterwards, as CSV or binary, by GCI_ecf_trace_write(), or read back
+   by GCI_ecf_trace_read().
+
+   ECF_ExportParams_start() is kept for existing code: it has
+   GCI_marquardt_fitting_engine() trace each fit and append the records
+   to a file once the fit is done.
+
+   The statistics (see GCI_ecf_set_workspace_stats()) count the work
+   done by each fit and why it stopped, and GCI_ecf_stats_summary_add()
+   gathers them into histograms over a whole image.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "EcfInternal.h"
+
+/* The timestamp counter where there is one, otherwise clock() */
+#if (defined(__GNUC__) || defined(__clang__)) && \
+	(defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define ECF_CYCLES() ((double) __rdtsc())
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define ECF_CYCLES() ((double) __rdtsc())
+#else
+#include <time.h>
+#define ECF_CYCLES() ((double) clock())
+#endif
+
+struct ecf_trace {
+	ecf_trace_record *records;  /* the ring buffer */
+	int capacity;               /* its length */
+	int first;                  /* index of the oldest record */
+	int count;                  /* number of records held */
+	int dropped;                /* records overwritten before being read */
+	int nfits;                  /* fits started so far */
+	ecf_trace_callback callback;
+	void *user;
+};
+
+/* Makes a trace which keeps the last capacity records (capacity may be 0
+   if only the callback is wanted), and which passes every record to
+   callback(record, user) as it is made if callback is not NULL.  Returns
+   NULL if out of memory.
+ */
+ecf_trace *GCI_ecf_trace(int capacity, ecf_trace_callback callback, void *user)
+{
+	ecf_trace *trace;
+
+	if (capacity < 0)
+		return NULL;
+	if ((trace = (ecf_trace *) malloc(sizeof(ecf_trace))) == NULL)
+		return NULL;
+
+	trace->records = NULL;
+	if (capacity > 0 &&
+		(trace->records = (ecf_trace_record *)
+		 malloc((size_t) capacity * sizeof(ecf_trace_record))) == NULL) {
+		free(trace);
+		return NULL;
+	}
+
+	trace->capacity = capacity;
+	trace->first = trace->count = trace->dropped = trace->nfits = 0;
+	trace->callback = callback;
+	trace->user = user;
+	return trace;
+}
+
+void GCI_ecf_free_trace(ecf_trace *trace)
+{
+	if (trace != NULL) {
+		free(trace->records);
+		free(trace);
+	}
+}
+
+/* The fits in this workspace will record their steps in trace, or not
+   at all if trace is NULL.
+ */
+void GCI_ecf_set_workspace_trace(ecf_workspace *ws, ecf_trace *trace)
+{
+	ws->trace = trace;
+}
+
+/* The number of records waiting to be read, and the number which were
+   overwritten because the ring buffer was full
+ */
+int GCI_ecf_trace_count(const ecf_trace *trace)
+{
+	return trace->count;
+}
+
+int GCI_ecf_trace_dropped(const ecf_trace *trace)
+{
+	return trace->dropped;
+}
+
+/* Removes up to max of the oldest records from the trace into
+   records[], returning how many there were.
+ */
+int GCI_ecf_trace_read(ecf_trace *trace, ecf_trace_record records[], int max)
+{
+	int i;
+
+	for (i=0; i<max && trace->count>0; i++) {
+		records[i] = trace->records[trace->first];
+		trace->first = (trace->first + 1) % trace->capacity;
+		trace->count--;
+	}
+	return i;
+}
+
+/* Appends all of the records in the trace to the file path, and empties
+   it.  ECF_TRACE_CSV writes one line per record: the fit, iteration,
+   accepted flag, chi-squared, alambda and the parameters.
+   ECF_TRACE_BINARY writes the ecf_trace_record structures as they are
+   held in memory, after a header of the eight characters "ECFTRACE"
+   and the size of a record as an int.  Returns the number of records
+   written, or -1 if the file cannot be written.
+ */
+int GCI_ecf_trace_write(ecf_trace *trace, const char *path, ecf_trace_format format)
+{
+	FILE *fp;
+	ecf_trace_record record;
+	int i, n, size, ret = 0;
+
+	if ((fp = fopen(path, (format == ECF_TRACE_BINARY) ? "ab" : "a")) == NULL)
+		return -1;
+
+	if (format == ECF_TRACE_BINARY) {
+		size = (int) sizeof(ecf_trace_record);
+		if (ftell(fp) == 0 &&
+			(fwrite("ECFTRACE", 1, 8, fp) != 8 ||
+			 fwrite(&size, sizeof(int), 1, fp) != 1))
+			ret = -1;
+	}
+
+	for (n=0; ret == 0 && GCI_ecf_trace_read(trace, &record, 1) == 1; n++) {
+		if (format == ECF_TRACE_BINARY) {
+			if (fwrite(&record, sizeof(ecf_trace_record), 1, fp) != 1)
+				ret = -1;
+		} else {
+			fprintf(fp, "%d, %d, %d, %g, %g", record.fit, record.iteration,
+					record.accepted, record.chisq, record.alambda);
+			for (i=0; i<record.nparam; i++)
+				fprintf(fp, ", %g", record.param[i]);
+			if (fprintf(fp, "\n") < 0)
+				ret = -1;
+		}
+	}
+
+	if (fclose(fp) != 0)
+		ret = -1;
+	return (ret == 0) ? n : -1;
+}
+
+/* Called by the fitting functions at the start of each fit */
+void ecf_trace_start(ecf_trace *trace)
+{
+	trace->nfits++;
+}
+
+/* Called by the fitting functions after each step, numbering them from
+   0 for the first */
+void ecf_trace_step(ecf_trace *trace, int iteration, float param[], int nparam,
+					float chisq, float alambda, int accepted)
+{
+	ecf_trace_record record, *r;
+	int i;
+
+	r = &record;
+	if (trace->capacity > 0) {
+		if (trace->count == trace->capacity) {
+			trace->first = (trace->first + 1) % trace->capacity;
+			trace->count--;
+			trace->dropped++;
+		}
+		r = &trace->records[(trace->first + trace->count) % trace->capacity];
+		trace->count++;
+	}
+
+	if (nparam > ECF_TRACE_MAXPARAM)
+		nparam = ECF_TRACE_MAXPARAM;
+	r->fit = trace->nfits;
+	r->iteration = iteration;
+	r->accepted = accepted;
+	r->nparam = nparam;
+	r->chisq = chisq;
+	r->alambda = alambda;
+	for (i=0; i<nparam; i++)
+		r->param[i] = param[i];
+
+	if (trace->callback != NULL)
+		(*trace->callback)(r, trace->user);
+}
+
+
+/* The old interface, which exports the parameters of each iteration of
+   GCI_marquardt_fitting_engine() to a file */
+
+static int ecf_export_params = 0;
+static char ecf_export_params_path[256];
+
+void ECF_ExportParams_start (char path[])
+{
+	ecf_export_params = 1;
+	if (path) {
+		strncpy(ecf_export_params_path, path, sizeof(ecf_export_params_path) - 1);
+		ecf_export_params_path[sizeof(ecf_export_params_path) - 1] = '\0';
+	}
+}
+
+void ECF_ExportParams_stop (void)
+{
+	ecf_export_params = 0;
+}
+
+/* Returns a trace for the fitting engine to record its fit in, if the
+   parameters are being exported, or NULL if not */
+ecf_trace *ecf_export_params_begin(void)
+{
+	if (!ecf_export_params)
+		return NULL;
+	return GCI_ecf_trace(MAXITERS * (MAXREFITS + 1), NULL, NULL);
+}
+
+/* Writes out and frees the trace of ecf_export_params_begin(), in the
+   old format of the parameters followed by chi-squared on each line and
+   a blank line after each fit */
+void ecf_export_params_end(ecf_trace *trace)
+{
+	FILE *fp;
+	ecf_trace_record record;
+	int i;
+
+	if (trace == NULL)
+		return;
+	if ((fp = fopen(ecf_export_params_path, "a")) != NULL) {
+		while (GCI_ecf_trace_read(trace, &record, 1) == 1) {
+			for (i=0; i<record.nparam; i++) fprintf(fp, "%g, ", record.param[i]);
+			fprintf(fp, "%g\n", record.chisq);
+		}
+		fprintf(fp, "\n");
+		fclose(fp);
+	}
+	GCI_ecf_free_trace(trace);
+}
+
+/* Whether the fitting engine is exporting the parameters, in which case
+   the batch fits run on one thread as they share the file */
+int ecf_export_params_active(void)
+{
+	return ecf_export_params;
+}
+
+
+
+/********************************************************************
+
+						   FIT STATISTICS
+
+ ********************************************************************/
+
+/* The fits in this workspace will fill in stats, or nothing if stats
+   is NULL.
+ */
+void GCI_ecf_set_workspace_stats(ecf_workspace *ws, ecf_fit_stats *stats)
+{
+	ws->stats = stats;
+}
+
+/* Called by the fitting engines at the start of each transient */
+void ecf_stats_start(ecf_fit_stats *stats)
+{
+	memset(stats, 0, sizeof(ecf_fit_stats));
+	stats->exit = ECF_EXIT_ERROR;
+	stats->cycles = ECF_CYCLES();
+}
+
+/* Called by the Marquardt fits after each step, with the new alambda */
+void ecf_stats_step(ecf_fit_stats *stats, float alambda, int accepted)
+{
+	stats->iterations++;
+	if (accepted)
+		stats->accepted++;
+	else {
+		stats->rejected++;
+		stats->lambda_increases++;
+	}
+	stats->alambda = alambda;
+}
+
+/* Called by the fitting engines at the end of each transient, with the
+   return value of the last fit: 0 or more if it converged, otherwise
+   the error codes of GCI_marquardt_instr() */
+void ecf_stats_finish(ecf_fit_stats *stats, int ret, float chisq,
+					  float chisq_target, int refits, int ndf)
+{
+	stats->cycles = ECF_CYCLES() - stats->cycles;
+	stats->chisq = chisq;
+	stats->ndf = ndf;
+	stats->refits = refits;
+	if (ret >= 0)
+		stats->exit = (chisq <= chisq_target) ?
+			ECF_EXIT_CONVERGED : ECF_EXIT_TARGET_MISSED;
+	else if (ret == -2)
+		stats->exit = ECF_EXIT_MAXITERS;
+	else if (ret == -3 || ret == -4)  /* a step or the endgame */
+		stats->exit = ECF_EXIT_SOLVER;
+	else
+		stats->exit = ECF_EXIT_ERROR;
+}
+
+/* Bin b of the power of two histograms holds the values from 2^(b-1)
+   up to 2^b, with 0 (and anything less than 1) in bin 0 */
+static int ecf_stats_log2_bin(double value)
+{
+	int b = 0;
+
+	while (value >= 1.0 && b < ECF_STATS_NBINS-1) {
+		value *= 0.5;
+		b++;
+	}
+	return b;
+}
+
+void GCI_ecf_stats_summary_clear(ecf_stats_summary *summary)
+{
+	memset(summary, 0, sizeof(ecf_stats_summary));
+}
+
+/* Adds the statistics of one fit to the summary */
+void GCI_ecf_stats_summary_add(ecf_stats_summary *summary, const ecf_fit_stats *stats)
+{
+	float v;
+
+	summary->nfits++;
+	if (stats->exit >= 0 && stats->exit < ECF_EXIT_NREASONS)
+		summary->exits[stats->exit]++;
+
+	summary->fn_evals += stats->fn_evals;
+	summary->iterations += stats->iterations;
+	summary->accepted += stats->accepted;
+	summary->rejected += stats->rejected;
+	summary->lambda_increases += stats->lambda_increases;
+	summary->refits += stats->refits;
+	summary->cycles += stats->cycles;
+
+	summary->fn_evals_hist[ecf_stats_log2_bin(stats->fn_evals)]++;
+	summary->iterations_hist[ecf_stats_log2_bin(stats->iterations)]++;
+	summary->refits_hist[(stats->refits < ECF_STATS_NBINS) ?
+						 stats->refits : ECF_STATS_NBINS-1]++;
+	summary->cycles_hist[ecf_stats_log2_bin(stats->cycles)]++;
+
+	/* Reduced chi-squared, with anything too large (or NaN) in the last bin */
+	if (stats->ndf > 0) {
+		v = stats->chisq / stats->ndf * ECF_STATS_CHISQ_BINS_PER_UNIT;
+		summary->chisq_hist[(v >= 0.0f && v < ECF_STATS_NBINS) ?
+							(int) v : ECF_STATS_NBINS-1]++;
+	}
+}
+
+/* Adds the summary from, of some other fits, to summary */
+void GCI_ecf_stats_summary_merge(ecf_stats_summary *summary, const ecf_stats_summary *from)
+{
+	int i;
+
+	summary->nfits += from->nfits;
+	for (i=0; i<ECF_EXIT_NREASONS; i++)
+		summary->exits[i] += from->exits[i];
+
+	summary->fn_evals += from->fn_evals;
+	summary->iterations += from->iterations;
+	summary->accepted += from->accepted;
+	summary->rejected += from->rejected;
+	summary->lambda_increases += from->lambda_increases;
+	summary->refits += from->refits;
+	summary->cycles += from->cycles;
+
+	for (i=0; i<ECF_STATS_NBINS; i++) {
+		summary->fn_evals_hist[i] += from->fn_evals_hist[i];
+		summary->iterations_hist[i] += from->iterations_hist[i];
+		summary->refits_hist[i] += from->refits_hist[i];
+		summary->cycles_hist[i] += from->cycles_hist[i];
+		summary->chisq_hist[i] += from->chisq_hist[i];
+	}
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
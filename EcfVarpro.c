@@ -0,0 +1,556 @@
+/*
+This file is part of the SLIM-curve package for exponential curve fitting of spectral lifetime data.
+
+Copyright (c) 2010-2013, Gray Institute University of Oxford & UW-Madison LOCI.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file contains the variable projection fits of the
+   multiexponential models.
+
+   In the models
+
+     y(t) = Z + (sum_i A_i exp(-t/tau_i)) * instr(t)
+
+   Z and the amplitudes A_i enter linearly, so for any given lifetimes
+   the best Z and A_i follow from a small linear least squares fit.  The
+   variable projection method (Golub and Pereyra, here with Kaufman's
+   approximation to the Jacobian) does this linear fit at every step,
+   and only the lifetimes are left to the Marquardt iteration.  There
+   are then only half as many parameters to iterate over, and the
+   amplitudes are always the best ones for the current lifetimes, so
+   far fewer iterations are needed and the fit converges from much
+   poorer starting values than when all the parameters are iterated.
+
+   If B holds the derivatives of the model with respect to the free
+   linear parameters, D those with respect to the free lifetimes and W
+   the weights of the noise model, then the linear fit is
+
+     c = (B'WB)^-1 B'W (y - f0)
+
+   where f0 is the part of the model which does not depend on c, and
+   the Marquardt matrices for the lifetimes are
+
+     alpha = D'WD - D'WB (B'WB)^-1 B'WD,  beta = D'W (y - yfit).
+
+   All of these come from one evaluation of the model with the free
+   amplitudes set to one and a free Z to zero, as D just scales with the
+   amplitudes.
+
+   The NOISE_POISSON_FIT and NOISE_GAUSSIAN_FIT weights depend on the fit
+   itself, so the linear fit uses the weights of the last accepted fit.
+   NOISE_MLE is not a least squares fit at all; it, the other models and
+   fits without both free linear and free nonlinear parameters are
+   passed on to GCI_marquardt_instr_ws().  Once converged, the
+   covariance matrix and error axes are computed for all of the free
+   parameters, exactly as GCI_marquardt_instr_ws() does.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "EcfInternal.h"
+
+/* Steps out of bounds are retried with more damping up to this alambda */
+#define ECF_VARPRO_MAX_ALAMBDA 1.0e4f
+
+/* The fitting method of GCI_marquardt_fitting_engine_ws() with a
+   workspace, and the default given to new workspaces */
+static method_type ecf_method = ECF_METHOD_MARQUARDT;
+
+void GCI_set_method(method_type method)
+{
+	ecf_method = method;
+}
+
+method_type GCI_get_method(void)
+{
+	return ecf_method;
+}
+
+void GCI_ecf_set_workspace_method(ecf_workspace *ws, method_type method)
+{
+	ws->method = method;
+}
+
+/* Which of the free parameters are linear, and the normal matrix B'WB
+   of the last linear fit */
+typedef struct {
+	int nlin;               /* number of free linear parameters */
+	int nnon;               /* number of free lifetimes */
+	int lin[MAXFIT];        /* their indices in param[] */
+	int non[MAXFIT];
+	float g[MAXFIT][MAXFIT];
+} ecf_varpro;
+
+/* Sorts the free parameters into linear and nonlinear ones.  Returns 0
+   if the fit can be done by variable projection, -1 if it must be left
+   to the ordinary Marquardt fit. */
+static int ecf_varpro_init(ecf_varpro *vp, ecf_model model, noise_type noise,
+						   int paramfree[], int nparam)
+{
+	int i;
+
+	if (model != ECF_MODEL_MULTIEXP_LAMBDA && model != ECF_MODEL_MULTIEXP_TAU)
+		return -1;
+	if (noise == NOISE_MLE || nparam > MAXFIT || (nparam & 1) == 0)
+		return -1;
+
+	/* Z and the amplitudes are linear, the lifetimes are not */
+	vp->nlin = vp->nnon = 0;
+	for (i=0; i<nparam; i++) {
+		if (!paramfree[i])
+			continue;
+		if (i == 0 || (i & 1) == 1)
+			vp->lin[vp->nlin++] = i;
+		else
+			vp->non[vp->nnon++] = i;
+	}
+
+	return (vp->nlin == 0 || vp->nnon == 0) ? -1 : 0;
+}
+
+/* The weight 1/sigma^2 of point q, exactly as in
+   GCI_marquardt_compute_fn_instr() */
+static float ecf_varpro_weight(noise_type noise, float sig[], int q,
+							   float y, float yfit)
+{
+	switch (noise) {
+	case NOISE_CONST:
+		return 1.0f / sig[0];
+	case NOISE_GIVEN:
+		return 1.0f / (sig[q] * sig[q]);
+	case NOISE_POISSON_DATA:
+		return (y > 15 ? 1.0f / y : 1.0f / 15);
+	case NOISE_POISSON_FIT:
+		return (yfit > 15 ? 1.0f / yfit : 1.0f / 15);
+	case NOISE_GAUSSIAN_FIT:
+		return (yfit > 1.0f ? 1.0f / yfit : 1.0f);
+	default:
+		return 0.0f;
+	}
+}
+
+/* Evaluates the model for the lifetimes in param[], leaving f0 in
+   ws->fnvals[] and the derivatives B and D (the latter for unit
+   amplitudes) in ws->dy_dparam_conv[][] */
+static void ecf_varpro_model(const ecf_varpro *vp, float xincr,
+							 int fit_start, int fit_end,
+							 float instr[], int ninstr,
+							 float param[], int nparam,
+							 void (*fitfunc)(float, float [], float *, float [], int),
+							 float yfit[], ecf_workspace *ws)
+{
+	float unit[MAXFIT], f0;
+	int j, q;
+
+	for (j=0; j<nparam; j++)
+		unit[j] = param[j];
+	for (j=0; j<vp->nlin; j++)
+		unit[vp->lin[j]] = (vp->lin[j] == 0) ? 0.0f : 1.0f;
+
+	ecf_compute_fn_model_instr(xincr, fit_start, fit_end, instr, ninstr,
+							   unit, nparam, fitfunc, yfit, ws);
+
+	for (q=fit_start; q<fit_end; q++) {
+		ws->dy_dparam_conv[q][0] = 1.0f;
+		f0 = yfit[q] + unit[0];
+		for (j=0; j<vp->nlin; j++)
+			if (vp->lin[j] != 0)
+				f0 -= ws->dy_dparam_conv[q][vp->lin[j]];
+		ws->fnvals[q] = f0;
+	}
+}
+
+/* Finds the free linear parameters of param[] by a least squares fit
+   with weights w[] to the model last evaluated by ecf_varpro_model().
+   Returns 0 on success, -1 if B'WB is singular. */
+static int ecf_varpro_linear(ecf_varpro *vp, float y[], int fit_start, int fit_end,
+							 float param[], float w[], ecf_workspace *ws)
+{
+	float a[MAXFIT][MAXFIT], *rows[MAXFIT], c[MAXFIT], b[MAXFIT], r;
+	int j, k, q;
+
+	for (j=0; j<vp->nlin; j++) {
+		c[j] = 0.0f;
+		for (k=0; k<=j; k++)
+			vp->g[j][k] = 0.0f;
+	}
+
+	for (q=fit_start; q<fit_end; q++) {
+		r = y[q] - ws->fnvals[q];
+		for (j=0; j<vp->nlin; j++) {
+			b[j] = ws->dy_dparam_conv[q][vp->lin[j]] * w[q];
+			c[j] += b[j] * r;
+			for (k=0; k<=j; k++)
+				vp->g[j][k] += b[j] * ws->dy_dparam_conv[q][vp->lin[k]];
+		}
+	}
+
+	for (j=0; j<vp->nlin; j++) {
+		for (k=0; k<j; k++)
+			vp->g[k][j] = vp->g[j][k];
+	}
+	for (j=0; j<vp->nlin; j++) {
+		rows[j] = a[j];
+		for (k=0; k<vp->nlin; k++)
+			a[j][k] = vp->g[j][k];
+	}
+
+	if (ecf_solve_normal(rows, vp->nlin, c) != 0)
+		return -1;
+
+	for (j=0; j<vp->nlin; j++)
+		param[vp->lin[j]] = c[j];
+	return 0;
+}
+
+/* Computes the fit yfit[] and residuals dy[] for the parameters
+   param[], the weights wfit[] of the noise model for this fit, and
+   chi-squared */
+static void ecf_varpro_chisq(const ecf_varpro *vp, float y[],
+							 int fit_start, int fit_end,
+							 noise_type noise, float sig[], float param[],
+							 float yfit[], float dy[], float wfit[], float *chisq,
+							 ecf_workspace *ws)
+{
+	int j, q;
+
+	*chisq = 0.0f;
+	for (q=fit_start; q<fit_end; q++) {
+		yfit[q] = ws->fnvals[q];
+		for (j=0; j<vp->nlin; j++)
+			yfit[q] += param[vp->lin[j]] * ws->dy_dparam_conv[q][vp->lin[j]];
+		dy[q] = y[q] - yfit[q];
+		wfit[q] = ecf_varpro_weight(noise, sig, q, y[q], yfit[q]);
+		*chisq += wfit[q] * dy[q] * dy[q];
+	}
+}
+
+/* Computes the reduced Marquardt matrices alpha and beta for the
+   lifetimes, from the residuals dy[] of the last linear fit with weights
+   w[] */
+static int ecf_varpro_alpha_beta(const ecf_varpro *vp, int fit_start, int fit_end,
+								 float param[], int paramfree[], float w[], float dy[],
+								 float alpha[][MAXFIT], float beta[],
+								 ecf_workspace *ws)
+{
+	float h[MAXFIT][MAXFIT], e[MAXFIT][MAXFIT], a[MAXFIT][MAXFIT], *rows[MAXFIT];
+	float scale[MAXFIT], d[MAXFIT], x[MAXFIT], wd;
+	int i, j, k, l, q;
+
+	/* The derivatives were evaluated for unit free amplitudes */
+	for (k=0; k<vp->nnon; k++) {
+		i = vp->non[k] - 1;
+		scale[k] = paramfree[i] ? param[i] : 1.0f;
+		beta[k] = 0.0f;
+		for (l=0; l<=k; l++)
+			e[k][l] = 0.0f;
+		for (j=0; j<vp->nlin; j++)
+			h[j][k] = 0.0f;
+	}
+
+	for (q=fit_start; q<fit_end; q++) {
+		for (k=0; k<vp->nnon; k++)
+			d[k] = ws->dy_dparam_conv[q][vp->non[k]] * scale[k];
+		for (k=0; k<vp->nnon; k++) {
+			wd = d[k] * w[q];
+			beta[k] += wd * dy[q];
+			for (l=0; l<=k; l++)
+				e[k][l] += wd * d[l];
+			for (j=0; j<vp->nlin; j++)
+				h[j][k] += wd * ws->dy_dparam_conv[q][vp->lin[j]];
+		}
+	}
+
+	/* alpha = E - H' G^-1 H, a column of G^-1 H at a time */
+	for (k=0; k<vp->nnon; k++)
+		for (l=0; l<=k; l++)
+			alpha[k][l] = alpha[l][k] = e[k][l];
+
+	for (l=0; l<vp->nnon; l++) {
+		for (j=0; j<vp->nlin; j++) {
+			rows[j] = a[j];
+			for (i=0; i<vp->nlin; i++)
+				a[j][i] = vp->g[j][i];
+			x[j] = h[j][l];
+		}
+		if (ecf_solve_normal(rows, vp->nlin, x) != 0)
+			return -1;
+		for (k=0; k<vp->nnon; k++)
+			for (j=0; j<vp->nlin; j++)
+				alpha[k][l] -= h[j][k] * x[j];
+	}
+
+	return 0;
+}
+
+/* Applies the parameter restraints as GCI_marquardt_step_instr() does */
+static int ecf_varpro_check(restrain_type restrain, float param[], int nparam,
+							void (*fitfunc)(float, float [], float *, float [], int),
+							ecf_workspace *ws)
+{
+	if (restrain == ECF_RESTRAIN_DEFAULT)
+		return check_ecf_params(param, nparam, fitfunc);
+	else
+		return check_ecf_user_params(ws->restraint, param, nparam, fitfunc);
+}
+
+/* Variable projection versions of GCI_marquardt_instr() and
+   GCI_marquardt_instr_ws(), with the same arguments and return values */
+int GCI_marquardt_varpro_instr(float xincr, float y[],
+					int ndata, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float param[], int paramfree[], int nparam,
+					restrain_type restrain,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float *fitted, float *residuals,
+					float **covar, float **alpha, float *chisq,
+					float chisq_delta, float chisq_percent, float **erraxes)
+{
+	ecf_workspace *ws;
+	int ret;
+
+	if ((ws = GCI_ecf_workspace(ndata, nparam)) == NULL)
+		return -1;
+
+	ret = GCI_marquardt_varpro_instr_ws(ws, xincr, y, ndata, fit_start, fit_end,
+										instr, ninstr, noise, sig,
+										param, paramfree, nparam, restrain, fitfunc,
+										fitted, residuals, covar, alpha, chisq,
+										chisq_delta, chisq_percent, erraxes);
+
+	GCI_ecf_free_workspace(ws);
+	return ret;
+}
+
+int GCI_marquardt_varpro_instr_ws(ecf_workspace *ws, float xincr, float y[],
+					int ndata, int fit_start, int fit_end,
+					float instr[], int ninstr,
+					noise_type noise, float sig[],
+					float param[], int paramfree[], int nparam,
+					restrain_type restrain,
+					void (*fitfunc)(float, float [], float *, float [], int),
+					float *fitted, float *residuals,
+					float **covar, float **alpha, float *chisq,
+					float chisq_delta, float chisq_percent, float **erraxes)
+{
+	ecf_varpro vp;
+	ecf_model model;
+	float *w, *wtry;
+	float alpha_r[MAXFIT][MAXFIT], beta_r[MAXFIT], a[MAXFIT][MAXFIT], *rows[MAXFIT];
+	float paramtry[MAXFIT], dparam[MAXFIT], beta[MAXFIT], evals[MAXFIT];
+	float alambda, ochisq, chisqtry;
+	int i, j, k, q, mfit, itst, itst_max, ret;
+
+	model = ecf_model_of(fitfunc);
+	if (ecf_varpro_init(&vp, model, noise, paramfree, nparam) != 0)
+		return GCI_marquardt_instr_ws(ws, xincr, y, ndata, fit_start, fit_end,
+									  instr, ninstr, noise, sig,
+									  param, paramfree, nparam, restrain, fitfunc,
+									  fitted, residuals, covar, alpha, chisq,
+									  chisq_delta, chisq_percent, erraxes);
+
+	mfit = vp.nlin + vp.nnon;
+
+	if (xincr <= 0)
+		return -11;
+	if (fit_start < 0 || fit_start > fit_end || fit_end > ndata)
+		return -12;
+	if (ecf_workspace_reserve(ws, ndata, nparam) != 0)
+		return -1;
+	ws->model = model;
+	/* The weights of the current and the trial parameters */
+	w = ws->alpha_weight;
+	wtry = ws->beta_weight;
+
+	itst_max = (restrain == ECF_RESTRAIN_DEFAULT) ? 4 : 6;
+	for (j=0; j<vp.nnon; j++)
+		rows[j] = a[j];
+
+	/* Start from the linear fit for the given lifetimes, weighted as
+	   the given parameters would be.  If that is out of bounds, which
+	   happens when the given lifetimes are so far out that one of the
+	   amplitudes comes out negative, every step would be, so leave the
+	   whole fit to the ordinary Marquardt iteration. */
+	ecf_varpro_model(&vp, xincr, fit_start, fit_end, instr, ninstr,
+					 param, nparam, fitfunc, fitted, ws);
+	ecf_varpro_chisq(&vp, y, fit_start, fit_end, noise, sig, param,
+					 fitted, residuals, w, chisq, ws);
+	for (i=0; i<nparam; i++)
+		paramtry[i] = param[i];
+	if (ecf_varpro_linear(&vp, y, fit_start, fit_end, paramtry, w, ws) != 0 ||
+		ecf_varpro_check(restrain, paramtry, nparam, fitfunc, ws) != 0)
+		return GCI_marquardt_instr_ws(ws, xincr, y, ndata, fit_start, fit_end,
+									  instr, ninstr, noise, sig,
+									  param, paramfree, nparam, restrain, fitfunc,
+									  fitted, residuals, covar, alpha, chisq,
+									  chisq_delta, chisq_percent, erraxes);
+
+	for (i=0; i<nparam; i++)
+		param[i] = paramtry[i];
+	ecf_varpro_chisq(&vp, y, fit_start, fit_end, noise, sig, param,
+					 fitted, residuals, wtry, chisq, ws);
+	if (ecf_varpro_alpha_beta(&vp, fit_start, fit_end, param, paramfree, w,
+							  residuals, alpha_r, beta_r, ws) != 0)
+		return GCI_marquardt_instr_ws(ws, xincr, y, ndata, fit_start, fit_end,
+									  instr, ninstr, noise, sig,
+									  param, paramfree, nparam, restrain, fitfunc,
+									  fitted, residuals, covar, alpha, chisq,
+									  chisq_delta, chisq_percent, erraxes);
+	for (q=fit_start; q<fit_end; q++)
+		w[q] = wtry[q];
+
+	alambda = 0.001f;
+	if (ws->trace != NULL) {
+		ecf_trace_start(ws->trace);
+		ecf_trace_step(ws->trace, 0, param, nparam, *chisq, alambda, 1);
+	}
+	if (ws->stats != NULL)
+		ecf_stats_step(ws->stats, alambda, 1);
+
+	k = 1;  /* Iteration counter */
+	itst = 0;
+	for (;;) {
+		k++;
+		if (k > MAXITERS) {
+			return -2;
+		}
+
+		ochisq = *chisq;
+
+		/* Steps which take the parameters out of bounds are retried at
+		   once with more damping; with the amplitudes eliminated the
+		   lifetimes are often strongly correlated at the start, and
+		   these steps should not count towards convergence */
+		for (;;) {
+			/* Alter linearised fitting matrix by augmenting diagonal elements */
+			for (i=0; i<vp.nnon; i++) {
+				for (j=0; j<vp.nnon; j++)
+					a[i][j] = alpha_r[i][j];
+				a[i][i] = alpha_r[i][i] * (1.0f + alambda);
+				dparam[i] = beta_r[i];
+			}
+			if (ecf_solve_normal(rows, vp.nnon, dparam) != 0)
+				return -3;
+
+			/* Try the new lifetimes, with the best linear parameters for them */
+			for (i=0; i<nparam; i++)
+				paramtry[i] = param[i];
+			for (j=0; j<vp.nnon; j++)
+				paramtry[vp.non[j]] += dparam[j];
+
+			ret = ecf_varpro_check(restrain, paramtry, nparam, fitfunc, ws);
+			for (j=0; j<vp.nnon; j++)
+				if (!(paramtry[vp.non[j]] > 0.0f))
+					ret = -1;
+
+			if (ret == 0) {
+				ecf_varpro_model(&vp, xincr, fit_start, fit_end, instr, ninstr,
+								 paramtry, nparam, fitfunc, fitted, ws);
+				ret = ecf_varpro_linear(&vp, y, fit_start, fit_end, paramtry, w, ws);
+			}
+			if (ret == 0)
+				ret = ecf_varpro_check(restrain, paramtry, nparam, fitfunc, ws);
+
+			if (ret == 0 || alambda > ECF_VARPRO_MAX_ALAMBDA)
+				break;
+			alambda *= 10.0f;
+			if (ws->stats != NULL)
+				ws->stats->lambda_increases++;
+		}
+
+		if (ret == 0) {
+			ecf_varpro_chisq(&vp, y, fit_start, fit_end, noise, sig, paramtry,
+							 fitted, residuals, wtry, &chisqtry, ws);
+
+			if (chisqtry < *chisq &&
+				ecf_varpro_alpha_beta(&vp, fit_start, fit_end, paramtry, paramfree, w,
+									  residuals, a, dparam, ws) == 0) {
+				/* Success, accept the new solution */
+				alambda *= 0.1f;
+				*chisq = chisqtry;
+				for (i=0; i<nparam; i++)
+					param[i] = paramtry[i];
+				for (i=0; i<vp.nnon; i++) {
+					for (j=0; j<vp.nnon; j++)
+						alpha_r[i][j] = a[i][j];
+					beta_r[i] = dparam[i];
+				}
+				for (q=fit_start; q<fit_end; q++)
+					w[q] = wtry[q];
+			}
+			else
+				ret = -1;
+		}
+		if (ret != 0)  /* Failure, increase alambda */
+			alambda *= 10.0f;
+
+		if (ws->trace != NULL)
+			ecf_trace_step(ws->trace, k-1, param, nparam, *chisq, alambda, ret == 0);
+		if (ws->stats != NULL)
+			ecf_stats_step(ws->stats, alambda, ret == 0);
+
+		if (*chisq > ochisq)
+			itst = 0;
+		else if (ochisq - *chisq < chisq_delta)
+			itst++;
+
+		if (itst < itst_max) continue;
+
+		/* Endgame: the fit, covariance matrix and error axes for all of
+		   the free parameters, as GCI_marquardt_step_instr() does */
+		if (GCI_marquardt_compute_fn_instr(xincr, y, ndata, fit_start, fit_end,
+										   instr, ninstr, noise, sig,
+										   param, paramfree, nparam, fitfunc,
+										   fitted, residuals, alpha, beta,
+										   chisq, 0.0f, -1.0f, ws) != 0 ||
+			GCI_marquardt_compute_fn_final_instr(xincr, y, ndata, fit_start, fit_end,
+												 instr, ninstr, noise, sig,
+												 param, paramfree, nparam, fitfunc,
+												 fitted, residuals, chisq, ws) != 0)
+			return -4;
+
+		for (i=0; i<mfit; i++)
+			for (j=0; j<mfit; j++)
+				covar[i][j] = alpha[i][j];
+		GCI_invert(covar, mfit);
+
+		if (mfit < nparam) {
+			GCI_covar_sort(covar, nparam, paramfree, mfit);
+			GCI_covar_sort(alpha, nparam, paramfree, mfit);
+		}
+
+		if (erraxes == NULL)
+			return k;
+
+		if (GCI_marquardt_estimate_errors(alpha, nparam, mfit, evals,
+										  erraxes, chisq_percent) != 0)
+			return -5;
+
+		break;  /* We're done now */
+	}
+
+	return k;
+}
+
+
+// Emacs settings:
+// Local variables:
+// mode: c
+// c-basic-offset: 4
+// tab-width: 4
+// End:
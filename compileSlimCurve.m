@@ -34,7 +34,7 @@ end
 fprintf('Using Cpath = %s\n', Cpath);
 
 % --- Check required files ---
-need = {'EcfSingle.c','EcfUtil.c','Ecf.h','EcfInternal.h'};
+need = {'EcfSingle.c','EcfUtil.c','EcfBatch.c','EcfFFT.c','EcfSimd.c','EcfKernels.c','EcfVarpro.c','EcfTrace.c','EcfBin.c','EcfGlobal.c','EcfSPA.c','EcfPhasor.c','EcfLUT.c','Ecf.h','EcfInternal.h'};
 for k = 1:numel(need)
     f = fullfile(Cpath,need{k});
     assert(exist(f,'file')==2, 'Missing %s in %s', need{k}, Cpath);
@@ -46,7 +46,14 @@ assert(exist(gate,'file')==2, 'Missing mxSlimCurve.c in %s', here);
 try, mex -setup C; catch ME, warning('%s', ME.message); end
 
 % --- Compose build ---
-src = { gate, fullfile(Cpath,'EcfUtil.c'), fullfile(Cpath,'EcfSingle.c') };
+src = { gate, fullfile(Cpath,'EcfUtil.c'), fullfile(Cpath,'EcfSingle.c'), ...
+        fullfile(Cpath,'EcfBatch.c'), ...
+        fullfile(Cpath,'EcfFFT.c'), fullfile(Cpath,'EcfSimd.c'), ...
+        fullfile(Cpath,'EcfKernels.c'), fullfile(Cpath,'EcfVarpro.c'), ...
+        fullfile(Cpath,'EcfTrace.c'), fullfile(Cpath,'EcfBin.c'), ...
+        fullfile(Cpath,'EcfGlobal.c'), fullfile(Cpath,'EcfSPA.c'), ...
+        fullfile(Cpath,'EcfPhasor.c'), ...
+        fullfile(Cpath,'EcfLUT.c') };
 inc = { ['-I', Cpath] };
 flags = {'-v','-R2018a'};
 libs  = {}; if isunix && ~ismac, libs{end+1}='-lm'; end
@@ -5,6 +5,7 @@
 #include "Ecf.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Definitions
 #define printf mexPrintf
@@ -20,12 +21,166 @@
                                      // (default = transient_size - 1)
 #define __sigma_values      prhs[9]  // noise standard deviations
                                      // (default = [])
+#define __fit_method        prhs[10] // fitting method (default = 0)
+#define __image_size        prhs[11] // [rows columns] of the image
+                                     // (default = [])
+#define __bin               prhs[12] // spatial binning [radius shape]
+                                     // (default = 0)
+#define __init_method       prhs[13] // initial estimates (default = 0)
 
 #define __LMA_param         plhs[0]  // LMA fit parameters
 #define __RLD_param         plhs[1]  // RLD fit parameters
 #define __LMA_fit           plhs[2]  // LMA fit result
 #define __RLD_fit           plhs[3]  // RLD fit result
 
+// A neighbour's fit is only good enough to start from if its reduced chi
+// square is no more than this many times chi_sq_target
+#define WARM_START_CHI_SQ_FACTOR 2.0f
+
+// Returns whether the class of an input array is one that the fits
+// accept: double, single, or the uint16 and uint32 histograms written
+// by TCSPC hardware.
+static int is_supported_class(const mxArray *array)
+{
+    switch (mxGetClassID(array))
+    {
+        case mxDOUBLE_CLASS:
+        case mxSINGLE_CLASS:
+        case mxUINT16_CLASS:
+        case mxUINT32_CLASS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Returns a pointer to column col, of rows elements, of an input array
+// as floats. Single arrays are used in place, without a copy; the other
+// classes are converted into buffer in one pass, which the compiler
+// vectorizes.
+static float *get_column(const mxArray *array, int rows, int col,
+                         float *buffer)
+{
+    size_t offset = (size_t) rows * col;
+    int i;
+
+    switch (mxGetClassID(array))
+    {
+        case mxSINGLE_CLASS:
+            return (float *) mxGetData(array) + offset;
+        case mxUINT16_CLASS:
+        {
+            const unsigned short *data =
+                    (const unsigned short *) mxGetData(array) + offset;
+            for (i = 0; i < rows; i++)
+            {
+                buffer[i] = (float) data[i];
+            }
+            break;
+        }
+        case mxUINT32_CLASS:
+        {
+            const unsigned int *data =
+                    (const unsigned int *) mxGetData(array) + offset;
+            for (i = 0; i < rows; i++)
+            {
+                buffer[i] = (float) data[i];
+            }
+            break;
+        }
+        default:
+        {
+            const double *data = (const double *) mxGetData(array) + offset;
+            for (i = 0; i < rows; i++)
+            {
+                buffer[i] = (float) data[i];
+            }
+            break;
+        }
+    }
+    return buffer;
+}
+
+// Sets the initial estimates of the LMA fit from those of the RLD fit,
+// splitting the amplitude and lifetime between the components of the
+// multiexponential models as TRI2/SP does.
+static void rld_estimates(int fit_type, float z, float a, float tau,
+                          float *params)
+{
+    switch (fit_type) {
+        // single exponential
+        case 1:
+            // params are Z, A, T
+            params[0] = z;
+            params[1] = a;
+            params[2] = tau;
+            break;
+        // double exponential
+        case 2:
+            // params are Z, A1, T1, A2, T2
+            params[0] = z;
+            params[1] = 0.75f * a; // values from TRI2/SP
+            params[2] = tau;
+            params[3] = 0.25f * a;
+            params[4] = 0.6666667f * tau;
+            break;
+        // triple exponential
+        case 3:
+            // params are Z, A1, T1, A2, T2, A3, T3
+            params[0] = z;
+            params[1] = 0.75f * a;
+            params[2] = tau;
+            params[3] = 0.1666667f * a;
+            params[4] = 0.6666667f * tau;
+            params[5] = 0.1666667f * a;
+            params[6] = 0.3333333f * tau;
+            break;
+        // stretched exponential
+        case 4:
+            // params are Z, A, T, H
+            params[0] = z;
+            params[1] = a;
+            params[2] = tau;
+            params[3] = 1.5f;
+            break;
+    }
+}
+
+// Returns the pixel, of the neighbours of pixel p above it and to the
+// left of it in an image with the given number of rows, whose LMA fit is
+// the best one to start the fit of p from, or -1 if neither will do.
+// Both have already been fitted in image order; counts[] is the number
+// of counts in the fit range of each pixel fitted, or -1 if its fit
+// failed, and a fit is only used if its reduced chi square is at most
+// max_chi_sq.
+static int warm_start_neighbour(const double *LMA_param_out, int n_param,
+                                const float *counts, int p, int rows,
+                                float max_chi_sq)
+{
+    int neighbours[2];
+    int best = -1;
+    double chi_sq, best_chi_sq = 0.0;
+    int k, q;
+
+    neighbours[0] = (p % rows > 0) ? p - 1 : -1;  // above
+    neighbours[1] = p - rows;                     // left
+    for (k = 0; k < 2; k++)
+    {
+        q = neighbours[k];
+        if ((q < 0) || (counts[q] <= 0.0f))
+        {
+            continue;
+        }
+        chi_sq = LMA_param_out[(size_t) q * (n_param + 1) + n_param];
+        if ((chi_sq <= max_chi_sq) && ((best < 0) || (chi_sq < best_chi_sq)))
+        {
+            best = q;
+            best_chi_sq = chi_sq;
+        }
+    }
+    return best;
+}
+
 void mexFunction(int nlhs, mxArray *plhs[],
                  int nrhs, const mxArray *prhs[])
 {
@@ -44,8 +199,9 @@ void mexFunction(int nlhs, mxArray *plhs[],
     }
     
     // transient_values:
-    //      A double matrix of size MxN containing transients for a fit.
-    //      The transients must be arranged in columns.
+    //      A double, single, uint16 or uint32 matrix of size MxN
+    //      containing transients for a fit. The transients must be
+    //      arranged in columns. Single transients are fitted in place.
     int transient_size = mxGetM(__transient_values); 
     int transient_nr = mxGetN(__transient_values);
     // Check if the transient_size and transient_nr are positive and double
@@ -57,30 +213,24 @@ void mexFunction(int nlhs, mxArray *plhs[],
                   transient_size);
         return;
     }
-    if (transient_size > 2048)
-    {
-        mexPrintf("transient_values must not have more than 2048 points. "
-                  "You chose transient with %d points.\nTerminating.\n",
-                  transient_size);
-        return;
-    }
     if (transient_nr < 1)
     {
         mexPrintf("transient_values cannot be empty. You chose %d "
                   "number of transients.\nTerminating.\n", transient_nr);
         return;
     }
-    if (!mxIsDouble(__transient_values))
+    if (!is_supported_class(__transient_values))
     {
-        mexPrintf("transient_values must be double. You given: %s\n"
+        mexPrintf("transient_values must be double, single, uint16 or "
+                  "uint32. You given: %s\n"
                   "Terminating.\n", mxGetClassName(__transient_values));
         return;
     }
-    float transient_values[transient_size];
-    double *transient_ptr = mxGetPr(__transient_values);
+    float *transient_values;
 
     // prompt_values:
-    //      A double matrix of size MxN containing prompts for a fit.
+    //      A double, single, uint16 or uint32 matrix of size MxN
+    //      containing prompts for a fit.
     //      There can be either one single prompt for all transients 
     //      arranged in Mx1 matrix or one prompt in an MxN matrix, where
     //      N, the number of columns, is the same as in the transient
@@ -101,18 +251,14 @@ void mexFunction(int nlhs, mxArray *plhs[],
                   "%d prompts.\nTerminating.\n", prompt_nr);
         return;
     }
-    if (!mxIsDouble(__prompt_values))
+    if (!is_supported_class(__prompt_values))
     {
-        mexPrintf("prompt_values must be double. You given: %s\n"
+        mexPrintf("prompt_values must be double, single, uint16 or "
+                  "uint32. You given: %s\n"
                   "Terminating.\n", mxGetClassName(__prompt_values));
         return;
     }
-    float prompt_values[prompt_size];
-    double *prompt_ptr = mxGetPr(__prompt_values);
-    for (i = 0; i < prompt_size; i++)
-    {
-        prompt_values[i] = prompt_ptr[i];
-    }
+    float *prompt_values;
 
     // x_inc:
     //      Float (single) with the time histogram bin size. It can be
@@ -131,7 +277,7 @@ void mexFunction(int nlhs, mxArray *plhs[],
     }
     // Store x_inc a double pointer array
     // check if x_inc is double, otherwise quit with warning
-    if (!mxIsDouble(__transient_values))
+    if (!mxIsDouble(__x_inc))
     {
         mexPrintf("x_inc must be a double. You given: %s\n"
                   "Terminating.\n", mxGetClassName(__x_inc));
@@ -304,7 +450,8 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
 
     // sigma_values (optional):
-    //      A double matrix of size MxN containing standard deviations
+    //      A double, single, uint16 or uint32 matrix of size MxN
+    //      containing standard deviations
     //      for indvidual noise characteristics to each transient point
     //      with noise type "given".
     //      There can be either one single sigma for all transients 
@@ -335,27 +482,139 @@ void mexFunction(int nlhs, mxArray *plhs[],
                       "%d points in a sigma.\nTerminating.\n", sigma_size);
             return;
         }
-        // check if sigma_values are double, otherwise quit with a warning.
-        if (!mxIsDouble(__sigma_values))
+        // check if sigma_values are of a supported class, otherwise quit
+        // with a warning.
+        if (!is_supported_class(__sigma_values))
         {
-            mexPrintf("sigma_values must be double. You given %s\n"
+            mexPrintf("sigma_values must be double, single, uint16 or "
+                      "uint32. You given %s\n"
                       "Terminating.\n", mxGetClassName(__sigma_values));
             return;
         }
     }
-    float sigma_values[sigma_size];
-    double *sigma_ptr;
-    if (nrhs > 9)
+    float *sigma_values;
+
+    // fit_method (optional):
+    //      Integer with values 0 or 1
+    //      0: Marquardt fit of all the parameters (ECF_METHOD_MARQUARDT)
+    //      1: Variable projection; Z and the amplitudes are found by
+    //         linear least squares at each step (ECF_METHOD_VARPRO)
+    int fit_method = 0;
+    if (nrhs > 10)
     {
-        double *sigma_ptr = mxGetPr(__sigma_values);
-        for (i = 0; i < sigma_size; i++)
+        if (mxGetNumberOfElements(__fit_method) != 1)
         {
-            sigma_values[i] = (float) sigma_ptr[i];
+            mexPrintf("fit_method must be a scalar. Your fit_method "
+                      "has got %d elements.\nTerminating.\n",
+                      mxGetNumberOfElements(__fit_method));
+            return;
+        }
+        fit_method = (int) mxGetScalar(__fit_method);
+        // check if fit_method is 0 or 1, otherwise quit with a warning
+        if ((fit_method < 0) | (fit_method > 1))
+        {
+            mexPrintf("fit_method must be 0 or 1. You chose: "
+                      "fit_method = %d\nTerminating.\n", fit_method);
+            return;
+        }
+    }
+
+    // image_size (optional):
+    //      Two integers [rows columns], the size of the image whose
+    //      pixels the transients are, in MATLAB's column order, so that
+    //      rows * columns is the number of transients. The transients are
+    //      then fitted as an image: the LMA fit of each pixel starts from
+    //      the fitted parameters of the neighbour above it or to the left
+    //      of it, if one of them was fitted well, rather than from the
+    //      RLD estimates. Neighbouring pixels usually have similar
+    //      lifetimes, so this needs far fewer iterations.
+    int image_rows = 0;
+    if ((nrhs > 11) && (mxGetNumberOfElements(__image_size) > 0))
+    {
+        if ((mxGetNumberOfElements(__image_size) != 2) ||
+            !mxIsDouble(__image_size))
+        {
+            mexPrintf("image_size must be a double vector of two "
+                      "elements, [rows columns].\nTerminating.\n");
+            return;
+        }
+        double *image_size = mxGetPr(__image_size);
+        image_rows = (int) image_size[0];
+        // check if the image has one pixel per transient, otherwise quit
+        // with a warning
+        if ((image_rows < 1) ||
+            (image_size[0] * image_size[1] != (double) transient_nr))
+        {
+            mexPrintf("image_size must multiply to the number of "
+                      "transients, %d. You chose: image_size = [%g %g]\n"
+                      "Terminating.\n", transient_nr,
+                      image_size[0], image_size[1]);
+            return;
+        }
+    }
+
+    // bin (optional):
+    //      [radius] or [radius shape]. Each transient of an image (see
+    //      image_size) is replaced by the sum of the transients of the
+    //      pixels around it before fitting: for shape 0 (the default),
+    //      the (2 * radius + 1) x (2 * radius + 1) square centred on it,
+    //      for shape 1, the pixels within radius of it. Radius 0 means
+    //      no binning.
+    int bin_radius = 0;
+    ecf_bin_shape bin_shape = ECF_BIN_SQUARE;
+    if ((nrhs > 12) && (mxGetNumberOfElements(__bin) > 0))
+    {
+        if ((mxGetNumberOfElements(__bin) > 2) || !mxIsDouble(__bin))
+        {
+            mexPrintf("bin must be a double vector of one or two "
+                      "elements, [radius shape].\nTerminating.\n");
+            return;
+        }
+        double *bin = mxGetPr(__bin);
+        bin_radius = (int) bin[0];
+        if (mxGetNumberOfElements(__bin) == 2)
+        {
+            bin_shape = (bin[1] == 1) ? ECF_BIN_CIRCLE : ECF_BIN_SQUARE;
+        }
+        // check if the radius is non-negative and there is an image to
+        // bin, otherwise quit with a warning
+        if ((bin_radius < 0) || ((bin_radius > 0) && (image_rows == 0)))
+        {
+            mexPrintf("bin radius must be 0 or more, and image_size must "
+                      "be given to bin. You chose: bin radius = %d\n"
+                      "Terminating.\n", bin_radius);
+            return;
+        }
+    }
+
+    // init_method (optional):
+    //      Integer with values 0 or 1
+    //      0: The LMA fit starts from the RLD fit, split between the
+    //         components of the multiexponential models as in TRI2/SP
+    //      1: The LMA fit starts from estimates of the lifetimes and
+    //         amplitudes made from the phasors of the transient (see
+    //         GCI_phasor_estimates); the RLD fit is then only run if
+    //         its results are asked for, or the phasors give nothing
+    int init_method = 0;
+    if (nrhs > 13)
+    {
+        if (mxGetNumberOfElements(__init_method) != 1)
+        {
+            mexPrintf("init_method must be a scalar. Your init_method "
+                      "has got %d elements.\nTerminating.\n",
+                      mxGetNumberOfElements(__init_method));
+            return;
+        }
+        init_method = (int) mxGetScalar(__init_method);
+        // check if init_method is 0 or 1, otherwise quit with a warning
+        if ((init_method < 0) | (init_method > 1))
+        {
+            mexPrintf("init_method must be 0 or 1. You chose: "
+                      "init_method = %d\nTerminating.\n", init_method);
+            return;
         }
     }
 
-    /**************************/
-    /*      Perform fits      */
     /**************************/
     int fits;               // Counting index of the fit
     float a, tau, z;        // Return values for RLD fit
@@ -375,8 +634,12 @@ void mexFunction(int nlhs, mxArray *plhs[],
     int n_param_free;   // Number of free parameters
     int restrain;       // Limits for fit parameters (not used)
     int chi_sq_percent; // (not sue about function)
-    int n_data;         // number of points in a transient
     int return_value;   // return value from fitting functions
+    int seed;           // Neighbour the LMA fit starts from, or -1
+    float start[7];     // Initial estimates of the LMA fit, at most
+                        // n_param = 7 of them
+    int from_phasor;    // Whether they come from the phasors
+    float counts;       // Counts in the fit range of the transient
 
     // Fitting function for the noise model
     void (*fitfunc)(float, float [], float *, float[], int) = NULL;
@@ -412,6 +675,102 @@ void mexFunction(int nlhs, mxArray *plhs[],
     // param_free array describes which params are free vs fixed (omits X2)
     param_free = (int *)malloc((size_t) n_param  * sizeof(int));
 
+    // The covariance, curvature and error axes matrices of the LMA fit
+    // only ever hold the n_param x n_param values of the free
+    // parameters, and the workspace holds the scratch arrays of both
+    // fits, so all of them are allocated once and reused for every
+    // transient.
+    float **covar    = GCI_ecf_matrix(n_param, n_param);
+    float **alpha    = GCI_ecf_matrix(n_param, n_param);
+    float **err_axes = GCI_ecf_matrix(n_param, n_param);
+    ecf_workspace *ws = GCI_ecf_workspace(transient_size, n_param);
+
+    // Buffers for the inputs that are not single and so must be
+    // converted; on the heap, as the transients may be of any length
+    float *transient_buffer =
+            (float *)malloc((size_t)transient_size * sizeof(float));
+    float *prompt_buffer =
+            (float *)malloc((size_t)prompt_size * sizeof(float));
+    float *sigma_buffer =
+            (float *)malloc((size_t)(sigma_size > 0 ? sigma_size : 1) *
+                            sizeof(float));
+    // Counts of each pixel fitted, to scale the amplitudes of the
+    // neighbours' fits by when fitting an image
+    float *pixel_counts =
+            (float *)malloc((size_t)(image_rows > 0 ? transient_nr : 1) *
+                            sizeof(float));
+    // The binned image, and a single copy of the image to bin it from if
+    // it is not single already
+    float *binned = NULL;
+    float *image_buffer = NULL;
+    if (bin_radius > 0)
+    {
+        binned = (float *)malloc((size_t)transient_size * transient_nr *
+                                 sizeof(float));
+        if (mxGetClassID(__transient_values) != mxSINGLE_CLASS)
+        {
+            image_buffer = (float *)malloc((size_t)transient_size *
+                                           transient_nr * sizeof(float));
+        }
+    }
+    if ((fitted == NULL) || (residuals == NULL) || (params == NULL) ||
+        (param_free == NULL) || (covar == NULL) || (alpha == NULL) ||
+        (err_axes == NULL) || (ws == NULL) || (transient_buffer == NULL) ||
+        (prompt_buffer == NULL) || (sigma_buffer == NULL) ||
+        (pixel_counts == NULL) || ((bin_radius > 0) && ((binned == NULL) ||
+        ((image_buffer == NULL) &&
+         (mxGetClassID(__transient_values) != mxSINGLE_CLASS)))))
+    {
+        mexPrintf("Out of memory.\nTerminating.\n");
+        free(params);
+        free(param_free);
+        free(fitted);
+        free(residuals);
+        GCI_ecf_free_matrix(covar);
+        GCI_ecf_free_matrix(alpha);
+        GCI_ecf_free_matrix(err_axes);
+        GCI_ecf_free_workspace(ws);
+        free(transient_buffer);
+        free(prompt_buffer);
+        free(sigma_buffer);
+        free(pixel_counts);
+        free(binned);
+        free(image_buffer);
+        return;
+    }
+    GCI_ecf_set_workspace_method(ws, fit_method == 1 ?
+                                 ECF_METHOD_VARPRO : ECF_METHOD_MARQUARDT);
+
+    // Bin the image, all at once, before fitting any of it
+    if (bin_radius > 0)
+    {
+        float *image = (float *) mxGetData(__transient_values);
+        if (image_buffer != NULL)
+        {
+            for (fits = 0; fits < transient_nr; fits++)
+            {
+                get_column(__transient_values, transient_size, fits,
+                           image_buffer + (size_t)transient_size * fits);
+            }
+            image = image_buffer;
+        }
+        GCI_ecf_bin_image(image, transient_size, image_rows,
+                          transient_nr / image_rows, bin_radius, bin_shape,
+                          binned);
+        free(image_buffer);
+        image_buffer = NULL;
+    }
+
+    // The first prompt and sigma, which may be all there are
+    prompt_values =
+            get_column(__prompt_values, prompt_size, 0, prompt_buffer);
+    sigma_values = sigma_buffer;
+    if ((sigma_size > 0) && (sigma_nr > 0))
+    {
+        sigma_values =
+                get_column(__sigma_values, sigma_size, 0, sigma_buffer);
+    }
+
     /* Create output pointers */
     // LMA fit parameters
     double *LMA_param_out;
@@ -453,33 +812,33 @@ void mexFunction(int nlhs, mxArray *plhs[],
     // Run a fitting loop for each transient
     for (fits = 0; fits < transient_nr; fits++)
     {
-        // Feed data into "transient_values" array
-        for (i = 0; i < transient_size; i++)
+        // Point "transient_values" at the transient, converting it into
+        // "transient_buffer" unless it is single or binned
+        if (binned != NULL)
         {
-            transient_values[i] = 
-                    (float) transient_ptr[i + transient_size * fits];
+            transient_values = binned + (size_t)transient_size * fits;
+        }
+        else
+        {
+            transient_values = get_column(__transient_values,
+                                          transient_size, fits,
+                                          transient_buffer);
         }
         if (fits > 0)
         {
             // If each transient comes with a different prompt ...
             if (prompt_nr > 1)
             {
-                // ... feed new data into "prompt_values" array
-                for (i = 0; i < prompt_size; i++)
-                {
-                    prompt_values[i] = 
-                            (float) prompt_ptr[i + prompt_size * fits];
-                }
+                // ... point "prompt_values" at the new prompt
+                prompt_values = get_column(__prompt_values, prompt_size,
+                                           fits, prompt_buffer);
             }
             // If each transient comes with a different sigma ...
-            if (sigma_nr > 1)
+            if ((sigma_nr > 1) && (sigma_size > 0))
             {
-                // ... feed new data into "simga_values" array
-                for (i = 0; i < sigma_size; i++)
-                {
-                    sigma_values[i] = 
-                            (float) sigma_ptr[i + sigma_size * fits];
-                }
+                // ... point "sigma_values" at the new sigma
+                sigma_values = get_column(__sigma_values, sigma_size,
+                                          fits, sigma_buffer);
             }
             // If each transient comes with a x_inc ...
             if (x_inc_nr > 1)
@@ -493,12 +852,6 @@ void mexFunction(int nlhs, mxArray *plhs[],
 
         restrain = 0;           // Reset to starting values
         chi_sq_percent = 95;    // Reset to starting values
-        n_data = fit_end;       // Reset to starting values
-
-        // I am not sure what is going on here.
-        float **covar    = GCI_ecf_matrix(n_data, n_data);
-        float **alpha    = GCI_ecf_matrix(n_data, n_data);
-        float **err_axes = GCI_ecf_matrix(n_data, n_data);
 
         // blind initial estimates as in TRI2/SP
         a = 1000.0f;
@@ -508,91 +861,106 @@ void mexFunction(int nlhs, mxArray *plhs[],
         // want non-reduced chi square target
         chi_sq_adjust = fit_end - fit_start - 3;
 
-        // for RLD+LMA fits TRI2/SP adjusts as follows for initial RLD fit:
-        //  fit_start becomes index of peak of transient
-        //  estimated A becomes value at peak
-        //  noise becomes NOISE_POISSON_FIT
-
-        // Run RLD fitting routine
-        return_value = GCI_triple_integral_fitting_engine(
-                        x_inc,
-                        transient_values,
-                        fit_start,
-                        fit_end,
-                        prompt_values,
-                        prompt_size,
-                        noise_model,
-                        sigma_values,
-                        &z,
-                        &a,
-                        &tau,
-                        fitted,
-                        residuals,
-                        &chi_square,
-                        chi_sq_target * chi_sq_adjust
-                        );
-
-        // If the parameters of RLD fit are requested, fill up the output
-        // array.
-        if (nlhs > 1)
-        {
-            RLD_param_out[RLD_param_in] = (double) z; RLD_param_in++;
-            RLD_param_out[RLD_param_in] = (double) a; RLD_param_in++;
-            RLD_param_out[RLD_param_in] = (double) tau; RLD_param_in++;
-        }
-
-        // If the RLD fit is requested, fill up the output array.
-        if (nlhs > 3)
+        // With init_method 1 the LMA fit starts from the phasor
+        // estimates, and the RLD fit is only needed for its results or
+        // if there are none; the stretched exponential takes the single
+        // exponential estimates
+        from_phasor = (init_method == 1) &&
+                (GCI_phasor_estimates(x_inc, transient_values, fit_start,
+                                      fit_end, prompt_values, prompt_size,
+                                      start, (fit_type == 4) ? 3 : n_param)
+                 >= 0);
+
+        if (!from_phasor || (nlhs > 1))
         {
-            for (i = 0; i < transient_size; i++)
+            // for RLD+LMA fits TRI2/SP adjusts as follows for initial RLD
+            // fit:
+            //  fit_start becomes index of peak of transient
+            //  estimated A becomes value at peak
+            //  noise becomes NOISE_POISSON_FIT
+
+            // Run RLD fitting routine
+            return_value = GCI_triple_integral_fitting_engine_ws(
+                            ws,
+                            x_inc,
+                            transient_values,
+                            fit_start,
+                            fit_end,
+                            prompt_values,
+                            prompt_size,
+                            noise_model,
+                            sigma_values,
+                            &z,
+                            &a,
+                            &tau,
+                            fitted,
+                            residuals,
+                            &chi_square,
+                            chi_sq_target * chi_sq_adjust
+                            );
+
+            // If the parameters of RLD fit are requested, fill up the
+            // output array.
+            if (nlhs > 1)
             {
-                RLD_fitted_out[RLD_fitted_in] = (double) fitted[i];
-                RLD_fitted_in++;
+                RLD_param_out[RLD_param_in] = (double) z; RLD_param_in++;
+                RLD_param_out[RLD_param_in] = (double) a; RLD_param_in++;
+                RLD_param_out[RLD_param_in] = (double) tau; RLD_param_in++;
+            }
+
+            // If the RLD fit is requested, fill up the output array.
+            if (nlhs > 3)
+            {
+                for (i = 0; i < transient_size; i++)
+                {
+                    RLD_fitted_out[RLD_fitted_in] = (double) fitted[i];
+                    RLD_fitted_in++;
+                }
             }
         }
 
         // adjust single exponential estimates for multiple exponential
         // fits.
         fitfunc = GCI_multiexp_tau;
-        switch (fit_type) {
-            // single exponential
-            case 1:
-                // params are Z, A, T
-                params[0] = z;
-                params[1] = a;
-                params[2] = tau;
-                break;
-            // double exponential
-            case 2:
-                // params are Z, A1, T1, A2, T2
-                params[0] = z;
-                params[1] = 0.75f * a; // values from TRI2/SP
-                params[2] = tau;
-                params[3] = 0.25f * a;
-                params[4] = 0.6666667f * tau;
-                break;
-            // triple exponential
-            case 3:
-                // params are Z, A1, T1, A2, T2, A3, T3
-                params[0] = z;
-                params[1] = 0.75f * a;
-                params[2] = tau;
-                params[3] = 0.1666667f * a;
-                params[4] = 0.6666667f * tau;
-                params[5] = 0.1666667f * a;
-                params[6] = 0.3333333f * tau;
-                break;
-            // stretched exponential
-            case 4:
-                // has it's own fitfunc
-                // fitfunc = GCI_stretchedexp;
-
-                // params are Z, A, T, H
-                params[0] = z;
-                params[1] = a;
-                params[2] = tau;
-                params[3] = 1.5f;
-                break;
+        if (!from_phasor)
+        {
+            rld_estimates(fit_type, z, a, tau, start);
+        }
+        else if (fit_type == 4)
+        {
+            start[3] = 1.5f;  // as rld_estimates()
+        }
+        memcpy(params, start, (size_t) n_param * sizeof(float));
+
+        // When fitting an image, start from a neighbour's fit if there
+        // is a good one, with its amplitudes scaled to this pixel's
+        // counts
+        seed = -1;
+        if (image_rows > 0)
+        {
+            counts = 0.0f;
+            for (i = fit_start; i < fit_end; i++)
+            {
+                counts += transient_values[i];
+            }
+            seed = warm_start_neighbour(LMA_param_out, n_param,
+                                        pixel_counts, fits, image_rows,
+                                        WARM_START_CHI_SQ_FACTOR *
+                                        chi_sq_target);
+        }
+        if (seed >= 0)
+        {
+            for (i = 0; i < n_param; i++)
+            {
+                params[i] = (float) LMA_param_out[
+                        (size_t) seed * (n_param + 1) + i];
+            }
+            // the amplitudes are every other parameter from A1, but the
+            // stretched exponential only has the one
+            for (i = 1; i < (fit_type == 4 ? 2 : n_param); i += 2)
+            {
+                params[i] *= counts / pixel_counts[seed];
+            }
         }
 
         // Make sure all parameters are free in the fit
@@ -605,30 +973,47 @@ void mexFunction(int nlhs, mxArray *plhs[],
         chi_sq_adjust = fit_end - fit_start - n_param_free;
 
         // Run LMA fitting routine
-        return_value = GCI_marquardt_fitting_engine(
-                                            x_inc,
-                                            transient_values,
-                                            transient_size,
-                                            fit_start,
-                                            fit_end,
-                                            prompt_values,
-                                            prompt_size,
-                                            noise_model,
-                                            sigma_values,
-                                            params,
-                                            param_free,
-                                            n_param,
-                                            restrain,
-                                            fitfunc,
-                                            fitted,
-                                            residuals,
-                                            &chi_square,
-                                            covar,
-                                            alpha,
-                                            err_axes,
-                                            chi_sq_target * chi_sq_adjust,
-                                            chi_sq_delta,
-                                            chi_sq_percent);
+        for (;;)
+        {
+            return_value = GCI_marquardt_fitting_engine_ws(
+                                                ws,
+                                                x_inc,
+                                                transient_values,
+                                                transient_size,
+                                                fit_start,
+                                                fit_end,
+                                                prompt_values,
+                                                prompt_size,
+                                                noise_model,
+                                                sigma_values,
+                                                params,
+                                                param_free,
+                                                n_param,
+                                                restrain,
+                                                fitfunc,
+                                                fitted,
+                                                residuals,
+                                                &chi_square,
+                                                covar,
+                                                alpha,
+                                                err_axes,
+                                                chi_sq_target * chi_sq_adjust,
+                                                chi_sq_delta,
+                                                chi_sq_percent);
+
+            // A fit from a neighbour's parameters which fails is tried
+            // again from the RLD or phasor estimates
+            if ((return_value >= 0) || (seed < 0))
+            {
+                break;
+            }
+            seed = -1;
+            memcpy(params, start, (size_t) n_param * sizeof(float));
+        }
+        if (image_rows > 0)
+        {
+            pixel_counts[fits] = (return_value >= 0) ? counts : -1.0f;
+        }
 
         // Fill up the ouput array with the fit parameters
         for (i = 0; i < n_param; i++)
@@ -649,17 +1034,22 @@ void mexFunction(int nlhs, mxArray *plhs[],
                 LMA_fitted_in++;
             }
         }
-            
-        // Not sure what is going on here
-        GCI_ecf_free_matrix(covar);
-        GCI_ecf_free_matrix(alpha);
-        GCI_ecf_free_matrix(err_axes);
     }
 
     // Free memory to prevent leaks
     free(params);
+    free(param_free);
     free(fitted);
     free(residuals);
+    GCI_ecf_free_matrix(covar);
+    GCI_ecf_free_matrix(alpha);
+    GCI_ecf_free_matrix(err_axes);
+    GCI_ecf_free_workspace(ws);
+    free(transient_buffer);
+    free(prompt_buffer);
+    free(sigma_buffer);
+    free(pixel_counts);
+    free(binned);
 
     // That's it!
     return;
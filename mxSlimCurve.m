@@ -5,7 +5,11 @@
 %   contains a single or multiple TCSPC decay curves from the start of the 
 %   transient to its end. For a single decay TRANSIENT must be in a column
 %   vector Mx1, for N different decays it must be an array shape of MxN
-%   elements. M are the number of micro time bins in each transient. PROMPT
+%   elements. M are the number of micro time bins in each transient.
+%   TRANSIENT may be double, single, uint16 or uint32; single data is
+%   fitted in place without a copy, so it is the most economical class
+%   for large image stacks. The same classes are accepted for PROMPT and
+%   SIGMA_VALUES. PROMPT
 %   is a normalized instrument response function, i.e. sum(PROMPT) == 1;
 %   There may be a single prompt for all decays in a Px1 column vector or
 %   each decay may have its own prompt in an PxN array. X_INC is the micro
@@ -79,6 +83,64 @@
 %   single sigma array for all decays in a Px1 column vector or each decay
 %   may have have its own sigma array in an PxN array.
 %
+%   LMA_PARAM = MXSLIMCURVE(TRANSIENT, PROMPT, X_INC, FIT_START, ...
+%                           FIT_TYPE, NOISE_MODEL, CHI_SQ_TARGET, ...
+%                           CHI_SQ_DELTA, FIT_END, SIGMA_VALUES, ...
+%                           FIT_METHOD) By default the Marquardt-Levenberg
+%   Algorithm iterates over all the parameters. Choose FIT_METHOD = 1 for
+%   variable projection, where only the lifetimes are iterated and Z and
+%   the amplitudes are found by linear least squares at each step. This
+%   needs fewer iterations for the multiexponential models and is less
+%   sensitive to poor starting values. It is not used with NOISE_MLE.
+%       0: Marquardt-Levenberg Algorithm
+%       1: Variable projection
+%
+%   LMA_PARAM = MXSLIMCURVE(TRANSIENT, PROMPT, X_INC, FIT_START, ...
+%                           FIT_TYPE, NOISE_MODEL, CHI_SQ_TARGET, ...
+%                           CHI_SQ_DELTA, FIT_END, SIGMA_VALUES, ...
+%                           FIT_METHOD, IMAGE_SIZE) When the decays are the
+%   pixels of an image, reshaped into columns with TRANSIENT(:, :), give
+%   the size of the image as IMAGE_SIZE = [ROWS COLUMNS]. The pixels are
+%   then fitted in order, and each fit starts from the fitted parameters
+%   of the pixel above it or to the left of it, with the amplitudes scaled
+%   to its photon count, rather than from the Rapid Lifetime
+%   Determination estimates. A neighbour's fit is only used if its chi^2
+%   is at most twice CHI_SQ_TARGET; if no neighbour qualifies, or if the
+%   fit from it fails, the pixel is fitted from the RLD estimates as
+%   usual. Neighbouring pixels mostly have similar lifetimes, so this
+%   needs fewer iterations, most of all with the multiexponential models.
+%   The default, [], fits every decay independently.
+%
+%   LMA_PARAM = MXSLIMCURVE(TRANSIENT, PROMPT, X_INC, FIT_START, ...
+%                           FIT_TYPE, NOISE_MODEL, CHI_SQ_TARGET, ...
+%                           CHI_SQ_DELTA, FIT_END, SIGMA_VALUES, ...
+%                           FIT_METHOD, IMAGE_SIZE, BIN) Bins the image
+%   before fitting it, replacing each decay by the sum of the decays of
+%   the pixels around it. BIN = RADIUS sums the (2 * RADIUS + 1) x
+%   (2 * RADIUS + 1) square of pixels centred on each one, and
+%   BIN = [RADIUS 1] the pixels within RADIUS of it. The bins are cut off
+%   at the edges of the image. This is done in C with summed-area tables,
+%   so it takes the same time whatever the radius, and is much faster
+%   than binning in MATLAB. IMAGE_SIZE must be given. The default, 0,
+%   does not bin.
+%
+%   LMA_PARAM = MXSLIMCURVE(TRANSIENT, PROMPT, X_INC, FIT_START, ...
+%                           FIT_TYPE, NOISE_MODEL, CHI_SQ_TARGET, ...
+%                           CHI_SQ_DELTA, FIT_END, SIGMA_VALUES, ...
+%                           FIT_METHOD, IMAGE_SIZE, BIN, INIT_METHOD)
+%   By default the LMA fit starts from the RLD fit, with the amplitude
+%   and lifetime split between the components of the multiexponential
+%   models in fixed ratios. Choose INIT_METHOD = 1 to start it from
+%   estimates made from the phasors of the decay between FIT_START and
+%   FIT_END instead: for the double and triple exponential models the
+%   two lifetimes are where the line through the decay's phasor cuts the
+%   semicircle of single exponentials, found from the first two
+%   harmonics. This costs less than the RLD fit, which is then only run
+%   if RLD_PARAM or RLD_FIT is asked for or the phasors give no
+%   estimates, and the LMA fit mostly needs fewer iterations.
+%       0: Rapid Lifetime Determination
+%       1: Phasors
+%
 %   [LMA_PARAM, RLD_PARAM, LMA_FIT, RLD_FIT] = ...
 %       MXSLIMCURVE(TRANSIENT, PROMPT, X_INC, FIT_START) RLD_param provides
 %   the fitted parameters based on Rapid Lifetime Determination in the form